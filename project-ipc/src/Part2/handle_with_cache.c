@@ -2,23 +2,56 @@
 #include <curl/curl.h>
 #include <sys/fcntl.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <unistd.h>
+#include <time.h>
 #include <string.h>
-#include <semaphore.h>
-#include <mqueue.h>
 
 #include "gfserver.h"
 #include "shm_channel.h"
+#include "probe.h"
+#include "stats.h"
+
+// counters published for gfstat
+#define STAT_REQUESTS 0
+#define STAT_OK 1
+#define STAT_NOT_FOUND 2
+#define STAT_BYTES 3
+#define STAT_SEGMENT_WAITS 4
+#define STAT_RESIDENT 5
+
+static const char *stat_names[] = {"requests", "ok", "not_found", "bytes", "segment_waits", "resident"};
 
 int num_seqments;
 size_t region_size;
 steque_t shm_queue;
 
-mqd_t msg_queue;
+// every segment, mapped once by cache_init and found by its index
+shm_seg **segments;
+
+// requests to simplecached, one at most per segment
+shm_ring *request_ring;
 
 pthread_mutex_t shm_queue_mtx;
 pthread_cond_t shm_queue_cond;
 
+// a read only mapping of the arena of resident files of one simplecached,
+// unmapped once it is neither current nor being sent from
+typedef struct arena_map {
+    pid_t owner;
+    const char *base;
+    size_t size;
+    int refs;
+} arena_map;
+
+// the arena of the current simplecached, mapped when first needed and
+// replaced should simplecached be restarted.  It holds a reference of
+// its own, and arena_mtx guards it and every reference count
+pthread_mutex_t arena_mtx = PTHREAD_MUTEX_INITIALIZER;
+arena_map *arena;
+
+static void arena_release_locked(arena_map *map);
+
 /**
  * Method for cleaning up all cache constructions
  */
@@ -34,13 +67,35 @@ void cache_cleanup() {
 
     // free up all shared memory
     for (long i = 0; i < num_seqments; i++) {
-        sprintf(shm_name, "/proxy_cache_%ld", i);
+        sprintf(shm_name, SHM_NAME_FORMAT, i);
         shm_unlink(shm_name);
+        if (segments != NULL && segments[i] != NULL)
+            munmap(segments[i], region_size);
     }
+    free(segments);
+    segments = NULL;
+
+    // let go of the arena, simplecached unlinks it
+    pthread_mutex_lock(&arena_mtx);
+    if (arena != NULL)
+        arena_release_locked(arena);
+    arena = NULL;
+    pthread_mutex_unlock(&arena_mtx);
+
+    // clean up request ring
+    shm_unlink(SHM_RING_NAME);
+    shm_ring_unmap(request_ring);
+    request_ring = NULL;
+}
 
-    // clean up message queue
-    mq_unlink(MQ_NAME);
-    close(msg_queue);
+/**
+ * Returns the microseconds since an earlier call
+ */
+static int64_t elapsed_us(struct timespec *since) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000LL + (now.tv_nsec - since->tv_nsec) / 1000;
 }
 
 /**
@@ -51,58 +106,111 @@ void cache_init(int nsegments, int size_seg) {
     cache_cleanup();
 
     num_seqments = nsegments;
-    int shm_fd;
 
-    // build share memory name and size
-    char shm_name[MAX_CACHE_REQUEST_LEN];
-    region_size = sizeof(shm_seg) + size_seg;
+    // build share memory size, the data area is split into ring slots
+    size_t slot_size = (size_seg / SHM_RING_SLOTS) & ~(size_t) 63;
+    if (slot_size == 0)
+        slot_size = 64;
+    region_size = sizeof(shm_seg) + SHM_RING_SLOTS * slot_size;
 
     // initialize steque
     steque_init(&shm_queue);
 
-    // create shared memory to be used
+    // create and map shared memory to be used, kept mapped for every request
+    segments = calloc(nsegments, sizeof(shm_seg *));
     for (long i = 0; i < nsegments; i++) {
-        // create shared memory name with correct id number
-        sprintf(shm_name, "/proxy_cache_%ld", i);
-
-        // unlink in case left over then open share memory file descriptor
-        if ((shm_fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0666)) < 0)
-            error_and_die("Cache init failed, shm_open");
+        if ((segments[i] = shm_channel_map(i, 1, &region_size)) == NULL)
+            error_and_die("Cache init failed, shm segment");
+        segments[i]->slot_size = slot_size;
 
-        // allocate memory necessary for share memory file
-        if ((ftruncate(shm_fd, (off_t) region_size)) < 0)
-            error_and_die("Cache init failed, ftruncate");
-
-        // map shared memory
-        void *shm_pointer = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-        if (shm_pointer == MAP_FAILED)
-            error_and_die("Cache init failed, mmap");
-
-        // push newly created shared memory to queue and close file descriptor
+        // push newly created shared memory to queue
         steque_push(&shm_queue, (steque_item) i);
-        close(shm_fd);
     }
 
     pthread_mutex_init(&shm_queue_mtx, NULL);
     pthread_cond_init(&shm_queue_cond, NULL);
 
-    // set message queue attributes
-    struct mq_attr msg_queue_attr;
-    msg_queue_attr.mq_flags = 0;
-    msg_queue_attr.mq_maxmsg = MAX_MSG_NUM;
-    msg_queue_attr.mq_msgsize = MAX_MSG_SIZE;
-    msg_queue_attr.mq_curmsgs = 0;
-
-    // clean up and attempt to open message queue
-    msg_queue = mq_open(MQ_NAME, O_CREAT | O_WRONLY, 0644, &msg_queue_attr);
-    if (msg_queue < 0)
-        error_and_die("Cache init failed, message queue open");
+    // a request holds its segment until the reply is sent, so a ring with
+    // a cell per segment never fills.  simplecached waits for it to appear
+    // and then maps the segments, so it goes last
+    if ((request_ring = shm_ring_map(1, (uint32_t) nsegments)) == NULL)
+        error_and_die("Cache init failed, request ring");
+
+    // statistics are a convenience, run without them if need be
+    if (stats_init("webproxy", stat_names, sizeof(stat_names) / sizeof(stat_names[0])) < 0)
+        perror("Cache init could not publish statistics");
+}
+
+/**
+ * Drops a reference to an arena mapping, unmapping it with the last one.
+ * Caller holds arena_mtx.
+ */
+static void arena_release_locked(arena_map *map) {
+    if (--map->refs > 0)
+        return;
+    munmap((void *) map->base, map->size);
+    free(map);
+}
+
+/**
+ * Drops the reference arena_acquire took once the send from it is done
+ */
+static void arena_release(arena_map *map) {
+    pthread_mutex_lock(&arena_mtx);
+    arena_release_locked(map);
+    pthread_mutex_unlock(&arena_mtx);
+}
+
+/**
+ * Returns a reference to the arena of simplecached owner, mapping it if
+ * need be, or NULL if that simplecached is gone and its arena with it
+ */
+static arena_map *arena_acquire(pid_t owner) {
+    arena_map *mapped;
+
+    pthread_mutex_lock(&arena_mtx);
+    if (arena == NULL || arena->owner != owner) {
+        mapped = malloc(sizeof(arena_map));
+        if (mapped == NULL || (mapped->base = shm_arena_map(0, &mapped->size)) == NULL)
+            error_and_die("Handler unable to map arena");
+
+        // the name may already belong to a newer simplecached
+        mapped->owner = *(const pid_t *) mapped->base;
+        if (mapped->owner != owner) {
+            munmap((void *) mapped->base, mapped->size);
+            free(mapped);
+            pthread_mutex_unlock(&arena_mtx);
+            return NULL;
+        }
+
+        // the previous arena goes once the sends from it are done
+        mapped->refs = 1;
+        if (arena != NULL)
+            arena_release_locked(arena);
+        arena = mapped;
+    }
+    arena->refs++;
+    mapped = arena;
+    pthread_mutex_unlock(&arena_mtx);
+    return mapped;
+}
+
+/**
+ * Aborts the transfer of a client that went away, failing only its own
+ * request rather than the proxy.  Returns -1 for the handler to return
+ */
+static ssize_t abort_transfer(gfcontext_t *ctx, struct timespec *started) {
+    shutdown(ctx->socket, SHUT_RDWR);
+    stats_latency(elapsed_us(started));
+    return -1;
 }
 
 /**
  * Replaces share memory segment on queue when finished using
  */
 void enqueue_segment(long shm_id) {
+    PROBE(webproxy, segment_release, shm_id);
+
     // lock mutex and add back segment
     pthread_mutex_lock(&shm_queue_mtx);
     steque_enqueue(&shm_queue, (steque_item) shm_id);
@@ -119,82 +227,109 @@ void enqueue_segment(long shm_id) {
 ssize_t handle_with_cache(gfcontext_t *ctx, char *path, void* arg) {
     size_t bytes_transferred = 0;
     ssize_t bytes_written;
-    char buffer[region_size];
+    struct timespec started;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    stats_add(STAT_REQUESTS, 1);
+
+    // a path that doesn't fit in a request can't be in the cache
+    if (strlen(path) >= MAX_CACHE_REQUEST_LEN) {
+        stats_add(STAT_NOT_FOUND, 1);
+        return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+    }
 
     // lock and check queue, signal waiting
     pthread_mutex_lock(&shm_queue_mtx);
+    if (steque_isempty(&shm_queue))
+        stats_add(STAT_SEGMENT_WAITS, 1);
     while(steque_isempty(&shm_queue))
         pthread_cond_wait(&shm_queue_cond, &shm_queue_mtx);
 
     // pop next segment from queue then unlock mutex
     long shm_id = (long) steque_pop(&shm_queue);
     pthread_mutex_unlock(&shm_queue_mtx);
+    PROBE(webproxy, segment_acquire, shm_id, path);
 
-    // extract shared memory name
-    char shm_name[MAX_CACHE_REQUEST_LEN] = {0};
-    if (sprintf(shm_name, "proxy_cache_%ld", shm_id) < 0)
-        error_and_die("Handler failed to extract shm ID");
-
-    // open shared memory
-    int shm_fd = shm_open(shm_name, O_RDWR, 0);
-    if (shm_fd == -1)
-        error_and_die("Handler failed to open shm");
-
-    // access shared memory when received and close file descriptor
-    shm_seg *shm_pointer;
-    shm_pointer = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if (shm_pointer == MAP_FAILED)
-        error_and_die("Hanlder failed, mmap");
-    close(shm_fd);
-
-    // initialize share memory semaphores for synchronization, instead of message queues :)
-    if ((sem_init(&shm_pointer->cache_sem, 1, 0) == -1) ||
-            (sem_init(&shm_pointer->proxy_sem, 1, 0) == -1))
-        error_and_die("Handler semaphores not initialized");
-
-    // message simplecached
-    char message[MAX_MSG_SIZE] = {0};
-    sprintf(message, "Request: %ld %zu %s", shm_id, region_size, path);
-    if (mq_send(msg_queue, message, strlen(message), 0) < 0)
-        error_and_die("Handler failed to send message");
-
-    // wait for semaphore to unlock from simplecache
-    if (sem_wait(&shm_pointer->proxy_sem) == -1)
-        error_and_die("Handler unable to lock semaphore");
+    // the segment was mapped once by cache_init
+    shm_seg *shm_pointer = segments[shm_id];
+
+    // reset the events for this transfer, every slot starts out free so
+    // the cache can fill ahead of us
+    memset(&shm_pointer->answered, 0, sizeof(shm_event));
+    memset(&shm_pointer->head, 0, sizeof(shm_event));
+    memset(&shm_pointer->tail, 0, sizeof(shm_event));
+
+    // ask simplecached for the file
+    if (shm_ring_push(request_ring, shm_id, path) < 0)
+        error_and_die("Handler failed to send request");
+
+    // wait for simplecache to look the file up
+    shm_event_wait(&shm_pointer->answered, 0);
 
     // if no file then return not found
     if (shm_pointer->file_size <= 0) {
         enqueue_segment(shm_id);
+        stats_add(STAT_NOT_FOUND, 1);
+        stats_latency(elapsed_us(&started));
         // EXTRA CREDIT - HANDLE WITH CURL
         return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
     }
 
+    // resident files are sent straight from the arena, they never change
+    // so the segment can go back before the send
+    if (shm_pointer->arena_offset >= 0) {
+        ssize_t file_size = shm_pointer->file_size;
+        ssize_t offset = shm_pointer->arena_offset;
+        arena_map *map = arena_acquire(shm_pointer->arena_owner);
+        enqueue_segment(shm_id);
+        if (map == NULL) {
+            stats_latency(elapsed_us(&started));
+            return gfs_sendheader(ctx, GF_ERROR, 0);
+        }
+        if (offset < SHM_ARENA_ALIGN || (size_t) (offset + file_size) > map->size)
+            error_and_die("Handler got a file outside the arena");
+
+        bytes_written = gfs_sendheader(ctx, GF_OK, (size_t) file_size) < 0 ? -1 :
+                gfs_send(ctx, (void *) (map->base + offset), (size_t) file_size);
+        arena_release(map);
+        if (bytes_written != file_size)
+            return abort_transfer(ctx, &started);
+
+        stats_add(STAT_OK, 1);
+        stats_add(STAT_RESIDENT, 1);
+        stats_add(STAT_BYTES, bytes_written);
+        stats_latency(elapsed_us(&started));
+        return bytes_written;
+    }
+
     // send ok header and start file transfer process
-    gfs_sendheader(ctx, GF_OK, (size_t) shm_pointer->file_size);
+    int failed = gfs_sendheader(ctx, GF_OK, (size_t) shm_pointer->file_size) < 0;
     while (bytes_transferred < shm_pointer->file_size){
+        uint32_t tail = shm_pointer->tail.seq;
 
-        // inform simplecache to write more
-        if (sem_post(&shm_pointer->cache_sem) == -1)
-            error_and_die("Handler failed to request data");
-            
-        // wait for cache to write data
-        if (sem_wait(&shm_pointer->proxy_sem) == -1)
-            error_and_die("Handler failed to recieve data");
+        // wait for cache to fill the next slot
+        shm_event_wait(&shm_pointer->head, tail);
 
-        // set memory for local buffer and copy over shared buffer
-        memset(buffer, 0, sizeof(buffer));
-        memcpy(buffer, &shm_pointer->buffer, shm_pointer->bytes_sent);
+        // send straight from the slot, the cache leaves it alone until it
+        // is handed back.  Once the client is gone the rest is drained
+        // unsent, simplecached writes to the segment until the file ends
+        size_t slot_len = shm_pointer->slot_len[tail % SHM_RING_SLOTS];
+        if (!failed && gfs_send(ctx, SHM_SLOT(shm_pointer, tail), slot_len) != slot_len)
+            failed = 1;
 
-        // attempt to write the file and check to ensure it was successful
-        bytes_written = gfs_send(ctx, buffer, (size_t) shm_pointer->bytes_sent);
-        if (bytes_written != shm_pointer->bytes_sent)
-            error_and_die("Handler write error");
+        // hand the slot back to simplecache to write more
+        shm_event_signal(&shm_pointer->tail, tail + 1);
 
         // update the bytes transferred
-        bytes_transferred += bytes_written;
+        bytes_transferred += slot_len;
     }
 
     // clean up handler and return
     enqueue_segment(shm_id);
+    if (failed)
+        return abort_transfer(ctx, &started);
+    stats_add(STAT_OK, 1);
+    stats_add(STAT_BYTES, bytes_transferred);
+    stats_latency(elapsed_us(&started));
     return bytes_transferred;
 }
@@ -0,0 +1,80 @@
+#ifndef __GF_PROBE_H__
+#define __GF_PROBE_H__
+
+/*
+ * Static user space tracepoints.  PROBE(provider, name, args...) places a
+ * single nop in the code and describes it in a .note.stapsdt ELF note,
+ * the format of systemtap's <sys/sdt.h>, so perf and bpftrace find the
+ * probes in an unmodified binary:
+ *
+ *   perf probe -x gfserver_main sdt_gfserver:request_parsed
+ *   bpftrace -e 'usdt:./gfserver_main:gfserver:gfs_send { @ = sum(arg1); }'
+ *
+ * A probe costs the nop and keeping its arguments live when no one is
+ * attached.  Up to four arguments are passed, each widened to a 64-bit
+ * signed integer, so pointers arrive as addresses.  Define NO_PROBES, or
+ * build for anything but gcc or clang on x86-64 or aarch64, to compile
+ * them out entirely.
+ */
+
+#if !defined(NO_PROBES) && defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+
+#define PROBE_NOTE(provider, name, args)                                      \
+	"990:\tnop\n"                                                         \
+	"\t.pushsection .note.stapsdt,\"\",\"note\"\n"                        \
+	"\t.balign 4\n"                                                       \
+	"\t.4byte 992f-991f,994f-993f,3\n"                                    \
+	"991:\t.asciz \"stapsdt\"\n"                                          \
+	"992:\t.balign 4\n"                                                   \
+	"993:\t.8byte 990b\n"                                                 \
+	"\t.8byte _.stapsdt.base\n"                                           \
+	"\t.8byte 0\n"                                                        \
+	"\t.asciz \"" #provider "\"\n"                                        \
+	"\t.asciz \"" #name "\"\n"                                            \
+	"\t.asciz \"" args "\"\n"                                             \
+	"994:\t.balign 4\n"                                                   \
+	"\t.popsection\n"                                                     \
+	"\t.ifndef _.stapsdt.base\n"                                          \
+	"\t.pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"\
+	"\t.weak _.stapsdt.base\n"                                            \
+	"\t.hidden _.stapsdt.base\n"                                          \
+	"_.stapsdt.base:\t.space 1\n"                                         \
+	"\t.size _.stapsdt.base,1\n"                                          \
+	"\t.popsection\n"                                                     \
+	"\t.endif\n"
+
+#define PROBE_ARG(n, x) [_a##n] "nor" ((long long) (x))
+
+#define PROBE0(provider, name)                                                \
+	__asm__ __volatile__ (PROBE_NOTE(provider, name, ""))
+#define PROBE1(provider, name, a1)                                            \
+	__asm__ __volatile__ (PROBE_NOTE(provider, name, "-8@%[_a1]")          \
+		:: PROBE_ARG(1, a1))
+#define PROBE2(provider, name, a1, a2)                                        \
+	__asm__ __volatile__ (PROBE_NOTE(provider, name, "-8@%[_a1] -8@%[_a2]") \
+		:: PROBE_ARG(1, a1), PROBE_ARG(2, a2))
+#define PROBE3(provider, name, a1, a2, a3)                                    \
+	__asm__ __volatile__ (PROBE_NOTE(provider, name,                      \
+		"-8@%[_a1] -8@%[_a2] -8@%[_a3]")                              \
+		:: PROBE_ARG(1, a1), PROBE_ARG(2, a2), PROBE_ARG(3, a3))
+#define PROBE4(provider, name, a1, a2, a3, a4)                                \
+	__asm__ __volatile__ (PROBE_NOTE(provider, name,                      \
+		"-8@%[_a1] -8@%[_a2] -8@%[_a3] -8@%[_a4]")                    \
+		:: PROBE_ARG(1, a1), PROBE_ARG(2, a2), PROBE_ARG(3, a3), PROBE_ARG(4, a4))
+
+#else
+
+#define PROBE0(provider, name) do {} while (0)
+#define PROBE1(provider, name, a1) do {} while (0)
+#define PROBE2(provider, name, a1, a2) do {} while (0)
+#define PROBE3(provider, name, a1, a2, a3) do {} while (0)
+#define PROBE4(provider, name, a1, a2, a3, a4) do {} while (0)
+
+#endif
+
+/* PROBE(provider, name, ...) picks the variant for the number of arguments */
+#define PROBE_PICK(_0, _1, _2, _3, _4, n, ...) PROBE##n
+#define PROBE(provider, ...)                                                  \
+	PROBE_PICK(__VA_ARGS__, 4, 3, 2, 1, 0, 0)(provider, __VA_ARGS__)
+
+#endif
@@ -1,5 +1,270 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "shm_channel.h"
+
+// bounds of the spin before a wait sleeps, in pause instructions
+#define SPIN_MIN 16
+#define SPIN_MAX 8192
+
+// a sleep shorter than this would have been cheaper spent spinning
+#define SPIN_WORTH_NS 50000
+
+// spin of the calling thread, -1 until first used
+static __thread int spin_budget = -1;
+
+static long futex(uint32_t *word, int op, uint32_t value) {
+    return syscall(SYS_futex, word, op, value, NULL, NULL, 0);
+}
+
+static int spin_clamp(int spins) {
+    return spins < SPIN_MIN ? SPIN_MIN : spins > SPIN_MAX ? SPIN_MAX : spins;
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__ ("yield");
+#endif
+}
+
+shm_seg *shm_channel_map(long id, int create, size_t *size) {
+    char shm_name[MAX_CACHE_REQUEST_LEN];
+    struct stat st;
+    void *shm_pointer;
+    int shm_fd;
+
+    sprintf(shm_name, SHM_NAME_FORMAT, id);
+    if ((shm_fd = shm_open(shm_name, create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0666)) < 0)
+        return NULL;
+
+    // a new segment gets its size, an existing one reports it
+    if ((create && ftruncate(shm_fd, (off_t) *size) < 0) || (!create && fstat(shm_fd, &st) < 0)) {
+        close(shm_fd);
+        return NULL;
+    }
+    if (!create)
+        *size = (size_t) st.st_size;
+
+    shm_pointer = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    return shm_pointer == MAP_FAILED ? NULL : shm_pointer;
+}
+
+char *shm_arena_map(int create, size_t *size) {
+    struct stat st;
+    void *arena;
+    int shm_fd;
+
+    // a new arena is a new object, the proxy may still be sending from one
+    // left behind by a simplecached that died and must not see it change
+    if (create)
+        shm_unlink(SHM_ARENA_NAME);
+    if ((shm_fd = shm_open(SHM_ARENA_NAME, create ? O_CREAT | O_EXCL | O_RDWR : O_RDONLY, 0644)) < 0)
+        return NULL;
+
+    // back it now, tmpfs would otherwise raise SIGBUS on a write once full
+    if ((create && posix_fallocate(shm_fd, 0, (off_t) *size) != 0) ||
+            (!create && (fstat(shm_fd, &st) < 0 || st.st_size == 0))) {
+        close(shm_fd);
+        if (create)
+            shm_unlink(SHM_ARENA_NAME);
+        return NULL;
+    }
+    if (!create)
+        *size = (size_t) st.st_size;
+
+    arena = mmap(NULL, *size, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (arena == MAP_FAILED) {
+        if (create)
+            shm_unlink(SHM_ARENA_NAME);
+        return NULL;
+    }
+    if (create)
+        *(pid_t *) arena = getpid();
+    return arena;
+}
+
+static size_t shm_ring_size(uint32_t ncells) {
+    return sizeof(shm_ring) + ncells * sizeof(shm_request);
+}
+
+shm_ring *shm_ring_map(int create, uint32_t capacity) {
+    struct stat st;
+    shm_ring *ring;
+    uint32_t ncells;
+    size_t size;
+    int shm_fd;
+
+    if ((shm_fd = shm_open(SHM_RING_NAME, create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0666)) < 0)
+        return NULL;
+
+    // cells are found by masking a position, so there are a power of two
+    for (ncells = 1; ncells < capacity; ncells <<= 1)
+        ;
+    if (create)
+        size = shm_ring_size(ncells);
+    else if (fstat(shm_fd, &st) < 0 || st.st_size < (off_t) sizeof(shm_ring))
+        size = 0;
+    else
+        size = (size_t) st.st_size;
+
+    if (size == 0 || (create && ftruncate(shm_fd, (off_t) size) < 0)) {
+        close(shm_fd);
+        return NULL;
+    }
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (ring == MAP_FAILED)
+        return NULL;
+
+    if (create) {
+        ring->mask = ncells - 1;
+        for (uint32_t i = 0; i < ncells; i++)
+            ring->cells[i].seq = i;
+        __atomic_store_n(&ring->ready, 1, __ATOMIC_RELEASE);
+    } else if (!__atomic_load_n(&ring->ready, __ATOMIC_ACQUIRE) ||
+            size < shm_ring_size(ring->mask + 1)) {
+        // still being set up by the proxy
+        munmap(ring, size);
+        return NULL;
+    }
+    return ring;
+}
+
+void shm_ring_unmap(shm_ring *ring) {
+    if (ring != NULL)
+        munmap(ring, shm_ring_size(ring->mask + 1));
+}
+
+int shm_ring_push(shm_ring *ring, long shm_id, const char *path) {
+    uint32_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    shm_request *cell;
+    int32_t diff;
+
+    // a cell is free for position pos when its seq is pos
+    while (1) {
+        cell = &ring->cells[pos & ring->mask];
+        diff = (int32_t) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0 && __atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1,
+                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            break;
+        if (diff < 0)
+            return -1;
+        if (diff > 0)
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+
+    cell->shm_id = (int32_t) shm_id;
+    strncpy(cell->path, path, sizeof(cell->path) - 1);
+    cell->path[sizeof(cell->path) - 1] = '\0';
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // pairs with the sleeper count going up before a cache thread looks
+    // at the ring a last time, so one of the two sees the other
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->sleepers, __ATOMIC_RELAXED) > 0)
+        futex(&ring->head, FUTEX_WAKE, 1);
+    return 0;
+}
+
+/**
+ * Takes the next request if there is one, returning -1 if the ring is empty
+ */
+static int shm_ring_try_pop(shm_ring *ring, shm_request *request) {
+    uint32_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    shm_request *cell;
+    int32_t diff;
+
+    // a cell holds the request for position pos when its seq is pos + 1
+    while (1) {
+        cell = &ring->cells[pos & ring->mask];
+        diff = (int32_t) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0 && __atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+        if (diff < 0)
+            return -1;
+        if (diff > 0)
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    }
+
+    memcpy(request, cell, sizeof(shm_request));
+
+    // free the cell for the push one lap later
+    __atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void shm_ring_pop(shm_ring *ring, shm_request *request) {
+    uint32_t head;
+
+    while (shm_ring_try_pop(ring, request) < 0) {
+        // sleep until head moves, unless a push got in after the last look
+        __atomic_fetch_add(&ring->sleepers, 1, __ATOMIC_SEQ_CST);
+        head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+        if (shm_ring_try_pop(ring, request) == 0) {
+            __atomic_fetch_sub(&ring->sleepers, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        futex(&ring->head, FUTEX_WAIT, head);
+        __atomic_fetch_sub(&ring->sleepers, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void shm_event_wait(shm_event *event, uint32_t value) {
+    struct timespec slept, woke;
+    long slept_ns;
+    int spins;
+
+    if (__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) != value)
+        return;
+
+    // the other side can't make progress while we spin on a single cpu
+    if (spin_budget < 0)
+        spin_budget = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_MAX / 16 : 0;
+
+    for (spins = 1; spins <= spin_budget; spins++) {
+        cpu_relax();
+        if (__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) != value) {
+            // next time spin about twice as long as this handoff took
+            spin_budget = spin_clamp((spin_budget + 2 * spins) / 2);
+            return;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &slept);
+    while (__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) == value) {
+        // pairs with shm_event_signal, one of the two sees the other
+        __atomic_fetch_add(&event->sleepers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&event->seq, __ATOMIC_SEQ_CST) == value)
+            futex(&event->seq, FUTEX_WAIT, value);
+        __atomic_fetch_sub(&event->sleepers, 1, __ATOMIC_RELAXED);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &woke);
+
+    // just missed it, spin longer; the other side is slow, stop wasting cpu
+    if (spin_budget > 0) {
+        slept_ns = (woke.tv_sec - slept.tv_sec) * 1000000000L + (woke.tv_nsec - slept.tv_nsec);
+        spin_budget = spin_clamp(slept_ns < SPIN_WORTH_NS ? spin_budget * 2 : spin_budget / 2);
+    }
+}
+
+void shm_event_signal(shm_event *event, uint32_t value) {
+    __atomic_store_n(&event->seq, value, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&event->sleepers, __ATOMIC_SEQ_CST) > 0)
+        futex(&event->seq, FUTEX_WAKE, 1);
+}
 
 void error_and_die(const char *msg) {
     perror(msg);
@@ -1,30 +1,146 @@
 #ifndef _SHM_CHANNEL_H_
 #define _SHM_CHANNEL_H_
 
+#include <stdint.h>
+#include <sys/types.h>
+
 // shared memory defaults
 #define MAX_CACHE_REQUEST_LEN 256
+#define SHM_NAME_FORMAT "/proxy_cache_%ld"
+
+// each segment's data area is a ring of this many slots
+#define SHM_RING_SLOTS 4
+
+// request ring defaults
+#define SHM_RING_NAME "/proxy_cache_requests"
 
-// message queue defaults
-#define MQ_NAME "/message_queue"
-#define MAX_MSG_SIZE 4096
-#define MAX_MSG_NUM 10
+// arena of resident files defaults, offsets in it are aligned to this
+#define SHM_ARENA_NAME "/proxy_cache_arena"
+#define SHM_ARENA_ALIGN 64
+
+/**
+ * Sequence number one side of a transfer moves and the other waits on.
+ * A waiter spins on seq for a while before sleeping on it as a futex, and
+ * the side moving it only makes the wake up call when someone sleeps.
+ */
+typedef struct shm_event {
+    uint32_t seq;
+    uint32_t sleepers;
+} shm_event;
 
 /**
- * Structure for shared memory writen between simplecache and webproxy
+ * Structure for shared memory writen between simplecache and webproxy.
+ * The data area is a single producer single consumer ring: simplecached
+ * fills slot head while the proxy sends slot tail, so both sides work at
+ * once on large files.
  */
 typedef struct shm_segment {
-    // semaphores used to synchronize read/writes
-    sem_t cache_sem;
-    sem_t proxy_sem;
-
-    // transfer information
-    ssize_t bytes_sent;
-    
-    // file information
+    // moved to 1 once simplecached has set file_size
+    shm_event answered;
+
+    // file information, and where it is in the arena of simplecached
+    // arena_owner when resident or -1 when it comes through the slots
     ssize_t file_size;
-    char buffer[];
+    ssize_t arena_offset;
+    pid_t arena_owner;
+
+    // transfer information, bytes held by each slot
+    size_t slot_size;
+    size_t slot_len[SHM_RING_SLOTS];
+
+    // slots filled by simplecached and drained by the proxy, each moved
+    // by one side only and kept on lines of their own
+    shm_event head __attribute__((aligned(64)));
+    shm_event tail __attribute__((aligned(64)));
+
+    char buffer[] __attribute__((aligned(64)));
 } shm_seg;
 
+// data of slot n, counting up from the first slot of the transfer
+#define SHM_SLOT(seg, n) ((seg)->buffer + ((n) % SHM_RING_SLOTS) * (seg)->slot_size)
+
+/**
+ * A request from the proxy, naming the segment the reply goes through.
+ * seq tells whose turn the cell is, see shm_ring_push.
+ */
+typedef struct shm_request {
+    uint32_t seq;
+    int32_t shm_id;
+    char path[MAX_CACHE_REQUEST_LEN];
+} shm_request;
+
+/**
+ * Ring of requests shared by every proxy and cache thread, replacing a
+ * message queue.  Any thread may push or pop: each claims a cell by
+ * moving head or tail with a compare and swap, and the cell's seq
+ * publishes it to the other side.  Cache threads with nothing to do sleep
+ * on a futex on head, and pushes only make the wake up call while some
+ * are asleep.
+ */
+typedef struct shm_ring {
+    uint32_t ready;
+    uint32_t mask;
+
+    // next cell to fill, and the number of cache threads asleep on it
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t sleepers;
+
+    // next cell to take
+    uint32_t tail __attribute__((aligned(64)));
+
+    shm_request cells[] __attribute__((aligned(64)));
+} shm_ring;
+
+/**
+ * Maps shared memory segment id.  With create set the segment is made
+ * with the given size, otherwise its size is stored there.  Returns NULL
+ * if the segment can't be opened or mapped.
+ */
+shm_seg *shm_channel_map(long id, int create, size_t *size);
+
+/**
+ * Creates the arena of resident files with the given size, unlinking one
+ * left behind, or with create clear maps it read only and stores its
+ * size.  The first SHM_ARENA_ALIGN bytes hold the pid of the simplecached
+ * that created it.  Returns NULL if it can't be created or mapped.
+ */
+char *shm_arena_map(int create, size_t *size);
+
+/**
+ * Creates the request ring with room for at least capacity requests, or
+ * with create clear maps the one the proxy made once it is ready.
+ * Returns NULL if it can't be created or doesn't exist yet.
+ */
+shm_ring *shm_ring_map(int create, uint32_t capacity);
+
+/**
+ * Unmaps the request ring.
+ */
+void shm_ring_unmap(shm_ring *ring);
+
+/**
+ * Queues a request for shm_id.  Returns -1 if the ring is full.
+ */
+int shm_ring_push(shm_ring *ring, long shm_id, const char *path);
+
+/**
+ * Takes the next request, sleeping until there is one.
+ */
+void shm_ring_pop(shm_ring *ring, shm_request *request);
+
+/**
+ * Waits until event's sequence number is no longer value.  The spin
+ * before sleeping adapts to how long the calling thread's recent waits
+ * took, and shrinks away when the other side is rarely that quick.
+ */
+void shm_event_wait(shm_event *event, uint32_t value);
+
+/**
+ * Moves event's sequence number to value, waking the other side if it
+ * went to sleep waiting for that.
+ */
+void shm_event_signal(shm_event *event, uint32_t value);
+
 /**
  * Logs error that occured and exits with failure
  */
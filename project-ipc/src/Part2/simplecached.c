@@ -5,17 +5,59 @@
 #include <getopt.h>
 #include <pthread.h>
 #include <sys/fcntl.h>
-#include <semaphore.h>
-#include <mqueue.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <string.h>
+#include <time.h>
 
 #include "shm_channel.h"
 #include "simplecache.h"
-
-mqd_t msg_queue;
+#include "probe.h"
+#include "stats.h"
+
+// counters published for gfstat
+#define STAT_REQUESTS 0
+#define STAT_HITS 1
+#define STAT_MISSES 2
+#define STAT_BYTES 3
+#define STAT_CHUNKS 4
+#define STAT_RESIDENT 5
+
+static const char *stat_names[] = {"requests", "hits", "misses", "bytes", "chunks", "resident"};
+
+// states of a file in the arena
+#define ARENA_ABSENT 0
+#define ARENA_LOADING 1
+#define ARENA_RESIDENT 2
+#define ARENA_NO_ROOM 3
+
+typedef struct arena_entry {
+    int state;
+    size_t offset;
+    ssize_t size;
+} arena_entry;
+
+// requests from the proxy
+shm_ring *request_ring;
+
+// every segment of the proxy, mapped once and found by its index
+shm_seg **segments;
+long num_segments;
+
+// files are copied here on their first hit, after which the proxy sends
+// them straight from its read only mapping.  NULL when disabled
+char *arena;
+size_t arena_size;
+size_t arena_used;
+
+// state of every file in the arena, found by its descriptor
+arena_entry *arena_entries;
+long arena_nentries;
 
 // new methods used in simplecached
+void map_segments();
+int init_arena(size_t size);
+ssize_t arena_lookup(int file_desc, ssize_t *file_size);
 void start_threads(int nthreads);
 void *handler_worker(void* arg);
 void simplecache_cleanup();
@@ -36,12 +78,14 @@ static void _sig_handler(int signo){
 "options:\n"                                                                  \
 "  -t [thread_count]   Num worker threads (Default: 1, Range: 1-1000)\n"      \
 "  -c [cachedir]       Path to static files (Default: ./)\n"                  \
+"  -a [arena_mb]       MB of files kept resident (Default: 64)\n"             \
 "  -h                  Show this help message\n"
 
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
         {"nthreads",           required_argument,      NULL,           't'},
         {"cachedir",           required_argument,      NULL,           'c'},
+        {"arena",              required_argument,      NULL,           'a'},
         {"help",               no_argument,            NULL,           'h'},
         {NULL,                 0,                      NULL,             0}
 };
@@ -53,9 +97,10 @@ void Usage() {
 int main(int argc, char **argv) {
     int nthreads = 1;
     char *cachedir = "locals.txt";
+    int arena_mb = 64;
     char option_char;
 
-    while ((option_char = (char) getopt_long(argc, argv, "t:c:h", gLongOptions, NULL)) != -1) {
+    while ((option_char = (char) getopt_long(argc, argv, "t:c:a:h", gLongOptions, NULL)) != -1) {
         switch (option_char) {
             case 't': // thread-count
                 nthreads = atoi(optarg);
@@ -63,6 +108,9 @@ int main(int argc, char **argv) {
             case 'c': //cache directory
                 cachedir = optarg;
                 break;
+            case 'a': // arena size
+                arena_mb = atoi(optarg);
+                break;
             case 'h': // help
                 Usage();
                 exit(0);
@@ -84,13 +132,20 @@ int main(int argc, char **argv) {
 
     /* Initializing the cache */
     simplecache_init(cachedir);
+    if (stats_init("simplecached", stat_names, sizeof(stat_names) / sizeof(stat_names[0])) < 0)
+        perror("Simplecache could not publish statistics");
+
+    // files become resident in the arena as they are first asked for
+    if (arena_mb > 0 && init_arena((size_t) arena_mb << 20) < 0)
+        perror("Simplecache could not create its arena, streaming every file");
+
+    // wait for the proxy to set up the request ring
+    while ((request_ring = shm_ring_map(0, 0)) == NULL)
+        usleep(10000);
+
+    // the proxy made its segments before the ring, map them all now
+    map_segments();
 
-    // open message queues
-    while (1) {
-        if ((msg_queue = mq_open(MQ_NAME, O_RDONLY)) != -1)
-            break;
-    }
-    
     // initialize and start pthreads
     start_threads(nthreads);
 
@@ -99,6 +154,89 @@ int main(int argc, char **argv) {
     return EXIT_SUCCESS;
 }
 
+/**
+ * Maps every segment the proxy created, in order of their index, so
+ * requests only need to name the index
+ */
+void map_segments() {
+    shm_seg *shm_pointer;
+    size_t size;
+
+    while ((shm_pointer = shm_channel_map(num_segments, 0, &size)) != NULL) {
+        segments = realloc(segments, (num_segments + 1) * sizeof(shm_seg *));
+        segments[num_segments++] = shm_pointer;
+    }
+    if (num_segments == 0)
+        error_and_die("Simplecache found no shared memory segments");
+}
+
+/**
+ * Creates the arena of resident files, empty until files are asked for
+ */
+int init_arena(size_t size) {
+    // the cache's descriptors are all below the open file limit
+    arena_nentries = sysconf(_SC_OPEN_MAX);
+    if (arena_nentries <= 0 || (arena_entries = calloc(arena_nentries, sizeof(arena_entry))) == NULL)
+        return -1;
+
+    arena_size = size;
+    if ((arena = shm_arena_map(1, &arena_size)) == NULL) {
+        free(arena_entries);
+        arena_entries = NULL;
+        return -1;
+    }
+
+    // files go after the pid the proxy checks the arena by
+    arena_used = SHM_ARENA_ALIGN;
+    return 0;
+}
+
+/**
+ * Returns where a file is in the arena, copying it in on its first hit,
+ * or -1 if it is to be streamed.  file_size becomes that of the resident
+ * copy.  A file is loaded by the first thread to ask for it while the
+ * others stream it, and files that no longer fit are always streamed.
+ */
+ssize_t arena_lookup(int file_desc, ssize_t *file_size) {
+    arena_entry *entry;
+    int state = ARENA_ABSENT;
+    size_t used, needed, loaded;
+    ssize_t bytes_read;
+
+    if (arena == NULL || file_desc < 0 || file_desc >= arena_nentries || *file_size <= 0)
+        return -1;
+    entry = &arena_entries[file_desc];
+
+    if (!__atomic_compare_exchange_n(&entry->state, &state, ARENA_LOADING, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        if (state != ARENA_RESIDENT)
+            return -1;
+        *file_size = entry->size;
+        return (ssize_t) entry->offset;
+    }
+
+    // take room at the end, nothing is ever evicted
+    needed = ((size_t) *file_size + SHM_ARENA_ALIGN - 1) & ~(size_t) (SHM_ARENA_ALIGN - 1);
+    used = __atomic_load_n(&arena_used, __ATOMIC_RELAXED);
+    do {
+        if (used + needed > arena_size) {
+            __atomic_store_n(&entry->state, ARENA_NO_ROOM, __ATOMIC_RELAXED);
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&arena_used, &used, used + needed, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    for (loaded = 0; loaded < (size_t) *file_size; loaded += bytes_read) {
+        bytes_read = pread(file_desc, arena + used + loaded, *file_size - loaded, (off_t) loaded);
+        if (bytes_read <= 0)
+            error_and_die("simplecache read error");
+    }
+    PROBE(simplecached, arena_load, file_desc, *file_size, used);
+
+    entry->offset = used;
+    entry->size = *file_size;
+    __atomic_store_n(&entry->state, ARENA_RESIDENT, __ATOMIC_RELEASE);
+    return (ssize_t) used;
+}
+
 /**
  * Initiates pthreads and then starts them waiting for messages to come through
  * joining when they are completed
@@ -122,87 +260,84 @@ void start_threads(int nthreads) {
  * exists and then write the file to shared memory
  */
 void *handler_worker(void* arg) {
-    char message[MAX_MSG_SIZE] = {0};
-    char shm_name[MAX_CACHE_REQUEST_LEN] = {0};
+    shm_request request;
     long shm_id;
-    size_t region_size;
-    char path[MAX_CACHE_REQUEST_LEN];
     size_t bytes_transferred;
     ssize_t bytes_sent;
     size_t transfer_size;
+    struct timespec started, finished;
 
     while (1) {
-        // receive message from mqueue
-        memset(message, 0, sizeof(message));
-        if (mq_receive(msg_queue, message, sizeof(message), 0) < 0)
-            error_and_die("Simplecache error receiving message");
-
-        // extract file information from message
-        sscanf(message, "Request: %ld %zu %s", &shm_id, &region_size, path);
-        int file_desc = simplecache_get(path);
-
-        // get share memory name from its stored id
-        if (sprintf(shm_name, "proxy_cache_%ld", shm_id) < 0)
-            error_and_die("translation error");
-
-        // open shared memory file descriptor
-        int shm_fd = shm_open(shm_name, O_RDWR, 0);
-        if (shm_fd == -1)
-            error_and_die("Simplecache unable to open fd");
-
-        // obtain the pointer to shared memory
-        shm_seg *shm_pointer;
-        shm_pointer = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-        if (shm_pointer == MAP_FAILED)
-            error_and_die("not able to map memory");
-        close(shm_fd);
-
-        // access file and update file size
-        ssize_t file_size = lseek(file_desc, 0, SEEK_END);
-        lseek(file_desc, 0, SEEK_SET);
+        // take the next request, sleeping until one arrives
+        shm_ring_pop(request_ring, &request);
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        stats_add(STAT_REQUESTS, 1);
+
+        // requests are binary, only the segment needs checking
+        shm_id = request.shm_id;
+        if (shm_id < 0 || shm_id >= num_segments)
+            error_and_die("Simplecache received a bad request");
+        int file_desc = simplecache_get(request.path);
+
+        // the segment was mapped once at startup
+        shm_seg *shm_pointer = segments[shm_id];
+
+        // access file and update file size, the descriptor is shared by
+        // every thread so its offset is never used
+        struct stat file_stat;
+        ssize_t file_size = (file_desc != -1 && fstat(file_desc, &file_stat) == 0) ? file_stat.st_size : -1;
+        ssize_t arena_offset = arena_lookup(file_desc, &file_size);
         shm_pointer->file_size = file_size;
+        shm_pointer->arena_offset = arena_offset;
+        shm_pointer->arena_owner = getpid();
 
         // Send message back on status of file
-        if (sem_post(&shm_pointer->proxy_sem) == -1)
-            error_and_die("Simplecache failed to inform webroxy");
+        shm_event_signal(&shm_pointer->answered, 1);
 
         // file not found so move back to beginning
-        if (file_desc == -1)
+        if (file_desc == -1) {
+            stats_add(STAT_MISSES, 1);
             continue;
+        }
+        stats_add(STAT_HITS, 1);
 
-        // transfer file to webproxy
-        bytes_transferred = 0;
-        char buffer[region_size];
+        // resident files are sent by the proxy straight from the arena,
+        // the rest are streamed to it through the slots
+        if (arena_offset >= 0)
+            stats_add(STAT_RESIDENT, 1);
+        bytes_transferred = arena_offset >= 0 ? file_size : 0;
         while (bytes_transferred < file_size) {
+            uint32_t head = shm_pointer->head.seq;
 
-            // wait for handler to say its ready
-            if (sem_wait(&shm_pointer->cache_sem) == -1)
-                error_and_die("Simplecache failed to wait for proxy");
+            // wait for handler to free a slot when all of them are full
+            if (head - __atomic_load_n(&shm_pointer->tail.seq, __ATOMIC_ACQUIRE) == SHM_RING_SLOTS)
+                shm_event_wait(&shm_pointer->tail, head - SHM_RING_SLOTS);
 
             // calculate size of transfer to read in
             transfer_size = file_size - bytes_transferred;
-            transfer_size = (transfer_size < region_size) ? transfer_size : region_size;
+            transfer_size = (transfer_size < shm_pointer->slot_size) ? transfer_size : shm_pointer->slot_size;
 
-            // set memory for local buffer and read file
-            memset(buffer, 0, sizeof(buffer));
-            bytes_sent = read(file_desc, buffer, transfer_size);
+            // read the file straight into the slot
+            bytes_sent = pread(file_desc, SHM_SLOT(shm_pointer, head), transfer_size, (off_t) bytes_transferred);
 
             // make sure file read correctly and update totals
             if (bytes_sent == -1 || bytes_sent != transfer_size)
                 error_and_die("simplecache read error");
 
-            // set memory for shared buffer
-            memset(&shm_pointer->buffer, 0, bytes_sent);
-            memcpy(&shm_pointer->buffer, buffer, bytes_sent);
+            PROBE(simplecached, chunk_copy, shm_id, bytes_sent, bytes_transferred);
+            stats_add(STAT_CHUNKS, 1);
+            stats_add(STAT_BYTES, bytes_sent);
 
-            // update the total bytes read and how much is being sent
-            shm_pointer->bytes_sent = bytes_sent;
+            // update the total bytes read and how much the slot holds
+            shm_pointer->slot_len[head % SHM_RING_SLOTS] = bytes_sent;
             bytes_transferred += bytes_sent;
-            
+
             // Send message back on status of file
-            if (sem_post(&shm_pointer->proxy_sem) == -1)
-                error_and_die("Simplecache failed to inform webroxy");
+            shm_event_signal(&shm_pointer->head, head + 1);
         }
+
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        stats_latency((finished.tv_sec - started.tv_sec) * 1000000LL + (finished.tv_nsec - started.tv_nsec) / 1000);
     }
 
     // to rid of stupid warning
@@ -214,7 +349,7 @@ void *handler_worker(void* arg) {
  */
 void simplecache_cleanup() {
 
-    // unlink and close message queue
-    mq_unlink(MQ_NAME);
-    close(msg_queue);
+    // the proxy owns the request ring and the segments, and keeps the
+    // arena mapped for whatever it is still sending
+    shm_unlink(SHM_ARENA_NAME);
 }
@@ -4,12 +4,29 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+
+#include "content.h"
+#include "xxhash.h"
 
 #define MAX_KEYLEN 256
+#define NUM_ENCODINGS 2
+
+/* Precompressed variants are looked up next to each file by suffix */
+static const struct{
+	const char *name;
+	const char *suffix;
+} encodings[NUM_ENCODINGS] = {
+	{"zstd", ".zst"},
+	{"gzip", ".gz"}
+};
 
 typedef struct{
 	int fildes;
 	char key[MAX_KEYLEN];
+	char tag[CONTENT_TAG_LEN + 1];
+	int variants[NUM_ENCODINGS];
+	off_t variant_len[NUM_ENCODINGS];
 } item_t;
 
 static int nitems;
@@ -19,6 +36,79 @@ static int _itemcmp(const void *a, const void *b){
 	return strcmp(((item_t*) a)->key,((item_t*) b)->key);
 }
 
+/* Hashes the whole file once so requests only pay for a lookup */
+static void _tagfile(int fildes, char *tag){
+	struct stat st;
+	void *data;
+	uint64_t hash = xxh64(NULL, 0, 0);
+
+	if (0 == fstat(fildes, &st) && st.st_size > 0){
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fildes, 0);
+		if (data != MAP_FAILED){
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			hash = xxh64(data, st.st_size, 0);
+			munmap(data, st.st_size);
+		}
+	}
+
+	xxh64_tohex(hash, tag);
+}
+
+/*
+ * Opens the precompressed variants of path, if any.  A variant is only
+ * kept when it is at least as new as the original and actually smaller.
+ */
+static void _openvariants(item_t *item, char *path){
+	char vpath[MAX_KEYLEN + 8];
+	struct stat st, vst;
+	int i;
+
+	fstat(item->fildes, &st);
+	for (i = 0; i < NUM_ENCODINGS; i++){
+		item->variants[i] = -1;
+		snprintf(vpath, sizeof(vpath), "%s%s", path, encodings[i].suffix);
+		if (0 > (item->variants[i] = open(vpath, O_RDONLY)))
+			continue;
+
+		if (0 > fstat(item->variants[i], &vst) || vst.st_mtime < st.st_mtime ||
+				vst.st_size >= st.st_size){
+			close(item->variants[i]);
+			item->variants[i] = -1;
+			continue;
+		}
+		item->variant_len[i] = vst.st_size;
+	}
+}
+
+/* Returns non-zero if name appears in the comma separated list */
+static int _accepts(const char *accept, const char *name){
+	size_t len = strlen(name);
+	const char *ptr = accept;
+
+	while (NULL != (ptr = strstr(ptr, name))){
+		if ((ptr == accept || ptr[-1] == ',' || ptr[-1] == ' ') &&
+				(ptr[len] == '\0' || ptr[len] == ','))
+			return 1;
+		ptr += len;
+	}
+	return 0;
+}
+
+static item_t* _finditem(char *key){
+	int lo = 0;
+	int hi = nitems - 1;
+	int mid, cmp;
+	while (lo <= hi) {
+		// Key is in items[lo..hi] or not present.
+		mid = lo + (hi - lo) / 2;
+		cmp = strcmp(key,items[mid].key);
+		if ( cmp < 0) hi = mid - 1;
+		else if (cmp > 0) lo = mid + 1;
+		else return &items[mid];
+	}
+	return NULL;
+}
+
 int content_init(char *filename){
 	FILE *filelist;
 	int capacity = 16;
@@ -44,6 +134,8 @@ int content_init(char *filename){
 			fprintf(stderr, "Unable to open file %s.\n", path);
 			exit(EXIT_FAILURE);
 		}
+		_tagfile(items[nitems].fildes, items[nitems].tag);
+		_openvariants(&items[nitems], path);
 		nitems++;
 
 		if(nitems == capacity){
@@ -61,27 +153,58 @@ int content_init(char *filename){
 }
 
 int content_get(char *key){
-	int lo = 0;
-	int hi = nitems - 1;
-	int mid, cmp;
-	while (lo <= hi) {
-		// Key is in items[lo..hi] or not present.
-		mid = lo + (hi - lo) / 2;
-		cmp = strcmp(key,items[mid].key);
-		if ( cmp < 0) hi = mid - 1;
-		else if (cmp > 0) lo = mid + 1;
-		else{
-			lseek(items[mid].fildes, 0, SEEK_SET);
-			return items[mid].fildes;
-		} 
+	item_t *item;
+
+	if (NULL == (item = _finditem(key)))
+		return -1;
+
+	lseek(item->fildes, 0, SEEK_SET);
+	return item->fildes;
+}
+
+int content_get_encoded(char *key, char *accept, const char **encoding){
+	item_t *item;
+	int i, best = -1;
+
+	*encoding = NULL;
+	if (NULL == (item = _finditem(key)))
+		return -1;
+
+	/* Of the variants the client accepts, send the smallest one */
+	for (i = 0; accept != NULL && i < NUM_ENCODINGS; i++){
+		if (item->variants[i] < 0 || !_accepts(accept, encodings[i].name))
+			continue;
+		if (best < 0 || item->variant_len[i] < item->variant_len[best])
+			best = i;
 	}
-	return -1;
+
+	if (best < 0){
+		lseek(item->fildes, 0, SEEK_SET);
+		return item->fildes;
+	}
+
+	*encoding = encodings[best].name;
+	lseek(item->variants[best], 0, SEEK_SET);
+	return item->variants[best];
+}
+
+const char* content_get_tag(char *key){
+	item_t *item;
+
+	if (NULL == (item = _finditem(key)))
+		return NULL;
+
+	return item->tag;
 }
 
 void content_destroy(){
-	int i;
-	for(i = 0; i < nitems; i++)
+	int i, j;
+	for(i = 0; i < nitems; i++){
 		close(items[i].fildes);
+		for (j = 0; j < NUM_ENCODINGS; j++)
+			if (items[i].variants[j] >= 0)
+				close(items[i].variants[j]);
+	}
 	
 	free(items);
 }
\ No newline at end of file
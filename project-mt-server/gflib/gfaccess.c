@@ -0,0 +1,217 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "gfserver.h"
+#include "histogram.h"
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  gfaccess [options] access_log\n"                                           \
+"options:\n"                                                                  \
+"  -t                  Print every record as text instead of a summary\n"     \
+"  -h                  Show this help message\n"                              \
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] = {
+  {"text",          no_argument,            NULL,           't'},
+  {"help",          no_argument,            NULL,           'h'},
+  {NULL,            0,                      NULL,             0}
+};
+
+/* Phases of a request, each measured from the end of the one before */
+#define PHASES 5
+
+static const char *gPhaseNames[PHASES] = {
+  "read request", "to handler", "to header", "transfer", "total"
+};
+
+static const char *gPhaseKeys[PHASES] = {
+  "read", "dispatch", "queue", "send", "total"
+};
+
+static void Usage() {
+	fprintf(stdout, "%s", USAGE);
+}
+
+static char* statusName(int32_t status){
+  switch (status){
+    case 0:
+      return "NONE";
+    case GF_OK:
+      return "OK";
+    case GF_NOT_MODIFIED:
+      return "NOT_MODIFIED";
+    case GF_FILE_NOT_FOUND:
+      return "FILE_NOT_FOUND";
+    default:
+      return "ERROR";
+  }
+}
+
+/* Returns the microseconds between two marks, or -1 if either is missing */
+static long phase(uint32_t from, uint32_t to){
+  if (from == GFS_ACCESS_NONE || to == GFS_ACCESS_NONE)
+    return -1;
+  return (long) to - (long) from;
+}
+
+static void phases(gfs_access_record_t *record, long *out){
+  out[0] = phase(0, record->parsed);
+  out[1] = phase(record->parsed, record->handler);
+  out[2] = phase(record->handler, record->header);
+  out[3] = phase(record->header, record->done);
+  out[4] = phase(0, record->done);
+}
+
+static void printRecord(gfs_access_record_t *record){
+  char stamp[32];
+  long times[PHASES];
+  time_t seconds = record->accepted / 1000000000ULL;
+  struct tm tm;
+  int i;
+
+  localtime_r(&seconds, &tm);
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+  phases(record, times);
+
+  fprintf(stdout, "%s.%06llu %-14s %10llu %s", stamp,
+          (unsigned long long) (record->accepted % 1000000000ULL) / 1000,
+          statusName(record->status), (unsigned long long) record->bytes,
+          record->path[0] != '\0' ? record->path : "-");
+  for (i = 0; i < PHASES; i++)
+    if (times[i] >= 0)
+      fprintf(stdout, " %s=%ld", gPhaseKeys[i], times[i]);
+  fprintf(stdout, "%s\n", record->aborted ? " ABORTED" : "");
+}
+
+static void printSummary(gfs_access_record_t *records, size_t nrecords){
+  static histogram_t hists[PHASES];
+  size_t ok = 0, not_modified = 0, not_found = 0, errors = 0, aborted = 0;
+  unsigned long long bytes = 0;
+  uint64_t first = 0, last = 0, end;
+  long times[PHASES];
+  double seconds;
+  size_t n;
+  int i;
+
+  for (i = 0; i < PHASES; i++)
+    histogram_reset(&hists[i]);
+
+  for (n = 0; n < nrecords; n++){
+    switch (records[n].status){
+      case GF_OK:
+        ok++;
+        break;
+      case GF_NOT_MODIFIED:
+        not_modified++;
+        break;
+      case GF_FILE_NOT_FOUND:
+        not_found++;
+        break;
+      default:
+        errors++;
+    }
+    aborted += records[n].aborted != 0;
+    bytes += records[n].bytes;
+
+    end = records[n].accepted + (records[n].done != GFS_ACCESS_NONE ? records[n].done * 1000ULL : 0);
+    if (first == 0 || records[n].accepted < first)
+      first = records[n].accepted;
+    if (end > last)
+      last = end;
+
+    phases(&records[n], times);
+    for (i = 0; i < PHASES; i++)
+      if (times[i] >= 0)
+        histogram_record(&hists[i], times[i]);
+  }
+
+  seconds = nrecords > 0 ? (last - first) / 1e9 : 0;
+  fprintf(stdout, "Requests: %zu in %.2f s, %zu ok, %zu not modified, %zu not found, %zu errors, %zu aborted\n",
+          nrecords, seconds, ok, not_modified, not_found, errors, aborted);
+  fprintf(stdout, "Throughput: %.1f req/s, %.2f MB/s\n",
+          seconds > 0 ? nrecords / seconds : 0, seconds > 0 ? bytes / seconds / 1e6 : 0);
+  fprintf(stdout, "%-18s %9s %9s %9s %9s %9s %9s\n", "Phase (us)", "p50", "p90", "p99", "p99.9", "max", "mean");
+  for (i = 0; i < PHASES; i++)
+    fprintf(stdout, "%-18s %9ld %9ld %9ld %9ld %9ld %9.0f\n", gPhaseNames[i],
+            (long) histogram_percentile(&hists[i], 50), (long) histogram_percentile(&hists[i], 90),
+            (long) histogram_percentile(&hists[i], 99), (long) histogram_percentile(&hists[i], 99.9),
+            (long) hists[i].max, histogram_mean(&hists[i]));
+}
+
+/* Main ========================================================= */
+int main(int argc, char **argv) {
+/* COMMAND LINE OPTIONS ============================================= */
+  int text = 0;
+
+  int option_char = 0;
+  int fd;
+  struct stat st;
+  char *data;
+  uint32_t record_len;
+  size_t nrecords, n;
+
+  // Parse and set command line arguments
+  while ((option_char = getopt_long(argc, argv, "th", gLongOptions, NULL)) != -1) {
+    switch (option_char) {
+      case 't': // text
+        text = 1;
+        break;
+      case 'h': // help
+        Usage();
+        exit(0);
+        break;
+      default:
+        Usage();
+        exit(1);
+    }
+  }
+
+  if (optind != argc - 1){
+    Usage();
+    exit(1);
+  }
+
+  if( 0 > (fd = open(argv[optind], O_RDONLY)) || 0 > fstat(fd, &st)){
+    perror("Unable to open access log");
+    exit(EXIT_FAILURE);
+  }
+  if (st.st_size < GFS_ACCESS_HEADER_LEN){
+    fprintf(stderr, "%s is not an access log.\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+  if( MAP_FAILED == (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))){
+    perror("Unable to map access log");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+
+  memcpy(&record_len, data + 8, sizeof(record_len));
+  if (0 != memcmp(data, GFS_ACCESS_MAGIC, 8) || record_len != sizeof(gfs_access_record_t)){
+    fprintf(stderr, "%s is not an access log of this version.\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+
+  /* A record cut short by a crash is left out */
+  nrecords = (st.st_size - GFS_ACCESS_HEADER_LEN) / record_len;
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  if (text){
+    for (n = 0; n < nrecords; n++)
+      printRecord((gfs_access_record_t*) (data + GFS_ACCESS_HEADER_LEN) + n);
+  }
+  else
+    printSummary((gfs_access_record_t*) (data + GFS_ACCESS_HEADER_LEN), nrecords);
+
+  munmap(data, st.st_size);
+
+  return 0;
+}
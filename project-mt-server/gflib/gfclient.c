@@ -8,14 +8,123 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "gfclient.h"
+#include "log.h"
+#include "probe.h"
 
-#define BUFSIZE 4096
+#define HEADER_MAX 512
+#define RECV_BUFSIZE_MIN 65536
+#define RECV_BUFSIZE_MAX (1 << 20)
+#define MAX_TAG_LEN 32
+#define MAX_ENCODING_LEN 32
+#define DEFAULT_POOL_MAX_IDLE 64
+#define DEFAULT_POOL_IDLE_TIMEOUT 15
+#define RESOLVER_BUCKETS 64
+#define RESOLVER_MAX_ADDRS 4
+#define DEFAULT_RESOLVER_TTL 60
+#define MULTI_MAX_EVENTS 256
+#define HEDGE_SAMPLES 256
+#define HEDGE_MIN_SAMPLES 16
+#define DEFAULT_HEDGE_PERCENTILE 95
+#define DEFAULT_HEDGE_MIN_DELAY 20
+#define CACHE_BUCKETS 256
+#define CACHE_KEY_MAX 1024
+#define DEFAULT_CACHE_MEM (64 << 20)
 
 // helper function for getting status integer
 int gfc_intstatus(char *status);
 
+// idle connection kept open for reuse by later requests to the same server
+typedef struct gfc_conn_t {
+    char *server;
+    unsigned short portno;
+    int socket_fd;
+    time_t expires;
+    struct gfc_conn_t *next;
+} gfc_conn_t;
+
+// cached result of resolving server:portno
+typedef struct gfc_addr_t {
+    char *server;
+    unsigned short portno;
+    time_t expires;
+    int naddrs;
+    int preferred;
+    struct sockaddr_storage addrs[RESOLVER_MAX_ADDRS];
+    socklen_t addrlens[RESOLVER_MAX_ADDRS];
+    struct gfc_addr_t *next;
+} gfc_addr_t;
+
+// resolver cache shared by all threads, a hash table of chained entries
+static pthread_rwlock_t resolver_lock = PTHREAD_RWLOCK_INITIALIZER;
+static gfc_addr_t *resolver_table[RESOLVER_BUCKETS];
+static int resolver_ttl = DEFAULT_RESOLVER_TTL;
+
+// connection pool shared by all threads, enabled by gfc_global_init
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static gfc_conn_t *pool_head = NULL;
+static int pool_enabled = 0;
+static int pool_count = 0;
+static int pool_max_idle = DEFAULT_POOL_MAX_IDLE;
+static int pool_idle_timeout = DEFAULT_POOL_IDLE_TIMEOUT;
+
+// recent first byte latencies in milliseconds, used to decide when to hedge
+static pthread_mutex_t hedge_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int hedge_samples[HEDGE_SAMPLES];
+static int hedge_count = 0;
+static int hedge_next = 0;
+static int hedge_percentile = DEFAULT_HEDGE_PERCENTILE;
+static int hedge_min_delay = DEFAULT_HEDGE_MIN_DELAY;
+
+// object held by the client cache
+typedef struct gfc_cached_t {
+    char *key;
+    char tag[MAX_TAG_LEN + 1];
+    char encoding[MAX_ENCODING_LEN + 1];
+    time_t expires;
+    size_t len;
+    char *data;
+
+    // mapping of the disk copy when the body is not held in memory
+    void *map;
+    size_t map_len;
+
+    // references held by requests serving the object, and whether the
+    // memory tier still holds it
+    int refs;
+    int resident;
+    struct gfc_cached_t *next;
+    struct gfc_cached_t *lru_prev;
+    struct gfc_cached_t *lru_next;
+} gfc_cached_t;
+
+// response body being added to the cache as it arrives
+typedef struct gfc_cache_fill_t {
+    int fd;
+    char tmp_path[PATH_MAX];
+    char path[PATH_MAX];
+    gfc_cached_t *entry;
+    size_t written;
+} gfc_cache_fill_t;
+
+// client cache, a memory tier in front of an optional disk tier
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int cache_enabled = 0;
+static char *cache_dir = NULL;
+static size_t cache_mem_limit = DEFAULT_CACHE_MEM;
+static size_t cache_mem_used = 0;
+static gfc_cached_t *cache_table[CACHE_BUCKETS];
+static gfc_cached_t *cache_lru_head = NULL;
+static gfc_cached_t *cache_lru_tail = NULL;
+
 // file request structure
 typedef struct gfcrequest_t{
     char *server;
@@ -28,6 +137,18 @@ typedef struct gfcrequest_t{
     gfstatus_t status;
     size_t bytesreceived;
 	size_t filelen;
+    char *tag;
+    char resp_tag[MAX_TAG_LEN + 1];
+    char *accept_encoding;
+    char resp_encoding[MAX_ENCODING_LEN + 1];
+    int resp_lease;
+    long start_time;
+    long connect_time;
+    long header_time;
+    int connect_timeout;
+    int read_timeout;
+    char *hedge_server;
+    unsigned short hedge_portno;
 } gfcrequest_t;
 
 /**
@@ -51,6 +172,12 @@ gfcrequest_t *gfc_create(){
     request->status = GF_OK;
 	request->bytesreceived = 0;
 	request->filelen = 0;
+    request->tag = NULL;
+    request->accept_encoding = NULL;
+    request->connect_timeout = 0;
+    request->read_timeout = 0;
+    request->hedge_server = NULL;
+    request->hedge_portno = 0;
     return request;
 }
 
@@ -61,6 +188,7 @@ gfcrequest_t *gfc_create(){
  */
 void gfc_set_server(gfcrequest_t *gfr, char* server){
     if (gfr != NULL && server != NULL) {
+        free(gfr->server);
         gfr->server = (char *)calloc(strlen(server) + 1, sizeof(char));
         strcpy(gfr->server, server);
     }
@@ -73,6 +201,7 @@ void gfc_set_server(gfcrequest_t *gfr, char* server){
  */
 void gfc_set_path(gfcrequest_t *gfr, char* path){
     if (gfr != NULL && path != NULL) {
+        free(gfr->path);
         gfr->path = (char *)calloc(strlen(path) + 1, sizeof(char));
         strcpy(gfr->path, path);
     }
@@ -88,6 +217,59 @@ void gfc_set_port(gfcrequest_t *gfr, unsigned short port){
         gfr->portno = port;
 }
 
+/**
+ * Sets the validator tag of a copy of the file the caller already holds.
+ * @param gfr - pointer to gfcrequest_t
+ * @param tag - tag previously returned by gfc_get_tag
+ */
+void gfc_set_tag(gfcrequest_t *gfr, char* tag){
+    if (gfr != NULL && tag != NULL && strlen(tag) <= MAX_TAG_LEN) {
+        free(gfr->tag);
+        gfr->tag = strdup(tag);
+    }
+}
+
+/**
+ * Sets the list of content encodings the caller can decode.
+ * @param gfr - pointer to gfcrequest_t
+ * @param encodings - comma separated encoding names, e.g. "zstd,gzip"
+ */
+void gfc_set_accept_encoding(gfcrequest_t *gfr, char* encodings){
+    if (gfr != NULL && encodings != NULL && strlen(encodings) <= MAX_ENCODING_LEN
+            && strchr(encodings, ' ') == NULL) {
+        free(gfr->accept_encoding);
+        gfr->accept_encoding = strdup(encodings);
+    }
+}
+
+/**
+ * Sets the deadlines of the request.  Zero leaves a step without one.
+ * @param gfr - pointer to gfcrequest_t
+ * @param connect_timeout - milliseconds allowed to establish a connection
+ * @param read_timeout - milliseconds allowed between received bytes
+ */
+void gfc_set_timeouts(gfcrequest_t *gfr, int connect_timeout, int read_timeout){
+    if (gfr != NULL) {
+        gfr->connect_timeout = connect_timeout > 0 ? connect_timeout : 0;
+        gfr->read_timeout = read_timeout > 0 ? read_timeout : 0;
+    }
+}
+
+/**
+ * Sets a replica the request is duplicated to if the first server is slow
+ * to respond.
+ * @param gfr - pointer to gfcrequest_t
+ * @param server - replica server name, NULL to disable hedging
+ * @param port - replica server port
+ */
+void gfc_set_hedge(gfcrequest_t *gfr, char* server, unsigned short port){
+    if (gfr != NULL) {
+        free(gfr->hedge_server);
+        gfr->hedge_server = (server != NULL) ? strdup(server) : NULL;
+        gfr->hedge_portno = port;
+    }
+}
+
 /**
 * Sets the callback for received header.  The registered callback
 * will receive a pointer the header of the response, the length
@@ -144,240 +326,1877 @@ void gfc_set_writearg(gfcrequest_t *gfr, void *writearg){
         gfr->writearg = writearg;
 }
 
-/*
- * Performs the transfer as described in the options.  Returns a value of 0
- * if the communication is successful, including the case where the server
- * returns a response with a FILE_NOT_FOUND or ERROR response.  If the
- * communication is not successful (e.g. the connection is closed before
- * transfer is complete or an invalid header is returned), then a negative
- * integer will be returned.
- * @param gfr - pointer to gfcrequest_t
- * @return integer based on result of function
+/**
+ * Takes an idle connection to server:portno out of the pool, dropping any
+ * expired or closed connections found along the way.
+ * @param server - server name
+ * @param portno - server port
+ * @return connected socket or -1 if none is available
  */
-int gfc_perform(gfcrequest_t *gfr){
-    int EXIT_ERROR = -1;
+static int gfc_pool_get(char *server, unsigned short portno){
+    gfc_conn_t **link, *conn;
+    int socket_fd;
+    char probe;
+    time_t now = time(NULL);
 
-    if (gfr == NULL) {
-        fprintf(stderr, "[Client] Null client request given.\n");
-        return EXIT_ERROR;
+    do {
+        socket_fd = -1;
+
+        // most recently used connections sit at the front
+        pthread_mutex_lock(&pool_mutex);
+        link = &pool_head;
+        while ((conn = *link) != NULL) {
+            if (conn->expires > now && (socket_fd >= 0 || conn->portno != portno ||
+                    strcmp(conn->server, server) != 0)) {
+                link = &conn->next;
+                continue;
+            }
+
+            *link = conn->next;
+            pool_count--;
+            if (conn->expires <= now)
+                close(conn->socket_fd);
+            else
+                socket_fd = conn->socket_fd;
+            free(conn->server);
+            free(conn);
+        }
+        pthread_mutex_unlock(&pool_mutex);
+
+        // a readable idle connection means the server closed it
+        if (socket_fd >= 0 && recv(socket_fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT) >= 0) {
+            close(socket_fd);
+            continue;
+        }
+        if (socket_fd >= 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            close(socket_fd);
+            continue;
+        }
+        return socket_fd;
+    } while (1);
+}
+
+/**
+ * Returns a connection to the pool, or closes it if the pool is full or
+ * disabled.
+ * @param server - server name
+ * @param portno - server port
+ * @param socket_fd - connected socket with no unread data
+ * @param server_timeout - idle timeout advertised by the server
+ */
+static void gfc_pool_put(char *server, unsigned short portno, int socket_fd, int server_timeout){
+    gfc_conn_t *conn;
+    int timeout = pool_idle_timeout;
+
+    // give up on the connection a second before the server does
+    if (server_timeout - 1 < timeout)
+        timeout = server_timeout - 1;
+
+    pthread_mutex_lock(&pool_mutex);
+    if (!pool_enabled || pool_count >= pool_max_idle || timeout <= 0) {
+        pthread_mutex_unlock(&pool_mutex);
+        close(socket_fd);
+        return;
     }
 
-    // initialize variables
-    int socket_fd;
-    struct hostent *server;
-    unsigned long server_addr_nbo;
-    struct sockaddr_in server_socket_addr;
-    char full_request[200];
-    char *scheme, *method, *marker;
-    scheme = "GETFILE", method = "GET", marker = "\r\n\r\n";
-    char buffer[BUFSIZE], header_buffer[20];
-    char *content_buffer;
-    char status[50];
-    size_t file_block_size, filelen;
-    int header_processed = 0;
-    size_t data_written = 0;
-    filelen = 1;
-    int attempt_count = 0;
+    conn = malloc(sizeof(gfc_conn_t));
+    conn->server = strdup(server);
+    conn->portno = portno;
+    conn->socket_fd = socket_fd;
+    conn->expires = time(NULL) + timeout;
+    conn->next = pool_head;
+    pool_head = conn;
+    pool_count++;
+    pthread_mutex_unlock(&pool_mutex);
+}
 
-    // configure socket
-    socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_fd < 0) {
-        fprintf(stderr, "[Client] Failed to create socket.\n");
-        gfr->status = GF_ERROR;
-        return EXIT_ERROR;
+/**
+ * Hashes a server name and port into a resolver bucket (FNV-1a).
+ * @param server - server name
+ * @param portno - server port
+ * @return bucket index
+ */
+static unsigned int gfc_resolver_hash(const char *server, unsigned short portno){
+    unsigned int hash = 2166136261u;
+
+    while (*server != '\0') {
+        hash ^= (unsigned char) *server++;
+        hash *= 16777619u;
     }
+    hash ^= portno;
+    hash *= 16777619u;
+    return hash % RESOLVER_BUCKETS;
+}
 
-    // configure server
-    server = gethostbyname(gfr->server);
-	server_addr_nbo = *(unsigned long *)(server->h_addr_list[0]);
-	bzero(&server_socket_addr, sizeof(server_socket_addr));
-	server_socket_addr.sin_family = AF_INET;
-	server_socket_addr.sin_port = htons(gfr->portno);
-	server_socket_addr.sin_addr.s_addr = server_addr_nbo;
-
-    // attempt connection to socket
-    if (connect(socket_fd, (struct sockaddr *)&server_socket_addr, sizeof(server_socket_addr)) < 0) {
-        fprintf(stderr, "[Client] Failed to connect to %s:%d!\n", gfr->server, gfr->portno);
-        gfr->status = GF_ERROR;
-        return EXIT_ERROR;
+/**
+ * Looks up server:portno, from the cache if a fresh entry exists and
+ * with getaddrinfo otherwise.  The result is copied into entry so the
+ * caller does not hold the lock while connecting.
+ * @param server - server name or numeric address
+ * @param portno - server port
+ * @param entry - receives the addresses
+ * @return 0 on success, -1 if the name cannot be resolved
+ */
+static int gfc_resolve(char *server, unsigned short portno, gfc_addr_t *entry){
+    unsigned int bucket = gfc_resolver_hash(server, portno);
+    struct addrinfo hints, *result, *ai;
+    char port_string[8];
+    gfc_addr_t *cached, **link;
+    time_t now = time(NULL);
+    int status;
+
+    // fast path, a hash probe under a shared lock
+    pthread_rwlock_rdlock(&resolver_lock);
+    for (cached = resolver_table[bucket]; cached != NULL; cached = cached->next) {
+        if (cached->portno == portno && strcmp(cached->server, server) == 0 && cached->expires > now) {
+            memcpy(entry, cached, sizeof(gfc_addr_t));
+            pthread_rwlock_unlock(&resolver_lock);
+            return 0;
+        }
     }
+    pthread_rwlock_unlock(&resolver_lock);
 
-    // setup initial request
-    memset(full_request, '\0', sizeof(full_request));
-    sprintf(full_request, "%s %s %s%s", scheme, method, gfr->path, marker);
+    // slow path, getaddrinfo is reentrant unlike gethostbyname
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    snprintf(port_string, sizeof(port_string), "%u", portno);
+    if ((status = getaddrinfo(server, port_string, &hints, &result)) != 0) {
+        L(GFLOG_ERROR, "[Client] Unable to resolve %s: %s", server, gai_strerror(status));
+        return -1;
+    }
 
-    // request from server
-    if (send(socket_fd, full_request, strlen(full_request), 0) < 0) {
-        fprintf(stderr, "[Client] Received no response from %s!\n", gfr->server);
-        gfr->status = GF_ERROR;
-        return EXIT_ERROR;
+    memset(entry, 0, sizeof(gfc_addr_t));
+    for (ai = result; ai != NULL && entry->naddrs < RESOLVER_MAX_ADDRS; ai = ai->ai_next) {
+        memcpy(&entry->addrs[entry->naddrs], ai->ai_addr, ai->ai_addrlen);
+        entry->addrlens[entry->naddrs] = ai->ai_addrlen;
+        entry->naddrs++;
     }
+    freeaddrinfo(result);
+    if (entry->naddrs == 0)
+        return -1;
 
-	// wait until response is received from server
-    while (filelen - data_written > 0) {
-        // received data and set initial variables
-        file_block_size = recv(socket_fd, buffer, BUFSIZE, 0);
-        gfr->bytesreceived = gfr->bytesreceived + file_block_size;
-        content_buffer = buffer;
+    entry->portno = portno;
+    entry->expires = now + resolver_ttl;
 
-        // check if any header has been processed yet
-    	if(header_processed <= 0) {
-            memset(header_buffer, '\0', sizeof(header_buffer));
+    // replace any stale entry for the same key
+    pthread_rwlock_wrlock(&resolver_lock);
+    link = &resolver_table[bucket];
+    while ((cached = *link) != NULL) {
+        if (cached->portno == portno && strcmp(cached->server, server) == 0) {
+            *link = cached->next;
+            free(cached->server);
+            free(cached);
+            continue;
+        }
+        link = &cached->next;
+    }
+    cached = malloc(sizeof(gfc_addr_t));
+    memcpy(cached, entry, sizeof(gfc_addr_t));
+    cached->server = strdup(server);
+    cached->next = resolver_table[bucket];
+    resolver_table[bucket] = cached;
+    pthread_rwlock_unlock(&resolver_lock);
 
-            // check if any data received or if the marker exists
-            if (gfr->bytesreceived == 0) {
-                gfr->status = GF_FILE_NOT_FOUND;
-                break;
-            }
-            else if (strstr(buffer, marker) == NULL || strstr(buffer, scheme) == NULL) {
-                gfr->status = GF_INVALID;
-                break;
-            }
+    entry->server = NULL;
+    entry->next = NULL;
+    return 0;
+}
 
-            // try to scan the correct format
-            header_processed = sscanf(buffer, "GETFILE %s %zu\r\n\r\n", status, &filelen);
-            if (header_processed == EOF || header_processed < 2) {
-                header_processed = sscanf(buffer, "GETFILE %s \r\n\r\n", status);
-                gfr->status = gfc_intstatus(status);
-                break;
-            }
+/**
+ * Remembers which of the addresses of server:portno accepted a connection
+ * so later connections try it first.
+ * @param server - server name
+ * @param portno - server port
+ * @param preferred - index of the address that worked
+ */
+static void gfc_resolver_prefer(char *server, unsigned short portno, int preferred){
+    gfc_addr_t *cached;
 
-            if (strlen(gfc_strstatus(gfr->status)) == 0) {
-                gfr->status = GF_INVALID;
-                break;
-            }
+    pthread_rwlock_wrlock(&resolver_lock);
+    for (cached = resolver_table[gfc_resolver_hash(server, portno)]; cached != NULL; cached = cached->next) {
+        if (cached->portno == portno && strcmp(cached->server, server) == 0)
+            cached->preferred = preferred;
+    }
+    pthread_rwlock_unlock(&resolver_lock);
+}
 
-            // build the head buffer
-            sprintf(header_buffer, "GETFILE %s %zu\r\n\r\n", status, filelen);
-            //gfr->headerfunc(header_buffer, sizeof(header_buffer), gfr->headerarg);
+/**
+ * Waits for a non-blocking connect to finish and puts the socket back in
+ * blocking mode.
+ * @param socket_fd - socket with a connect in progress
+ * @param timeout - milliseconds to wait
+ * @return 0 once connected, -1 on failure or timeout
+ */
+static int gfc_connect_wait(int socket_fd, int timeout){
+    struct pollfd pfd;
+    socklen_t error_len = sizeof(int);
+    int error = 0;
 
-            // set the current status and file length
-            gfr->status = gfc_intstatus(status);
-            gfr->filelen = filelen;
+    pfd.fd = socket_fd;
+    pfd.events = POLLOUT;
+    while (poll(&pfd, 1, timeout) < 0)
+        if (errno != EINTR)
+            return -1;
 
-            // correct the file block size
-            file_block_size = file_block_size - strlen(header_buffer);
-            gfr->bytesreceived = file_block_size;
+    if (!(pfd.revents & (POLLOUT | POLLERR | POLLHUP)) ||
+            getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error != 0)
+        return -1;
 
-            // copy over the new content buffer
-            content_buffer = buffer + strlen(header_buffer);
-    	}
+    return fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) & ~O_NONBLOCK);
+}
 
-        // if data not being received, attempt 10 times (arbitrary number)
-        if (file_block_size <= 0 && attempt_count > 10)
-            return EXIT_ERROR;
-        else if (file_block_size <= 0)
-            attempt_count = attempt_count + 1;
+/**
+ * Opens a new connection to a server, trying each of its IPv4 and IPv6
+ * addresses in turn.
+ * @param server - server name
+ * @param portno - server port
+ * @param timeout - milliseconds allowed per address, 0 for no limit
+ * @return connected socket or -1 on failure
+ */
+static int gfc_connect(char *server, unsigned short portno, int timeout){
+    gfc_addr_t entry;
+    int socket_fd, i, index, connected;
+
+    // configure server
+    if (server == NULL || gfc_resolve(server, portno, &entry) < 0)
+        return -1;
 
-        // write data to file
-        if (file_block_size > 0 && gfr->writefunc != NULL && gfr->status == GF_OK) {
-            gfr->writefunc(content_buffer, file_block_size, gfr->writearg);
-            data_written = data_written + file_block_size;
+    // attempt connection, starting with the address that worked last time
+    for (i = 0; i < entry.naddrs; i++) {
+        index = (entry.preferred + i) % entry.naddrs;
+
+        // configure socket, connecting in the background when there is a deadline
+        socket_fd = socket(entry.addrs[index].ss_family, SOCK_STREAM | (timeout > 0 ? SOCK_NONBLOCK : 0), 0);
+        if (socket_fd < 0)
+            continue;
+
+        connected = connect(socket_fd, (struct sockaddr *) &entry.addrs[index], entry.addrlens[index]) == 0;
+        if (!connected && timeout > 0 && errno == EINPROGRESS)
+            connected = gfc_connect_wait(socket_fd, timeout) == 0;
+        else if (connected && timeout > 0)
+            connected = fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) & ~O_NONBLOCK) == 0;
+
+        if (connected) {
+            if (index != entry.preferred)
+                gfc_resolver_prefer(server, portno, index);
+            return socket_fd;
         }
+        close(socket_fd);
+    }
+
+    L(GFLOG_ERROR, "[Client] Failed to connect to %s:%d!", server, portno);
+    return -1;
+}
+
+/**
+ * Limits how long a receive on the socket may block.
+ * @param socket_fd - connected socket
+ * @param timeout - milliseconds, 0 for no limit
+ */
+static void gfc_set_recv_timeout(int socket_fd, int timeout){
+    struct timeval tv;
+
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/**
+ * Returns the current time in microseconds on the monotonic clock.
+ */
+static long gfc_now_us(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+/**
+ * Records how long a server took to start responding.  Only called once a
+ * whole header has arrived, so a pooled connection found closed doesn't
+ * count as an instant answer.
+ * @param latency - milliseconds from sending the request to the header
+ */
+static void gfc_hedge_record(int latency){
+    pthread_mutex_lock(&hedge_mutex);
+    hedge_samples[hedge_next] = latency;
+    hedge_next = (hedge_next + 1) % HEDGE_SAMPLES;
+    if (hedge_count < HEDGE_SAMPLES)
+        hedge_count++;
+    pthread_mutex_unlock(&hedge_mutex);
+}
+
+static int gfc_compare_int(const void *a, const void *b){
+    return *(const int *) a - *(const int *) b;
+}
+
+/**
+ * Returns how long to wait for the first byte before hedging: the
+ * configured percentile of recent first byte latencies, but never less
+ * than the minimum delay.
+ * @return delay in milliseconds
+ */
+static int gfc_hedge_delay(){
+    int samples[HEDGE_SAMPLES];
+    int count, delay;
 
+    pthread_mutex_lock(&hedge_mutex);
+    count = hedge_count;
+    memcpy(samples, hedge_samples, count * sizeof(int));
+    delay = hedge_min_delay;
+    pthread_mutex_unlock(&hedge_mutex);
+
+    if (count >= HEDGE_MIN_SAMPLES) {
+        qsort(samples, count, sizeof(int), gfc_compare_int);
+        if (samples[(count - 1) * hedge_percentile / 100] > delay)
+            delay = samples[(count - 1) * hedge_percentile / 100];
     }
+    return delay;
+}
 
-    // close connection, check for status type to decide what to give back
-    close(socket_fd);
-    if (gfr->status == GF_OK || gfr->status == GF_FILE_NOT_FOUND ||
-        gfr->status == GF_ERROR)
-        return EXIT_SUCCESS;
-    else
-        return EXIT_ERROR;
+/**
+ * Waits for the server to start responding and, if it has not by the
+ * hedge delay, sends the same request to the replica.  Whichever answers
+ * first is kept in socket_fd and the other connection is closed, which
+ * cancels its transfer.
+ * @param gfr - pointer to gfcrequest_t with a replica set
+ * @param socket_fd - socket the request was sent on, replaced by the winner
+ * @param server - receives the name of the server that answered
+ * @param portno - receives the port of the server that answered
+ * @param reused - cleared if the winner is a new connection
+ * @param request - request line to send to the replica
+ * @param request_len - length of the request line
+ */
+static void gfc_hedge(gfcrequest_t *gfr, int *socket_fd, char **server, unsigned short *portno,
+        int *reused, char *request, size_t request_len){
+    struct pollfd pfds[2];
+    int hedge_fd, hedge_reused, ready, timeout;
+    char peek;
+
+    pfds[0].fd = *socket_fd;
+    pfds[0].events = POLLIN;
+    while ((ready = poll(pfds, 1, gfc_hedge_delay())) < 0 && errno == EINTR)
+        ;
+    if (ready != 0)
+        return;
+
+    // the first server is slow, duplicate the request to the replica
+    hedge_fd = pool_enabled ? gfc_pool_get(gfr->hedge_server, gfr->hedge_portno) : -1;
+    hedge_reused = hedge_fd >= 0;
+    if (!hedge_reused)
+        hedge_fd = gfc_connect(gfr->hedge_server, gfr->hedge_portno, gfr->connect_timeout);
+    if (hedge_fd < 0)
+        return;
+    if (send(hedge_fd, request, request_len, MSG_NOSIGNAL) < 0) {
+        close(hedge_fd);
+        return;
+    }
+
+    pfds[1].fd = hedge_fd;
+    pfds[1].events = POLLIN;
+    timeout = gfr->read_timeout > 0 ? gfr->read_timeout : -1;
+    while ((ready = poll(pfds, 2, timeout)) < 0 && errno == EINTR)
+        ;
+
+    // a replica that answered while the first server is still silent wins,
+    // unless what woke us was a stale pooled connection being closed
+    if (ready > 0 && (pfds[1].revents & POLLIN) && !(pfds[0].revents & POLLIN) &&
+            recv(hedge_fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) > 0) {
+        close(*socket_fd);
+        *socket_fd = hedge_fd;
+        *server = gfr->hedge_server;
+        *portno = gfr->hedge_portno;
+        *reused = hedge_reused;
+        if (gfr->read_timeout > 0)
+            gfc_set_recv_timeout(hedge_fd, gfr->read_timeout);
+        return;
+    }
+    close(hedge_fd);
 }
 
 /**
- * Returns the status of the response.
+ * Builds the key the response to gfr is cached under.  The accepted
+ * encodings are part of it since they decide which variant is sent.
  * @param gfr - pointer to gfcrequest_t
- * @return gfstatus_t - status associated with request
+ * @param key - buffer of CACHE_KEY_MAX bytes
+ * @return 0 on success, -1 if the request cannot be cached
  */
-gfstatus_t gfc_get_status(gfcrequest_t *gfr){
-    return gfr->status;
+static int gfc_cache_key(gfcrequest_t *gfr, char *key){
+    int len;
+
+    if (gfr->server == NULL || gfr->path == NULL)
+        return -1;
+    len = snprintf(key, CACHE_KEY_MAX, "%s:%u%s %s", gfr->server, gfr->portno, gfr->path,
+            gfr->accept_encoding != NULL ? gfr->accept_encoding : "");
+    return (len < 0 || len >= CACHE_KEY_MAX) ? -1 : 0;
 }
 
-/*
- * Returns the string associated with the input status
- * @param status - a gfstatus_t showing status of request
- * @return char* of status
+/**
+ * Hashes a cache key (64-bit FNV-1a).
+ * @param key - cache key
+ * @return hash of the key
  */
-char* gfc_strstatus(gfstatus_t status){
-    char *statusString = "";
+static unsigned long long gfc_cache_hash(const char *key){
+    unsigned long long hash = 14695981039346656037ULL;
 
-    switch (status) {
-        case GF_OK:
-            statusString = "OK";
-            break;
-        case GF_FILE_NOT_FOUND:
-            statusString = "FILE_NOT_FOUND";
-            break;
-        case GF_ERROR:
-            statusString = "ERROR";
-            break;
-        case GF_INVALID:
-            statusString = "INVALID";
-            break;
-        default:
-            break;
+    while (*key != '\0') {
+        hash ^= (unsigned char) *key++;
+        hash *= 1099511628211ULL;
     }
-    return statusString;
+    return hash;
 }
 
-/*
- * Returns the integer associated with the input status
- * @param status - a string of the status
- * @return int gfc status
+/**
+ * Frees a cached object once it is neither resident nor in use.  Must be
+ * called with cache_mutex held.
+ * @param entry - cached object
  */
-int gfc_intstatus(char *status) {
-    const char *OK = "OK";
-    const char *FILE_NOT_FOUND = "FILE_NOT_FOUND";
-    const char *ERROR = "ERROR";
-    const char *INVALID = "INVALID";
+static void gfc_cache_free_locked(gfc_cached_t *entry){
+    if (entry->refs > 0 || entry->resident)
+        return;
+    if (entry->map != NULL)
+        munmap(entry->map, entry->map_len);
+    else
+        free(entry->data);
+    free(entry->key);
+    free(entry);
+}
 
-    if (strcmp(status, OK) == 0)
-        return GF_OK;
-    if (strcmp(status, FILE_NOT_FOUND) == 0)
-        return GF_FILE_NOT_FOUND;
-    if (strcmp(status, ERROR) == 0)
-        return GF_ERROR;
-    if (strcmp(status, INVALID) == 0)
-        return GF_INVALID;
+/**
+ * Drops an object from the memory tier.  Must be called with cache_mutex
+ * held.
+ * @param entry - resident cached object
+ */
+static void gfc_cache_evict_locked(gfc_cached_t *entry){
+    gfc_cached_t **link = &cache_table[gfc_cache_hash(entry->key) % CACHE_BUCKETS];
 
-    return -1;
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+
+    if (entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        cache_lru_head = entry->lru_next;
+    if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        cache_lru_tail = entry->lru_prev;
+
+    cache_mem_used -= entry->len;
+    entry->resident = 0;
+    gfc_cache_free_locked(entry);
 }
 
 /**
- * Returns the length of the file as indicated by the response header.
- * Value is not specified if the response status is not OK.
- * @param gfr - pointer to gfcrequest_t
- * @return size_t - size of file requested
+ * Makes an object resident in the memory tier, replacing any older copy
+ * and evicting the least recently used objects to stay within the limit.
+ * Objects held only as a mapping of their disk copy, or larger than an
+ * eighth of the limit, are not kept in memory.  Must be called with
+ * cache_mutex held.
+ * @param entry - cached object not yet resident
  */
-size_t gfc_get_filelen(gfcrequest_t *gfr){
-    return gfr->filelen;
+static void gfc_cache_insert_locked(gfc_cached_t *entry){
+    unsigned int bucket = gfc_cache_hash(entry->key) % CACHE_BUCKETS;
+    gfc_cached_t *old;
+
+    for (old = cache_table[bucket]; old != NULL; old = old->next) {
+        if (strcmp(old->key, entry->key) == 0) {
+            gfc_cache_evict_locked(old);
+            break;
+        }
+    }
+
+    if (entry->map != NULL || entry->len > cache_mem_limit / 8)
+        return;
+    while (cache_lru_tail != NULL && cache_mem_used + entry->len > cache_mem_limit)
+        gfc_cache_evict_locked(cache_lru_tail);
+
+    entry->resident = 1;
+    entry->next = cache_table[bucket];
+    cache_table[bucket] = entry;
+    entry->lru_prev = NULL;
+    entry->lru_next = cache_lru_head;
+    if (cache_lru_head != NULL)
+        cache_lru_head->lru_prev = entry;
+    else
+        cache_lru_tail = entry;
+    cache_lru_head = entry;
+    cache_mem_used += entry->len;
 }
 
 /**
- * Returns actual number of bytes received before the connection is closed.
- * This may be distinct from the result of gfc_get_filelen when the response
- * status is OK but the connection is reset before the transfer is completed.
- * @param gfr - pointer to gfcrequest_t
- * @return size_t - how many bytes received so far
+ * Releases an object returned by gfc_cache_lookup.
+ * @param entry - cached object
  */
-size_t gfc_get_bytesreceived(gfcrequest_t *gfr){
-    return gfr->bytesreceived;
+static void gfc_cache_release(gfc_cached_t *entry){
+    pthread_mutex_lock(&cache_mutex);
+    entry->refs--;
+    gfc_cache_free_locked(entry);
+    pthread_mutex_unlock(&cache_mutex);
 }
 
-/*
- * Frees memory associated with the request.
+/**
+ * Loads an object from the disk tier.  The file starts with a line
+ * "GFCACHE <expires> <len> <tag> <encoding> <key>", empty fields being
+ * written as "-", followed by the body.  The expiry is zero padded to a
+ * fixed width so a renewed lease can be written in place.
+ * @param key - cache key
+ * @return object with one reference held, or NULL if there is no copy
  */
-void gfc_cleanup(gfcrequest_t *gfr){
-    printf("[Client] Performing cleanup of resources.\n");
-    free(gfr);
+static gfc_cached_t *gfc_cache_load(const char *key){
+    char path[PATH_MAX], line[CACHE_KEY_MAX + 128], tag[MAX_TAG_LEN + 1], encoding[MAX_ENCODING_LEN + 1];
+    gfc_cached_t *entry;
+    struct stat st;
+    long long expires;
+    size_t len, line_len;
+    ssize_t read_len;
+    char *end;
+    int fd, key_at;
+
+    snprintf(path, sizeof(path), "%s/%016llx", cache_dir, gfc_cache_hash(key));
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+
+    // a copy under another key that hashes alike or a torn file is a miss
+    read_len = pread(fd, line, sizeof(line) - 1, 0);
+    line[read_len > 0 ? read_len : 0] = '\0';
+    if ((end = strchr(line, '\n')) == NULL || fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    *end = '\0';
+    line_len = end - line + 1;
+    if (sscanf(line, "GFCACHE %lld %zu %32s %32s %n", &expires, &len, tag, encoding, &key_at) < 4 ||
+            strcmp(line + key_at, key) != 0 || (size_t) st.st_size != line_len + len) {
+        close(fd);
+        return NULL;
+    }
+
+    entry = calloc(1, sizeof(gfc_cached_t));
+    entry->key = strdup(key);
+    if (strcmp(tag, "-") != 0)
+        strcpy(entry->tag, tag);
+    if (strcmp(encoding, "-") != 0)
+        strcpy(entry->encoding, encoding);
+    entry->expires = expires;
+    entry->len = len;
+    entry->refs = 1;
+
+    // small bodies are read into memory, large ones are served from a mapping
+    if (len <= cache_mem_limit / 8) {
+        entry->data = malloc(len > 0 ? len : 1);
+        if (pread(fd, entry->data, len, line_len) != (ssize_t) len) {
+            free(entry->data);
+            entry->data = NULL;
+        }
+    }
+    else {
+        entry->map_len = st.st_size;
+        entry->map = mmap(NULL, entry->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (entry->map == MAP_FAILED)
+            entry->map = NULL;
+        else
+            entry->data = (char *) entry->map + line_len;
+    }
+    close(fd);
+
+    if (entry->data == NULL) {
+        free(entry->key);
+        free(entry);
+        return NULL;
+    }
+    return entry;
 }
 
-/* Not needed */
-void gfc_global_init(){
+/**
+ * Looks an object up in the memory tier, then the disk tier.
+ * @param key - cache key
+ * @param expires - receives the end of the object's lease
+ * @return object with one reference held, to be passed to
+ *         gfc_cache_release, or NULL on a miss
+ */
+static gfc_cached_t *gfc_cache_lookup(const char *key, time_t *expires){
+    gfc_cached_t *entry;
+
+    pthread_mutex_lock(&cache_mutex);
+    for (entry = cache_table[gfc_cache_hash(key) % CACHE_BUCKETS]; entry != NULL; entry = entry->next)
+        if (strcmp(entry->key, key) == 0)
+            break;
+
+    // most recently used objects sit at the front
+    if (entry != NULL && entry != cache_lru_head) {
+        entry->lru_prev->lru_next = entry->lru_next;
+        if (entry->lru_next != NULL)
+            entry->lru_next->lru_prev = entry->lru_prev;
+        else
+            cache_lru_tail = entry->lru_prev;
+        entry->lru_prev = NULL;
+        entry->lru_next = cache_lru_head;
+        cache_lru_head->lru_prev = entry;
+        cache_lru_head = entry;
+    }
+    if (entry != NULL) {
+        entry->refs++;
+        *expires = entry->expires;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    if (entry == NULL && cache_dir != NULL && (entry = gfc_cache_load(key)) != NULL) {
+        *expires = entry->expires;
+        pthread_mutex_lock(&cache_mutex);
+        gfc_cache_insert_locked(entry);
+        pthread_mutex_unlock(&cache_mutex);
+    }
+    return entry;
 }
 
-/* Not needed */
-void gfc_global_cleanup(){
+/**
+ * Extends the lease of a cached object after the server confirmed it is
+ * still current.
+ * @param entry - cached object
+ * @param expires - new end of the lease
+ */
+static void gfc_cache_renew(gfc_cached_t *entry, time_t expires){
+    char path[PATH_MAX], field[32];
+    int fd;
+
+    pthread_mutex_lock(&cache_mutex);
+    entry->expires = expires;
+    pthread_mutex_unlock(&cache_mutex);
+
+    if (cache_dir == NULL)
+        return;
+    snprintf(path, sizeof(path), "%s/%016llx", cache_dir, gfc_cache_hash(entry->key));
+    snprintf(field, sizeof(field), "%020lld", (long long) expires);
+    if ((fd = open(path, O_WRONLY)) >= 0) {
+        if (pwrite(fd, field, 20, strlen("GFCACHE ")) != 20)
+            L(GFLOG_ERROR, "[Client] Unable to renew cached %s", path);
+        close(fd);
+    }
+}
+
+/**
+ * Completes gfr from a cached object as if the server had sent it.
+ * @param gfr - pointer to gfcrequest_t
+ * @param entry - cached object
+ */
+static void gfc_cache_serve(gfcrequest_t *gfr, gfc_cached_t *entry){
+    char header[200];
+    int header_len;
+
+    gfr->status = GF_OK;
+    gfr->filelen = entry->len;
+    strcpy(gfr->resp_tag, entry->tag);
+    strcpy(gfr->resp_encoding, entry->encoding);
+
+    if (gfr->headerfunc != NULL) {
+        header_len = snprintf(header, sizeof(header), "GETFILE OK %zu", entry->len);
+        if (entry->tag[0] != '\0')
+            header_len += snprintf(header + header_len, sizeof(header) - header_len, " TAG=%s", entry->tag);
+        if (entry->encoding[0] != '\0')
+            header_len += snprintf(header + header_len, sizeof(header) - header_len, " ENC=%s", entry->encoding);
+        header_len += snprintf(header + header_len, sizeof(header) - header_len, "\r\n\r\n");
+        gfr->headerfunc(header, header_len, gfr->headerarg);
+    }
+    if (entry->len > 0 && gfr->writefunc != NULL)
+        gfr->writefunc(entry->data, entry->len, gfr->writearg);
+    gfr->bytesreceived = entry->len;
+}
+
+/**
+ * Starts adding the body of a tagged OK response to the cache.
+ * @param gfr - pointer to gfcrequest_t with the response header parsed
+ * @param key - cache key
+ * @return fill to pass body bytes to, or NULL if the response is not cached
+ */
+static gfc_cache_fill_t *gfc_cache_fill_start(gfcrequest_t *gfr, const char *key){
+    gfc_cache_fill_t *fill;
+    gfc_cached_t *entry;
+    char line[CACHE_KEY_MAX + 128];
+    int line_len;
+
+    if (gfr->resp_tag[0] == '\0' || (cache_dir == NULL && gfr->filelen > cache_mem_limit / 8))
+        return NULL;
+
+    entry = calloc(1, sizeof(gfc_cached_t));
+    entry->key = strdup(key);
+    strcpy(entry->tag, gfr->resp_tag);
+    strcpy(entry->encoding, gfr->resp_encoding);
+    entry->expires = time(NULL) + (gfr->resp_lease > 0 ? gfr->resp_lease : 0);
+    entry->len = gfr->filelen;
+    if (entry->len <= cache_mem_limit / 8)
+        entry->data = malloc(entry->len > 0 ? entry->len : 1);
+
+    fill = calloc(1, sizeof(gfc_cache_fill_t));
+    fill->fd = -1;
+    fill->entry = entry;
+    if (cache_dir == NULL)
+        return fill;
+
+    // write to a temporary file that only takes the real name once complete
+    snprintf(fill->path, sizeof(fill->path), "%s/%016llx", cache_dir, gfc_cache_hash(key));
+    snprintf(fill->tmp_path, sizeof(fill->tmp_path), "%s/%016llx.XXXXXX", cache_dir, gfc_cache_hash(key));
+    line_len = snprintf(line, sizeof(line), "GFCACHE %020lld %zu %s %s %s\n", (long long) entry->expires,
+            entry->len, entry->tag, entry->encoding[0] != '\0' ? entry->encoding : "-", key);
+    if ((fill->fd = mkstemp(fill->tmp_path)) < 0 || write(fill->fd, line, line_len) != line_len) {
+        if (fill->fd >= 0) {
+            close(fill->fd);
+            unlink(fill->tmp_path);
+            fill->fd = -1;
+        }
+        if (entry->data == NULL) {
+            free(entry->key);
+            free(entry);
+            free(fill);
+            return NULL;
+        }
+    }
+    return fill;
+}
+
+/**
+ * Adds received body bytes to a cache fill.
+ * @param fill - fill started by gfc_cache_fill_start
+ * @param data - body bytes
+ * @param len - number of bytes
+ */
+static void gfc_cache_fill_write(gfc_cache_fill_t *fill, const char *data, size_t len){
+    ssize_t written;
+    size_t done = 0;
+
+    if (fill->written + len > fill->entry->len)
+        return;
+    if (fill->entry->data != NULL)
+        memcpy(fill->entry->data + fill->written, data, len);
+    while (fill->fd >= 0 && done < len) {
+        if ((written = write(fill->fd, data + done, len - done)) < 0 && errno == EINTR)
+            continue;
+        if (written < 0) {
+            close(fill->fd);
+            unlink(fill->tmp_path);
+            fill->fd = -1;
+            break;
+        }
+        done += written;
+    }
+    fill->written += len;
+}
+
+/**
+ * Ends a cache fill, publishing the object if the whole body arrived and
+ * discarding it otherwise.
+ * @param fill - fill started by gfc_cache_fill_start
+ * @param complete - nonzero if the body was received in full
+ */
+static void gfc_cache_fill_end(gfc_cache_fill_t *fill, int complete){
+    gfc_cached_t *entry = fill->entry;
+
+    complete = complete && fill->written == entry->len;
+    if (fill->fd >= 0) {
+        close(fill->fd);
+        if (!complete || rename(fill->tmp_path, fill->path) < 0)
+            unlink(fill->tmp_path);
+    }
+
+    if (complete && entry->data != NULL) {
+        pthread_mutex_lock(&cache_mutex);
+        gfc_cache_insert_locked(entry);
+        gfc_cache_free_locked(entry);
+        pthread_mutex_unlock(&cache_mutex);
+    }
+    else {
+        free(entry->data);
+        free(entry->key);
+        free(entry);
+    }
+    free(fill);
+}
+
+/**
+ * Writes the request line for gfr, including any options, into request.
+ * @param gfr - pointer to gfcrequest_t
+ * @param tag - content tag to revalidate, or NULL for an unconditional GET
+ * @param request - buffer for the request
+ * @param size - size of the buffer
+ * @return length of the request or -1 if it does not fit
+ */
+static int gfc_build_request(gfcrequest_t *gfr, const char *tag, char *request, size_t size){
+    char *scheme = "GETFILE", *method = "GET", *marker = "\r\n\r\n";
+    int request_len;
+
+    if (gfr->path == NULL) {
+        L(GFLOG_ERROR, "[Client] No path set for request.");
+        return -1;
+    }
+
+    memset(request, '\0', size);
+    request_len = snprintf(request, size, "%s %s %s", scheme, method, gfr->path);
+    if (tag != NULL && request_len < (int) size)
+        request_len += snprintf(request + request_len, size - request_len, " TAG=%s", tag);
+    if (gfr->accept_encoding != NULL && request_len < (int) size)
+        request_len += snprintf(request + request_len, size - request_len, " ENC=%s", gfr->accept_encoding);
+    if (pool_enabled && request_len < (int) size)
+        request_len += snprintf(request + request_len, size - request_len, " KEEPALIVE=1");
+    if (request_len + strlen(marker) >= size) {
+        L(GFLOG_ERROR, "[Client] Request for %s is too long.", gfr->path);
+        return -1;
+    }
+    strcat(request, marker);
+
+    return request_len + strlen(marker);
+}
+
+/**
+ * Parses a complete, null-terminated response header into gfr.
+ * @param gfr - pointer to gfcrequest_t
+ * @param header - header text up to and including the marker
+ * @param keepalive - receives the server's keep-alive timeout, 0 if none
+ * @return 0 if the header is valid, -1 otherwise
+ */
+static int gfc_parse_header(gfcrequest_t *gfr, char *header, int *keepalive){
+    char status[50];
+    char *option;
+    size_t filelen;
+    int fields;
+
+    *keepalive = 0;
+    fields = sscanf(header, "GETFILE %49s %zu", status, &filelen);
+    if (strncmp(header, "GETFILE ", 8) != 0 || fields < 1 ||
+            (int) (gfr->status = gfc_intstatus(status)) < 0 || (gfr->status == GF_OK && fields < 2)) {
+        gfr->status = GF_INVALID;
+        return -1;
+    }
+    if (gfr->status == GF_OK)
+        gfr->filelen = filelen;
+
+    // options follow the status line
+    if ((option = strstr(header, " TAG=")) != NULL)
+        sscanf(option, " TAG=%32[0-9a-zA-Z]", gfr->resp_tag);
+    if ((option = strstr(header, " ENC=")) != NULL)
+        sscanf(option, " ENC=%32[0-9a-zA-Z_-]", gfr->resp_encoding);
+    gfr->resp_lease = 0;
+    if ((option = strstr(header, " LEASE=")) != NULL)
+        sscanf(option, " LEASE=%d", &gfr->resp_lease);
+    if ((option = strstr(header, " KEEPALIVE=")) != NULL)
+        sscanf(option, " KEEPALIVE=%d", keepalive);
+
+    return 0;
+}
+
+/**
+ * Reads from the socket until the end of the response header has been
+ * received.  The header may arrive split across any number of reads, and
+ * bytes following it are left in the buffer for the caller.
+ * @param socket_fd - connected socket
+ * @param header - buffer of at least HEADER_MAX + 1 bytes
+ * @param header_len - receives the number of bytes read into header
+ * @return pointer just past the header marker, NULL if the connection ended
+ *         or the header did not fit, with errno telling which
+ */
+static char *gfc_recv_header(int socket_fd, char *header, size_t *header_len){
+    char *header_end;
+    ssize_t len;
+
+    *header_len = 0;
+    header[0] = '\0';
+    while (*header_len < HEADER_MAX) {
+        len = recv(socket_fd, header + *header_len, HEADER_MAX - *header_len, 0);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len == 0)
+            errno = ECONNRESET;
+        if (len <= 0)
+            return NULL;
+
+        // only the newly read bytes and the three before them can complete the marker
+        *header_len += len;
+        header[*header_len] = '\0';
+        header_end = strstr(header + (*header_len - len > 3 ? *header_len - len - 3 : 0), "\r\n\r\n");
+        if (header_end != NULL)
+            return header_end + 4;
+    }
+    errno = EMSGSIZE;
+    return NULL;
+}
+
+/**
+ * Performs the transfer over the network.  When a cached copy is given it
+ * is revalidated with its tag and served if the server confirms it, and
+ * with a cache key a fresh tagged response is added to the cache.
+ * @param gfr - pointer to gfcrequest_t
+ * @param cache_key - key to cache the response under, or NULL
+ * @param cached - cached copy whose lease has ended, or NULL
+ * @return integer based on result of function
+ */
+static int gfc_fetch(gfcrequest_t *gfr, const char *cache_key, gfc_cached_t *cached){
+    int EXIT_ERROR = -1;
+
+    // initialize variables
+    int socket_fd;
+    int reused, keepalive = 0, complete = 0, parsed, timed_out = 0, revalidated;
+    char *conn_server = gfr->server;
+    unsigned short conn_portno = gfr->portno;
+    ssize_t sent, len;
+    long sent_at;
+    char full_request[512];
+    size_t request_len;
+    char header[HEADER_MAX + 1];
+    char *header_end, saved;
+    size_t header_len, header_size;
+    char *buffer;
+    size_t buffer_size, remaining;
+    size_t data_written = 0;
+    gfc_cache_fill_t *fill = NULL;
+
+    // reuse an idle connection to the same server if there is one
+    socket_fd = pool_enabled ? gfc_pool_get(gfr->server, gfr->portno) : -1;
+    reused = socket_fd >= 0;
+    if (!reused && (socket_fd = gfc_connect(gfr->server, gfr->portno, gfr->connect_timeout)) < 0) {
+        gfr->status = GF_ERROR;
+        return EXIT_ERROR;
+    }
+    if (!reused)
+        gfr->connect_time = gfc_now_us() - gfr->start_time;
+    PROBE(gfclient, connected, gfr, reused);
+    if (gfr->read_timeout > 0)
+        gfc_set_recv_timeout(socket_fd, gfr->read_timeout);
+
+    // setup initial request
+    if (gfc_build_request(gfr, cached != NULL ? cached->tag : gfr->tag, full_request, sizeof(full_request)) < 0) {
+        close(socket_fd);
+        gfr->status = GF_ERROR;
+        return EXIT_ERROR;
+    }
+    request_len = strlen(full_request);
+
+    // request from server and read the header, a pooled connection may have
+    // gone stale, in which case the request is retried once on a new one
+    for (;;) {
+        sent_at = gfc_now_us();
+        sent = send(socket_fd, full_request, request_len, MSG_NOSIGNAL);
+        if (sent >= 0 && gfr->hedge_server != NULL)
+            gfc_hedge(gfr, &socket_fd, &conn_server, &conn_portno, &reused, full_request, request_len);
+        header_end = (sent < 0) ? NULL : gfc_recv_header(socket_fd, header, &header_len);
+        timed_out = header_end == NULL && sent >= 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        if (header_end != NULL || !reused || timed_out || (sent >= 0 && header_len > 0))
+            break;
+
+        close(socket_fd);
+        reused = 0;
+        conn_server = gfr->server;
+        conn_portno = gfr->portno;
+        if ((socket_fd = gfc_connect(gfr->server, gfr->portno, gfr->connect_timeout)) < 0) {
+            gfr->status = GF_ERROR;
+            return EXIT_ERROR;
+        }
+        gfr->connect_time = gfc_now_us() - gfr->start_time;
+        PROBE(gfclient, connected, gfr, 0);
+        if (gfr->read_timeout > 0)
+            gfc_set_recv_timeout(socket_fd, gfr->read_timeout);
+    }
+    if (header_end != NULL) {
+        gfr->header_time = gfc_now_us() - gfr->start_time;
+        if (gfr->hedge_server != NULL)
+            gfc_hedge_record((gfc_now_us() - sent_at) / 1000);
+    }
+    if (timed_out) {
+        L(GFLOG_ERROR, "[Client] Timed out waiting for a response from %s!", conn_server);
+        close(socket_fd);
+        gfr->status = GF_ERROR;
+        return EXIT_ERROR;
+    }
+    if (sent < 0) {
+        L(GFLOG_ERROR, "[Client] Received no response from %s!", gfr->server);
+        close(socket_fd);
+        gfr->status = GF_ERROR;
+        return EXIT_ERROR;
+    }
+    if (header_end == NULL) {
+        close(socket_fd);
+        gfr->status = GF_INVALID;
+        return EXIT_ERROR;
+    }
+
+    // parse only the header, body bytes may follow the marker
+    header_size = header_end - header;
+    saved = *header_end;
+    *header_end = '\0';
+    parsed = gfc_parse_header(gfr, header, &keepalive);
+    *header_end = saved;
+    if (parsed < 0) {
+        close(socket_fd);
+        return EXIT_ERROR;
+    }
+    PROBE(gfclient, header_received, gfr, gfr->status, gfr->filelen);
+
+    // the cached copy is still current, serve it under a new lease
+    revalidated = cached != NULL && gfr->status == GF_NOT_MODIFIED;
+    if (revalidated) {
+        gfc_cache_renew(cached, time(NULL) + (gfr->resp_lease > 0 ? gfr->resp_lease : 0));
+        gfc_cache_serve(gfr, cached);
+    }
+    else if (gfr->headerfunc != NULL)
+        gfr->headerfunc(header, header_size, gfr->headerarg);
+
+    if (revalidated || gfr->status != GF_OK) {
+        complete = header_len == header_size;
+    }
+    else {
+        if (cache_key != NULL)
+            fill = gfc_cache_fill_start(gfr, cache_key);
+
+        // body bytes that arrived with the header go straight to the writer
+        if (header_len > header_size && gfr->writefunc != NULL)
+            gfr->writefunc(header_end, header_len - header_size, gfr->writearg);
+        if (header_len > header_size && fill != NULL)
+            gfc_cache_fill_write(fill, header_end, header_len - header_size);
+        data_written = header_len - header_size;
+        gfr->bytesreceived = data_written;
+
+        // size the receive buffer to the body, growing it while reads fill it
+        remaining = gfr->filelen > data_written ? gfr->filelen - data_written : 0;
+        buffer_size = remaining < RECV_BUFSIZE_MIN ? RECV_BUFSIZE_MIN : remaining;
+        buffer_size = buffer_size > RECV_BUFSIZE_MIN * 4 ? RECV_BUFSIZE_MIN * 4 : buffer_size;
+        buffer = (remaining > 0) ? malloc(buffer_size) : NULL;
+
+        while (data_written < gfr->filelen) {
+            remaining = gfr->filelen - data_written;
+            len = recv(socket_fd, buffer, remaining < buffer_size ? remaining : buffer_size, 0);
+            if (len < 0 && errno == EINTR)
+                continue;
+            timed_out = len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            if (len <= 0)
+                break;
+
+            if (gfr->writefunc != NULL)
+                gfr->writefunc(buffer, len, gfr->writearg);
+            if (fill != NULL)
+                gfc_cache_fill_write(fill, buffer, len);
+            data_written += len;
+            gfr->bytesreceived = data_written;
+
+            if ((size_t) len == buffer_size && buffer_size < RECV_BUFSIZE_MAX && remaining > buffer_size) {
+                char *grown = realloc(buffer, buffer_size * 2);
+                if (grown != NULL) {
+                    buffer = grown;
+                    buffer_size *= 2;
+                }
+            }
+        }
+        free(buffer);
+        complete = data_written == gfr->filelen;
+        if (fill != NULL)
+            gfc_cache_fill_end(fill, complete);
+    }
+
+    // keep the connection if the server agreed and nothing is left unread,
+    // otherwise close it, then check for status type to decide what to give back
+    if (keepalive > 0 && complete) {
+        if (gfr->read_timeout > 0)
+            gfc_set_recv_timeout(socket_fd, 0);
+        gfc_pool_put(conn_server, conn_portno, socket_fd, keepalive);
+    }
+    else
+        close(socket_fd);
+    if (!complete && gfr->status == GF_OK) {
+        L(GFLOG_ERROR, "[Client] %s after %zu of %zu bytes!",
+                timed_out ? "Timed out" : "Connection closed", data_written, gfr->filelen);
+        return EXIT_ERROR;
+    }
+    if (gfr->status == GF_OK || gfr->status == GF_FILE_NOT_FOUND ||
+        gfr->status == GF_ERROR || gfr->status == GF_NOT_MODIFIED)
+        return EXIT_SUCCESS;
+    else
+        return EXIT_ERROR;
+}
+
+/*
+ * Performs the transfer as described in the options.  Returns a value of 0
+ * if the communication is successful, including the case where the server
+ * returns a response with a FILE_NOT_FOUND or ERROR response.  If the
+ * communication is not successful (e.g. the connection is closed before
+ * transfer is complete or an invalid header is returned), then a negative
+ * integer will be returned.
+ * @param gfr - pointer to gfcrequest_t
+ * @return integer based on result of function
+ */
+int gfc_perform(gfcrequest_t *gfr){
+    char cache_key[CACHE_KEY_MAX];
+    gfc_cached_t *cached;
+    time_t expires;
+    int result;
+
+    if (gfr == NULL) {
+        L(GFLOG_ERROR, "[Client] Null client request given.");
+        return -1;
+    }
+    gfr->start_time = gfc_now_us();
+    gfr->connect_time = 0;
+    gfr->header_time = 0;
+    PROBE(gfclient, perform_start, gfr, gfr->path);
+
+    // a caller revalidating its own copy bypasses the cache
+    if (!cache_enabled || gfr->tag != NULL || gfc_cache_key(gfr, cache_key) < 0)
+        result = gfc_fetch(gfr, NULL, NULL);
+
+    // serve locally while the lease holds
+    else if ((cached = gfc_cache_lookup(cache_key, &expires)) != NULL && expires > time(NULL)) {
+        gfc_cache_serve(gfr, cached);
+        gfc_cache_release(cached);
+        result = 0;
+    }
+    else {
+        result = gfc_fetch(gfr, cache_key, cached);
+        if (cached != NULL)
+            gfc_cache_release(cached);
+    }
+
+    PROBE(gfclient, perform_done, gfr, result, gfr->status, gfr->bytesreceived);
+    return result;
+}
+
+// states of a transfer driven by a gfcmulti_t
+typedef enum {
+    GFC_CONNECTING,
+    GFC_SENDING,
+    GFC_HEADER,
+    GFC_BODY
+} gfc_state_t;
+
+// a request in flight on a multi handle
+typedef struct gfc_transfer_t {
+    gfcrequest_t *gfr;
+    gfc_state_t state;
+    int socket_fd;
+    int reused;
+    int keepalive;
+    int result;
+
+    // when the current connect or wait for data gives up, 0 for never
+    long deadline;
+
+    // addresses still to try while connecting
+    gfc_addr_t addr;
+    int addr_tries;
+
+    char request[512];
+    size_t request_len;
+    size_t request_sent;
+
+    char header[HEADER_MAX + 1];
+    size_t header_len;
+    size_t data_written;
+
+    struct gfc_transfer_t *prev;
+    struct gfc_transfer_t *next;
+} gfc_transfer_t;
+
+// multi handle, drives many transfers from one thread
+struct gfcmulti_t {
+    int epoll_fd;
+    int running;
+    gfc_transfer_t *active;
+    gfc_transfer_t *done_head;
+    gfc_transfer_t *done_tail;
+    char buffer[RECV_BUFSIZE_MIN];
+};
+
+/**
+ * Creates a multi handle.
+ * @return gfcmulti_t handle or NULL on failure
+ */
+gfcmulti_t *gfc_multi_create(){
+    gfcmulti_t *gfm = calloc(1, sizeof(gfcmulti_t));
+
+    if (gfm != NULL && (gfm->epoll_fd = epoll_create1(0)) < 0) {
+        free(gfm);
+        return NULL;
+    }
+    return gfm;
+}
+
+/**
+ * Moves a transfer from the active list to the done queue, handing its
+ * connection to the pool when it can be reused.
+ * @param gfm - multi handle
+ * @param xfer - transfer that ended
+ * @param result - value gfc_perform would have returned
+ */
+static void gfc_multi_done(gfcmulti_t *gfm, gfc_transfer_t *xfer, int result){
+    gfcrequest_t *gfr = xfer->gfr;
+    int complete;
+
+    xfer->result = result;
+    if (xfer->socket_fd >= 0) {
+        epoll_ctl(gfm->epoll_fd, EPOLL_CTL_DEL, xfer->socket_fd, NULL);
+        complete = result == 0 && (gfr->status != GF_OK || xfer->data_written == gfr->filelen);
+        if (xfer->keepalive > 0 && complete) {
+            fcntl(xfer->socket_fd, F_SETFL, fcntl(xfer->socket_fd, F_GETFL) & ~O_NONBLOCK);
+            gfc_pool_put(gfr->server, gfr->portno, xfer->socket_fd, xfer->keepalive);
+        }
+        else
+            close(xfer->socket_fd);
+        xfer->socket_fd = -1;
+    }
+
+    if (xfer->prev != NULL)
+        xfer->prev->next = xfer->next;
+    else
+        gfm->active = xfer->next;
+    if (xfer->next != NULL)
+        xfer->next->prev = xfer->prev;
+
+    xfer->prev = NULL;
+    xfer->next = NULL;
+    if (gfm->done_tail != NULL)
+        gfm->done_tail->next = xfer;
+    else
+        gfm->done_head = xfer;
+    gfm->done_tail = xfer;
+    gfm->running--;
+}
+
+/**
+ * Restarts the transfer's deadline for the step it is in, the connect
+ * timeout while connecting and the read timeout after that.
+ * @param xfer - transfer that started a step or received data
+ */
+static void gfc_multi_deadline(gfc_transfer_t *xfer){
+    int timeout = xfer->state == GFC_CONNECTING ? xfer->gfr->connect_timeout : xfer->gfr->read_timeout;
+
+    xfer->deadline = timeout > 0 ? gfc_now_us() + timeout * 1000L : 0;
+}
+
+/**
+ * Starts a non-blocking connect to the next untried address of the
+ * transfer's server and registers it for writability.
+ * @param gfm - multi handle
+ * @param xfer - transfer to connect
+ * @return 0 if a connect is under way, -1 if no address is left
+ */
+static int gfc_multi_connect(gfcmulti_t *gfm, gfc_transfer_t *xfer){
+    struct epoll_event event;
+    int index;
+
+    while (xfer->addr_tries < xfer->addr.naddrs) {
+        index = (xfer->addr.preferred + xfer->addr_tries++) % xfer->addr.naddrs;
+
+        xfer->socket_fd = socket(xfer->addr.addrs[index].ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (xfer->socket_fd < 0)
+            continue;
+
+        if (connect(xfer->socket_fd, (struct sockaddr *) &xfer->addr.addrs[index], xfer->addr.addrlens[index]) < 0 &&
+                errno != EINPROGRESS) {
+            close(xfer->socket_fd);
+            xfer->socket_fd = -1;
+            continue;
+        }
+
+        xfer->state = GFC_CONNECTING;
+        gfc_multi_deadline(xfer);
+        event.events = EPOLLOUT;
+        event.data.ptr = xfer;
+        epoll_ctl(gfm->epoll_fd, EPOLL_CTL_ADD, xfer->socket_fd, &event);
+        return 0;
+    }
+
+    L(GFLOG_ERROR, "[Client] Failed to connect to %s:%d!", xfer->gfr->server, xfer->gfr->portno);
+    return -1;
+}
+
+/**
+ * Adds a request to the multi handle.  The transfer starts right away
+ * and progresses during calls to gfc_multi_perform.
+ * @param gfm - multi handle
+ * @param gfr - pointer to gfcrequest_t, owned by the caller
+ * @return 0 on success, -1 if the request could not be started
+ */
+int gfc_multi_add(gfcmulti_t *gfm, gfcrequest_t *gfr){
+    gfc_transfer_t *xfer;
+    struct epoll_event event;
+    int request_len;
+
+    if (gfm == NULL || gfr == NULL)
+        return -1;
+
+    xfer = calloc(1, sizeof(gfc_transfer_t));
+    xfer->gfr = gfr;
+    gfr->start_time = gfc_now_us();
+    gfr->connect_time = 0;
+    gfr->header_time = 0;
+    xfer->socket_fd = -1;
+    xfer->next = gfm->active;
+    if (gfm->active != NULL)
+        gfm->active->prev = xfer;
+    gfm->active = xfer;
+    gfm->running++;
+
+    if ((request_len = gfc_build_request(gfr, gfr->tag, xfer->request, sizeof(xfer->request))) < 0) {
+        gfr->status = GF_ERROR;
+        gfc_multi_done(gfm, xfer, -1);
+        return -1;
+    }
+    xfer->request_len = request_len;
+
+    // reuse an idle connection to the same server if there is one
+    xfer->socket_fd = pool_enabled ? gfc_pool_get(gfr->server, gfr->portno) : -1;
+    if (xfer->socket_fd >= 0) {
+        xfer->reused = 1;
+        xfer->state = GFC_SENDING;
+        gfc_multi_deadline(xfer);
+        fcntl(xfer->socket_fd, F_SETFL, fcntl(xfer->socket_fd, F_GETFL) | O_NONBLOCK);
+        event.events = EPOLLOUT;
+        event.data.ptr = xfer;
+        epoll_ctl(gfm->epoll_fd, EPOLL_CTL_ADD, xfer->socket_fd, &event);
+        return 0;
+    }
+
+    if (gfr->server == NULL || gfc_resolve(gfr->server, gfr->portno, &xfer->addr) < 0 ||
+            gfc_multi_connect(gfm, xfer) < 0) {
+        gfr->status = GF_ERROR;
+        gfc_multi_done(gfm, xfer, -1);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Handles the end of a connection before the response is complete.  A
+ * pooled connection that the server closed while idle is retried once
+ * on a fresh connection.
+ * @param gfm - multi handle
+ * @param xfer - transfer whose connection ended
+ */
+static void gfc_multi_eof(gfcmulti_t *gfm, gfc_transfer_t *xfer){
+    gfcrequest_t *gfr = xfer->gfr;
+
+    if (xfer->reused && xfer->header_len == 0) {
+        epoll_ctl(gfm->epoll_fd, EPOLL_CTL_DEL, xfer->socket_fd, NULL);
+        close(xfer->socket_fd);
+        xfer->socket_fd = -1;
+        xfer->reused = 0;
+        xfer->request_sent = 0;
+        if (gfc_resolve(gfr->server, gfr->portno, &xfer->addr) == 0 && gfc_multi_connect(gfm, xfer) == 0)
+            return;
+    }
+
+    if (xfer->state != GFC_BODY)
+        gfr->status = (xfer->state == GFC_HEADER && xfer->header_len > 0) ? GF_INVALID : GF_ERROR;
+    gfc_multi_done(gfm, xfer, -1);
+}
+
+/**
+ * Passes body bytes to the write callback and completes the transfer
+ * once the whole file has arrived.
+ * @param gfm - multi handle
+ * @param xfer - transfer receiving the body
+ * @param data - received body bytes
+ * @param len - number of bytes
+ */
+static void gfc_multi_body(gfcmulti_t *gfm, gfc_transfer_t *xfer, char *data, size_t len){
+    gfcrequest_t *gfr = xfer->gfr;
+
+    if (len > 0 && gfr->writefunc != NULL)
+        gfr->writefunc(data, len, gfr->writearg);
+    xfer->data_written += len;
+    gfr->bytesreceived = xfer->data_written;
+
+    if (xfer->data_written >= gfr->filelen)
+        gfc_multi_done(gfm, xfer, 0);
+}
+
+/**
+ * Advances a transfer after its socket became ready.
+ * @param gfm - multi handle
+ * @param xfer - transfer to advance
+ */
+static void gfc_multi_step(gfcmulti_t *gfm, gfc_transfer_t *xfer){
+    gfcrequest_t *gfr = xfer->gfr;
+    struct epoll_event event;
+    socklen_t error_len;
+    ssize_t len;
+    char *header_end;
+    size_t header_size;
+    int error;
+
+    switch (xfer->state) {
+        case GFC_CONNECTING:
+            // non-blocking connect finished, check whether it worked
+            error = 0;
+            error_len = sizeof(error);
+            getsockopt(xfer->socket_fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+            if (error != 0) {
+                epoll_ctl(gfm->epoll_fd, EPOLL_CTL_DEL, xfer->socket_fd, NULL);
+                close(xfer->socket_fd);
+                xfer->socket_fd = -1;
+                if (gfc_multi_connect(gfm, xfer) < 0) {
+                    gfr->status = GF_ERROR;
+                    gfc_multi_done(gfm, xfer, -1);
+                }
+                return;
+            }
+            xfer->state = GFC_SENDING;
+            gfc_multi_deadline(xfer);
+            gfr->connect_time = gfc_now_us() - gfr->start_time;
+            // fall through
+
+        case GFC_SENDING:
+            len = send(xfer->socket_fd, xfer->request + xfer->request_sent,
+                    xfer->request_len - xfer->request_sent, MSG_NOSIGNAL);
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (len < 0) {
+                gfc_multi_eof(gfm, xfer);
+                return;
+            }
+            xfer->request_sent += len;
+            if (xfer->request_sent < xfer->request_len)
+                return;
+
+            // request is out, wait for the response
+            xfer->state = GFC_HEADER;
+            event.events = EPOLLIN;
+            event.data.ptr = xfer;
+            epoll_ctl(gfm->epoll_fd, EPOLL_CTL_MOD, xfer->socket_fd, &event);
+            return;
+
+        case GFC_HEADER:
+            len = recv(xfer->socket_fd, xfer->header + xfer->header_len,
+                    HEADER_MAX - xfer->header_len, 0);
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (len <= 0) {
+                gfc_multi_eof(gfm, xfer);
+                return;
+            }
+            xfer->header_len += len;
+            xfer->header[xfer->header_len] = '\0';
+            gfc_multi_deadline(xfer);
+
+            // wait for the rest of a header split across reads
+            if ((header_end = strstr(xfer->header, "\r\n\r\n")) == NULL) {
+                if (xfer->header_len == HEADER_MAX) {
+                    gfr->status = GF_INVALID;
+                    gfc_multi_done(gfm, xfer, -1);
+                }
+                return;
+            }
+            header_end += 4;
+            header_size = header_end - xfer->header;
+            gfr->header_time = gfc_now_us() - gfr->start_time;
+
+            // parse only the header, body bytes may follow the marker
+            {
+                char saved = *header_end;
+                *header_end = '\0';
+                error = gfc_parse_header(gfr, xfer->header, &xfer->keepalive);
+                *header_end = saved;
+            }
+            if (error < 0) {
+                gfc_multi_done(gfm, xfer, -1);
+                return;
+            }
+            if (gfr->headerfunc != NULL)
+                gfr->headerfunc(xfer->header, header_size, gfr->headerarg);
+
+            if (gfr->status != GF_OK) {
+                xfer->keepalive = (xfer->header_len == header_size) ? xfer->keepalive : 0;
+                gfc_multi_done(gfm, xfer, 0);
+                return;
+            }
+
+            xfer->state = GFC_BODY;
+            gfc_multi_body(gfm, xfer, header_end, xfer->header_len - header_size);
+            return;
+
+        case GFC_BODY:
+            len = recv(xfer->socket_fd, gfm->buffer, sizeof(gfm->buffer), 0);
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (len <= 0) {
+                gfc_multi_eof(gfm, xfer);
+                return;
+            }
+            gfc_multi_deadline(xfer);
+            gfc_multi_body(gfm, xfer, gfm->buffer, len);
+            return;
+    }
+}
+
+/**
+ * Ends the transfers whose deadline has passed with GF_ERROR, moving on
+ * to the server's next address first when a connect timed out.
+ * @param gfm - multi handle
+ * @return milliseconds until the next deadline, -1 if there is none
+ */
+static int gfc_multi_expire(gfcmulti_t *gfm){
+    gfc_transfer_t *xfer, *next;
+    long now = gfc_now_us(), nearest = 0;
+
+    for (xfer = gfm->active; xfer != NULL; xfer = next) {
+        next = xfer->next;
+        if (xfer->deadline == 0)
+            continue;
+
+        if (xfer->deadline <= now && xfer->state == GFC_CONNECTING) {
+            epoll_ctl(gfm->epoll_fd, EPOLL_CTL_DEL, xfer->socket_fd, NULL);
+            close(xfer->socket_fd);
+            xfer->socket_fd = -1;
+            if (gfc_multi_connect(gfm, xfer) < 0) {
+                xfer->gfr->status = GF_ERROR;
+                gfc_multi_done(gfm, xfer, -1);
+                continue;
+            }
+        }
+        else if (xfer->deadline <= now) {
+            L(GFLOG_ERROR, "[Client] Timed out waiting for a response from %s!", xfer->gfr->server);
+            xfer->gfr->status = GF_ERROR;
+            gfc_multi_done(gfm, xfer, -1);
+            continue;
+        }
+
+        if (nearest == 0 || xfer->deadline < nearest)
+            nearest = xfer->deadline;
+    }
+
+    // round up so the wait doesn't end just short of the deadline
+    return nearest == 0 ? -1 : (int) ((nearest - now + 999) / 1000);
+}
+
+/**
+ * Waits up to timeout_ms for activity and advances every transfer that
+ * is ready.  Callbacks are invoked from within this call.
+ * @param gfm - multi handle
+ * @param timeout_ms - maximum wait in milliseconds, -1 to wait forever
+ * @return number of transfers still running, -1 on error
+ */
+int gfc_multi_perform(gfcmulti_t *gfm, int timeout_ms){
+    struct epoll_event events[MULTI_MAX_EVENTS];
+    int i, nevents, until_deadline;
+
+    if (gfm == NULL)
+        return -1;
+    if (gfm->running == 0)
+        return 0;
+
+    // wake up in time for the nearest deadline
+    until_deadline = gfc_multi_expire(gfm);
+    if (until_deadline >= 0 && (timeout_ms < 0 || until_deadline < timeout_ms))
+        timeout_ms = until_deadline;
+
+    nevents = epoll_wait(gfm->epoll_fd, events, MULTI_MAX_EVENTS, timeout_ms);
+    if (nevents < 0 && errno != EINTR)
+        return -1;
+
+    for (i = 0; i < nevents; i++)
+        gfc_multi_step(gfm, (gfc_transfer_t *) events[i].data.ptr);
+    gfc_multi_expire(gfm);
+
+    return gfm->running;
+}
+
+/**
+ * Returns the next finished request, or NULL if none has finished since
+ * the last call.
+ * @param gfm - multi handle
+ * @param result - receives the value gfc_perform would have returned
+ * @return finished request
+ */
+gfcrequest_t *gfc_multi_info_read(gfcmulti_t *gfm, int *result){
+    gfc_transfer_t *xfer;
+    gfcrequest_t *gfr;
+
+    if (gfm == NULL || (xfer = gfm->done_head) == NULL)
+        return NULL;
+
+    gfm->done_head = xfer->next;
+    if (gfm->done_head == NULL)
+        gfm->done_tail = NULL;
+
+    gfr = xfer->gfr;
+    if (result != NULL)
+        *result = xfer->result;
+    free(xfer);
+    return gfr;
+}
+
+/**
+ * Aborts any running transfers and frees the multi handle.  The requests
+ * themselves still belong to the caller.
+ * @param gfm - multi handle
+ */
+void gfc_multi_cleanup(gfcmulti_t *gfm){
+    gfc_transfer_t *xfer;
+
+    if (gfm == NULL)
+        return;
+
+    while ((xfer = gfm->active) != NULL) {
+        xfer->keepalive = 0;
+        gfc_multi_done(gfm, xfer, -1);
+    }
+    while (gfc_multi_info_read(gfm, NULL) != NULL)
+        ;
+    close(gfm->epoll_fd);
+    free(gfm);
+}
+
+/**
+ * Returns the status of the response.
+ * @param gfr - pointer to gfcrequest_t
+ * @return gfstatus_t - status associated with request
+ */
+gfstatus_t gfc_get_status(gfcrequest_t *gfr){
+    return gfr->status;
+}
+
+/*
+ * Returns the string associated with the input status
+ * @param status - a gfstatus_t showing status of request
+ * @return char* of status
+ */
+char* gfc_strstatus(gfstatus_t status){
+    char *statusString = "";
+
+    switch (status) {
+        case GF_OK:
+            statusString = "OK";
+            break;
+        case GF_FILE_NOT_FOUND:
+            statusString = "FILE_NOT_FOUND";
+            break;
+        case GF_ERROR:
+            statusString = "ERROR";
+            break;
+        case GF_INVALID:
+            statusString = "INVALID";
+            break;
+        case GF_NOT_MODIFIED:
+            statusString = "NOT_MODIFIED";
+            break;
+        default:
+            break;
+    }
+    return statusString;
+}
+
+/*
+ * Returns the integer associated with the input status
+ * @param status - a string of the status
+ * @return int gfc status
+ */
+int gfc_intstatus(char *status) {
+    const char *OK = "OK";
+    const char *FILE_NOT_FOUND = "FILE_NOT_FOUND";
+    const char *ERROR = "ERROR";
+    const char *INVALID = "INVALID";
+    const char *NOT_MODIFIED = "NOT_MODIFIED";
+
+    if (strcmp(status, OK) == 0)
+        return GF_OK;
+    if (strcmp(status, FILE_NOT_FOUND) == 0)
+        return GF_FILE_NOT_FOUND;
+    if (strcmp(status, ERROR) == 0)
+        return GF_ERROR;
+    if (strcmp(status, INVALID) == 0)
+        return GF_INVALID;
+    if (strcmp(status, NOT_MODIFIED) == 0)
+        return GF_NOT_MODIFIED;
+
+    return -1;
+}
+
+/**
+ * Returns the length of the file as indicated by the response header.
+ * Value is not specified if the response status is not OK.
+ * @param gfr - pointer to gfcrequest_t
+ * @return size_t - size of file requested
+ */
+size_t gfc_get_filelen(gfcrequest_t *gfr){
+    return gfr->filelen;
+}
+
+/**
+ * Returns the validator tag the server sent with a GF_OK response.
+ * @param gfr - pointer to gfcrequest_t
+ * @return tag string or NULL if none was sent
+ */
+char* gfc_get_tag(gfcrequest_t *gfr){
+    return gfr->resp_tag[0] != '\0' ? gfr->resp_tag : NULL;
+}
+
+/**
+ * Returns the content encoding of the received body.
+ * @param gfr - pointer to gfcrequest_t
+ * @return encoding name or NULL if the body is the file as is
+ */
+char* gfc_get_encoding(gfcrequest_t *gfr){
+    return gfr->resp_encoding[0] != '\0' ? gfr->resp_encoding : NULL;
+}
+
+/**
+ * Returns actual number of bytes received before the connection is closed.
+ * This may be distinct from the result of gfc_get_filelen when the response
+ * status is OK but the connection is reset before the transfer is completed.
+ * @param gfr - pointer to gfcrequest_t
+ * @return size_t - how many bytes received so far
+ */
+size_t gfc_get_bytesreceived(gfcrequest_t *gfr){
+    return gfr->bytesreceived;
+}
+
+/**
+ * Returns how long connecting to the server took.
+ * @param gfr - pointer to gfcrequest_t
+ * @return microseconds from the start of the request until connected,
+ *         zero if an open connection was reused
+ */
+long gfc_get_connect_time(gfcrequest_t *gfr){
+    return gfr->connect_time;
+}
+
+/**
+ * Returns how long it took until the response header had arrived.
+ * @param gfr - pointer to gfcrequest_t
+ * @return microseconds from the start of the request, zero if the response
+ *         came from the client cache or none arrived
+ */
+long gfc_get_header_time(gfcrequest_t *gfr){
+    return gfr->header_time;
+}
+
+/**
+ * Returns the pointer registered with gfc_set_writearg, so a completed
+ * request can be matched to the caller's state without a search.
+ * @param gfr - pointer to gfcrequest_t
+ * @return the write argument, NULL if none was set
+ */
+void *gfc_get_writearg(gfcrequest_t *gfr){
+    return gfr->writearg;
+}
+
+/*
+ * Frees memory associated with the request.
+ */
+void gfc_cleanup(gfcrequest_t *gfr){
+    L(GFLOG_DEBUG, "[Client] Performing cleanup of resources.");
+    free(gfr->server);
+    free(gfr->path);
+    free(gfr->tag);
+    free(gfr->accept_encoding);
+    free(gfr->hedge_server);
+    free(gfr);
+}
+
+/*
+ * Sets up the connection pool shared by all requests.  The resolver cache
+ * starts empty and is only emptied by gfc_global_cleanup, so calling this
+ * again keeps the addresses already cached.
+ */
+void gfc_global_init(){
+    pthread_mutex_lock(&pool_mutex);
+    pool_enabled = pool_max_idle > 0;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/*
+ * Sets the limits of the connection pool.  A max_idle of zero disables
+ * connection reuse.
+ * @param max_idle - maximum number of idle connections kept open
+ * @param idle_timeout - seconds an idle connection is kept open
+ */
+void gfc_global_set_pool(int max_idle, int idle_timeout){
+    pthread_mutex_lock(&pool_mutex);
+    pool_max_idle = max_idle;
+    pool_idle_timeout = idle_timeout;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/*
+ * Sets how many seconds resolved server addresses are cached before the
+ * name is looked up again.
+ * @param ttl - seconds, zero resolves on every connection
+ */
+void gfc_global_set_resolver_ttl(int ttl){
+    pthread_rwlock_wrlock(&resolver_lock);
+    resolver_ttl = ttl;
+    pthread_rwlock_unlock(&resolver_lock);
+}
+
+/*
+ * Turns on the client cache.
+ * @param dir - directory for the disk tier, NULL to keep objects in memory only
+ * @param mem_limit - bytes of bodies held in memory
+ * @return 0 on success, -1 if the directory cannot be used
+ */
+int gfc_global_set_cache(char *dir, size_t mem_limit){
+    if (dir != NULL && mkdir(dir, S_IRWXU) < 0 && errno != EEXIST) {
+        L(GFLOG_ERROR, "[Client] Unable to use cache directory %s: %s", dir, strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+    free(cache_dir);
+    cache_dir = (dir != NULL) ? strdup(dir) : NULL;
+    cache_mem_limit = mem_limit;
+    while (cache_lru_tail != NULL && cache_mem_used > cache_mem_limit)
+        gfc_cache_evict_locked(cache_lru_tail);
+    cache_enabled = 1;
+    pthread_mutex_unlock(&cache_mutex);
+    return 0;
+}
+
+/*
+ * Sets when requests with a replica are hedged.
+ * @param percentile - percentile of recent first byte latencies to wait for
+ * @param min_delay - minimum milliseconds to wait, also used until enough
+ *                    latencies have been seen
+ */
+void gfc_global_set_hedge(int percentile, int min_delay){
+    pthread_mutex_lock(&hedge_mutex);
+    hedge_percentile = (percentile < 0) ? 0 : (percentile > 100) ? 100 : percentile;
+    hedge_min_delay = (min_delay < 0) ? 0 : min_delay;
+    pthread_mutex_unlock(&hedge_mutex);
+}
+
+/*
+ * Closes all pooled connections, empties the resolver cache and turns
+ * the client cache off.
+ */
+void gfc_global_cleanup(){
+    gfc_conn_t *conn;
+    gfc_addr_t *cached;
+    int i;
+
+    pthread_rwlock_wrlock(&resolver_lock);
+    for (i = 0; i < RESOLVER_BUCKETS; i++) {
+        while ((cached = resolver_table[i]) != NULL) {
+            resolver_table[i] = cached->next;
+            free(cached->server);
+            free(cached);
+        }
+    }
+    pthread_rwlock_unlock(&resolver_lock);
+
+    pthread_mutex_lock(&cache_mutex);
+    cache_enabled = 0;
+    while (cache_lru_tail != NULL)
+        gfc_cache_evict_locked(cache_lru_tail);
+    free(cache_dir);
+    cache_dir = NULL;
+    pthread_mutex_unlock(&cache_mutex);
+
+    pthread_mutex_lock(&pool_mutex);
+    pool_enabled = 0;
+    while ((conn = pool_head) != NULL) {
+        pool_head = conn->next;
+        close(conn->socket_fd);
+        free(conn->server);
+        free(conn);
+    }
+    pool_count = 0;
+    pthread_mutex_unlock(&pool_mutex);
 }
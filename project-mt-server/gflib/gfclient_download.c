@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +10,7 @@
 
 #include "workload.h"
 #include "gfclient.h"
+#include "xxhash.h"
 
 #define USAGE                                                                 \
 "usage:\n"                                                                    \
@@ -19,6 +21,14 @@
 "  -w [workload_path]  Path to workload file (Default: workload.txt)\n"       \
 "  -t [nthreads]       Number of threads (Default 1)\n"                       \
 "  -n [num_requests]   Requests download per thread (Default: 1)\n"           \
+"  -e [encodings]      Accepted content encodings, e.g. zstd,gzip (Default: none)\n"\
+"  -m [max_inflight]   Transfers kept in flight by one thread (Default: 0, off)\n"\
+"  -d [deadline_ms]    Connect and read deadline per request (Default: none)\n"\
+"  -r [replica]        Replica host[:port] to hedge slow requests to (Default: none)\n"\
+"  -c [cache_dir]      Cache responses in memory and in cache_dir (Default: off)\n"\
+"  -D [distribution]   Paths requested, seq, random, zipf[:s] or trace (Default: seq)\n"\
+"  -o [sink]           Bodies go to a file, discard or verify:<manifest> (Default: file)\n"\
+"  -v                  Print the status and size of every request\n"          \
 "  -h                  Show this help message\n"                              \
 
 /* OPTIONS DESCRIPTOR ====================================================== */
@@ -28,6 +38,14 @@ static struct option gLongOptions[] = {
   {"workload-path", required_argument,      NULL,           'w'},
   {"nthreads",      required_argument,      NULL,           't'},
   {"nrequests",     required_argument,      NULL,           'n'},
+  {"encodings",     required_argument,      NULL,           'e'},
+  {"max-inflight",  required_argument,      NULL,           'm'},
+  {"deadline",      required_argument,      NULL,           'd'},
+  {"replica",       required_argument,      NULL,           'r'},
+  {"cache",         required_argument,      NULL,           'c'},
+  {"distribution",  required_argument,      NULL,           'D'},
+  {"output",        required_argument,      NULL,           'o'},
+  {"verbose",       no_argument,            NULL,           'v'},
   {"help",          no_argument,            NULL,           'h'},
   {NULL,            0,                      NULL,             0}
 };
@@ -36,15 +54,66 @@ static void Usage() {
 	fprintf(stdout, "%s", USAGE);
 }
 
+/* Bytes of response bodies the client cache keeps in memory */
+#define CACHE_MEM (64 << 20)
+
+/* Received data is staged and written out in chunks of this size */
+#define WRITE_CHUNK (1 << 20)
+
+/*
+ * Output file written with large positional writes.  When bodies are
+ * discarded or verified there is no file and fd is -1.
+ */
+typedef struct outfile_t {
+  int fd;
+  off_t offset;
+  char *buffer;
+  size_t buffered;
+  size_t buffer_size;
+  char *path;
+  xxh64_state_t hash;
+  gfcrequest_t *gfr;
+} outfile_t;
+
+/* Where response bodies go */
+#define SINK_FILE 0
+#define SINK_DISCARD 1
+#define SINK_VERIFY 2
+
+/* Expected hash of a path's body, read from the verify manifest */
+typedef struct manifest_entry_t {
+  char *path;
+  uint64_t hash;
+} manifest_entry_t;
+
+static int gSink = SINK_FILE;
+static manifest_entry_t *gManifest = NULL;
+static size_t gManifestLen = 0;
+static unsigned long gVerified = 0;
+static unsigned long gMismatched = 0;
+
+/* Per request output slows the transfer loop, so it is off by default */
+static int gVerbose = 0;
+
 static void localPath(char *req_path, char *local_path){
   static int counter = 0;
 
-  sprintf(local_path, "%s-%06d", &req_path[1], counter++);
+  /* The pid keeps runs sharing a directory from overwriting each other */
+  sprintf(local_path, "%s-%d-%06d", &req_path[1], (int) getpid(), __sync_fetch_and_add(&counter, 1));
 }
 
-static FILE* openFile(char *path){
+static void openFile(char *path, outfile_t *out){
   char *cur, *prev;
-  FILE *ans;
+
+  out->fd = -1;
+  out->offset = 0;
+  out->buffer = NULL;
+  out->buffered = 0;
+  out->buffer_size = 0;
+  if (gSink == SINK_VERIFY)
+    xxh64_reset(&out->hash, 0);
+  if (gSink != SINK_FILE)
+    return;
 
   /* Make the directory if it isn't there */
   prev = path;
@@ -62,19 +131,273 @@ static FILE* openFile(char *path){
     prev = cur;
   }
 
-  if( NULL == (ans = fopen(&path[0], "w"))){
+  if( 0 > (out->fd = open(&path[0], O_WRONLY | O_CREAT | O_TRUNC, 0644))){
     perror("Unable to open file");
     exit(EXIT_FAILURE);
   }
+}
+
+/* Writes len bytes at the current offset of the file */
+static void writeFile(outfile_t *out, char *data, size_t len){
+  ssize_t written;
+
+  while(len > 0){
+    if( 0 > (written = pwrite(out->fd, data, len, out->offset))){
+      if (errno == EINTR)
+        continue;
+      perror("Unable to write file");
+      exit(EXIT_FAILURE);
+    }
+    data += written;
+    len -= written;
+    out->offset += written;
+  }
+}
+
+/* Writes out any staged data, trims the preallocated length and closes */
+static void closeFile(outfile_t *out){
+  if (out->fd < 0)
+    return;
+
+  writeFile(out, out->buffer, out->buffered);
+  out->buffered = 0;
+
+  if (0 > ftruncate(out->fd, out->offset))
+    perror("Unable to truncate file");
+  close(out->fd);
+  free(out->buffer);
+  out->buffer = NULL;
+}
+
+/* Renames a downloaded file so its name reflects the encoding received */
+static void encodedPath(char *local_path, char *encoding){
+  char encoded_path[600];
+
+  if (0 == strcmp(encoding, "gzip"))
+    snprintf(encoded_path, sizeof(encoded_path), "%s.gz", local_path);
+  else if (0 == strcmp(encoding, "zstd"))
+    snprintf(encoded_path, sizeof(encoded_path), "%s.zst", local_path);
+  else
+    snprintf(encoded_path, sizeof(encoded_path), "%s.%s", local_path, encoding);
+
+  if (0 > rename(local_path, encoded_path))
+    fprintf(stderr, "rename failed on %s\n", local_path);
+}
+
+static int compareEntries(const void *a, const void *b){
+  return strcmp(((manifest_entry_t*) a)->path, ((manifest_entry_t*) b)->path);
+}
+
+/* Reads "<path> <xxh64 hex>" lines, the tags the server sends for identity bodies */
+static void loadManifest(char *manifest_path){
+  char line[4096], path[4096], hex[32];
+  size_t capacity = 0;
+  FILE *file;
+
+  if( NULL == (file = fopen(manifest_path, "r"))){
+    perror("Unable to open manifest");
+    exit(EXIT_FAILURE);
+  }
+
+  while(NULL != fgets(line, sizeof(line), file)){
+    if (2 != sscanf(line, "%4095s %31s", path, hex))
+      continue;
+    if (gManifestLen == capacity){
+      capacity = capacity ? capacity * 2 : 1024;
+      gManifest = realloc(gManifest, capacity * sizeof(manifest_entry_t));
+    }
+    gManifest[gManifestLen].path = strdup(path);
+    gManifest[gManifestLen++].hash = strtoull(hex, NULL, 16);
+  }
+  fclose(file);
 
-  return ans;
+  qsort(gManifest, gManifestLen, sizeof(manifest_entry_t), compareEntries);
+}
+
+/* Checks the hash of a complete body against the manifest */
+static void verifyBody(outfile_t *out){
+  manifest_entry_t key, *entry;
+
+  if (gfc_get_encoding(out->gfr) != NULL){
+    fprintf(stdout, "Verify: skipped %s, body is %s encoded\n", out->path, gfc_get_encoding(out->gfr));
+    return;
+  }
+
+  key.path = out->path;
+  if (NULL == (entry = bsearch(&key, gManifest, gManifestLen, sizeof(manifest_entry_t), compareEntries)))
+    fprintf(stdout, "Verify: skipped %s, not in the manifest\n", out->path);
+  else if (entry->hash != xxh64_digest(&out->hash)){
+    fprintf(stdout, "Verify: MISMATCH on %s\n", out->path);
+    __sync_fetch_and_add(&gMismatched, 1);
+  }
+  else
+    __sync_fetch_and_add(&gVerified, 1);
 }
 
 /* Callbacks ========================================================= */
+static void headercb(void* data, size_t data_len, void *arg){
+  outfile_t *out = (outfile_t*) arg;
+  size_t filelen;
+
+  if (out->fd < 0 || gfc_get_status(out->gfr) != GF_OK || 0 == (filelen = gfc_get_filelen(out->gfr)))
+    return;
+
+  /* Reserve the whole file up front so it is laid out contiguously */
+  if (0 != posix_fallocate(out->fd, 0, filelen))
+    fprintf(stderr, "Unable to preallocate %zu bytes\n", filelen);
+
+  out->buffer_size = filelen < WRITE_CHUNK ? filelen : WRITE_CHUNK;
+  if( NULL == (out->buffer = malloc(out->buffer_size))){
+    perror("Unable to allocate write buffer");
+    exit(EXIT_FAILURE);
+  }
+}
+
 static void writecb(void* data, size_t data_len, void *arg){
-  FILE *file = (FILE*) arg;
+  outfile_t *out = (outfile_t*) arg;
+  size_t len;
+
+  if (gSink == SINK_VERIFY)
+    xxh64_update(&out->hash, data, data_len);
+  if (out->fd < 0)
+    return;
+
+  /* Stage small pieces and write whole chunks, large pieces go straight out */
+  while(data_len > 0){
+    if (0 == out->buffered && data_len >= out->buffer_size){
+      writeFile(out, data, data_len);
+      return;
+    }
+
+    len = out->buffer_size - out->buffered;
+    len = data_len < len ? data_len : len;
+    memcpy(out->buffer + out->buffered, data, len);
+    out->buffered += len;
+    data = (char*) data + len;
+    data_len -= len;
+
+    if (out->buffered == out->buffer_size){
+      writeFile(out, out->buffer, out->buffered);
+      out->buffered = 0;
+    }
+  }
+}
+
+/* A download in flight when several are driven by one multi handle */
+typedef struct transfer_t {
+  gfcrequest_t *gfr;
+  outfile_t file;
+  char local_path[512];
+} transfer_t;
+
+/* Deadline and replica applied to every request */
+static int gDeadline = 0;
+static char *gReplica = NULL;
+static unsigned short gReplicaPort = 0;
+
+/* Creates the request for the next workload path and opens its file */
+static gfcrequest_t* startRequest(char *server, unsigned short port, char *encodings,
+                                  char *local_path, outfile_t *file){
+  gfcrequest_t *gfr;
+  char *req_path;
+
+  req_path = workload_get_path();
+
+  if(strlen(req_path) > 256){
+    fprintf(stderr, "Request path exceeded maximum of 256 characters\n.");
+    exit(EXIT_FAILURE);
+  }
 
-  fwrite(data, 1, data_len, file);
+  localPath(req_path, local_path);
+
+  openFile(local_path, file);
+  file->path = req_path;
+
+  gfr = gfc_create();
+  gfc_set_server(gfr, server);
+  gfc_set_path(gfr, req_path);
+  gfc_set_port(gfr, port);
+  gfc_set_headerfunc(gfr, headercb);
+  gfc_set_headerarg(gfr, file);
+  gfc_set_writefunc(gfr, writecb);
+  gfc_set_writearg(gfr, file);
+  file->gfr = gfr;
+  gfc_set_accept_encoding(gfr, encodings);
+  gfc_set_timeouts(gfr, gDeadline, gDeadline);
+  gfc_set_hedge(gfr, gReplica, gReplicaPort);
+
+  if (gVerbose)
+    fprintf(stdout, "Requesting %s%s\n", server, req_path);
+
+  return gfr;
+}
+
+/* Closes the file of a finished request and reports how it went */
+static void finishRequest(gfcrequest_t *gfr, outfile_t *file, char *local_path, int returncode){
+  if ( 0 > returncode)
+    fprintf(stdout, "gfc_perform returned an error %d\n", returncode);
+  closeFile(file);
+
+  if (gSink == SINK_FILE){
+    if ( 0 > returncode || gfc_get_status(gfr) != GF_OK){
+      if ( 0 > unlink(local_path))
+        fprintf(stderr, "unlink failed on %s\n", local_path);
+    }
+    else if (gfc_get_encoding(gfr) != NULL)
+      encodedPath(local_path, gfc_get_encoding(gfr));
+  }
+  else if (gSink == SINK_VERIFY && 0 <= returncode && gfc_get_status(gfr) == GF_OK)
+    verifyBody(file);
+
+  if (gVerbose){
+    fprintf(stdout, "Status: %s\n", gfc_strstatus(gfc_get_status(gfr)));
+    fprintf(stdout, "Received %zu of %zu bytes\n", gfc_get_bytesreceived(gfr), gfc_get_filelen(gfr));
+  }
+}
+
+/* Downloads nrequests files keeping up to max_inflight transfers running */
+static void downloadMulti(char *server, unsigned short port, char *encodings,
+                          int nrequests, int max_inflight){
+  gfcmulti_t *gfm;
+  gfcrequest_t *gfr;
+  transfer_t *transfers;
+  int started = 0, inflight = 0;
+  int i, returncode;
+
+  if( NULL == (gfm = gfc_multi_create())){
+    fprintf(stderr, "Unable to create multi handle.\n");
+    exit(EXIT_FAILURE);
+  }
+  transfers = calloc(max_inflight, sizeof(transfer_t));
+
+  while(started < nrequests || inflight > 0){
+    /* Top up the free slots */
+    for(i = 0; i < max_inflight && started < nrequests; i++){
+      if(transfers[i].gfr != NULL)
+        continue;
+      transfers[i].gfr = startRequest(server, port, encodings, transfers[i].local_path, &transfers[i].file);
+      gfc_multi_add(gfm, transfers[i].gfr);
+      started++;
+      inflight++;
+    }
+
+    if( 0 > gfc_multi_perform(gfm, 1000)){
+      perror("gfc_multi_perform");
+      break;
+    }
+
+    while(NULL != (gfr = gfc_multi_info_read(gfm, &returncode))){
+      for(i = 0; i < max_inflight && transfers[i].gfr != gfr; i++)
+        ;
+      finishRequest(gfr, &transfers[i].file, transfers[i].local_path, returncode);
+      gfc_cleanup(gfr);
+      transfers[i].gfr = NULL;
+      inflight--;
+    }
+  }
+
+  gfc_multi_cleanup(gfm);
+  free(transfers);
 }
 
 /* Main ========================================================= */
@@ -83,19 +406,23 @@ int main(int argc, char **argv) {
   char *server = "localhost";
   unsigned short port = 8888;
   char *workload_path = "workload.txt";
+  char *encodings = NULL;
+  char *colon;
+  char *cache_dir = NULL;
+  char *distribution = "seq";
 
   int i;
   int option_char = 0;
   int nrequests = 1;
   int nthreads = 1;
+  int max_inflight = 0;
   int returncode;
   gfcrequest_t *gfr;
-  FILE *file;
-  char *req_path;
+  outfile_t file;
   char local_path[512];
 
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "s:p:w:n:t:h", gLongOptions, NULL)) != -1) {
+  while ((option_char = getopt_long(argc, argv, "s:p:w:n:t:e:m:d:r:c:D:o:vh", gLongOptions, NULL)) != -1) {
     switch (option_char) {
       case 's': // server
         server = optarg;
@@ -116,6 +443,43 @@ int main(int argc, char **argv) {
           exit(0);
         }
         break;
+      case 'e': // encodings
+        encodings = optarg;
+        break;
+      case 'm': // max-inflight
+        max_inflight = atoi(optarg);
+        break;
+      case 'd': // deadline
+        gDeadline = atoi(optarg);
+        break;
+      case 'r': // replica
+        gReplica = optarg;
+        if (NULL != (colon = strchr(gReplica, ':')) && colon == strrchr(gReplica, ':')){
+          *colon = '\0';
+          gReplicaPort = atoi(colon + 1);
+        }
+        break;
+      case 'c': // cache
+        cache_dir = optarg;
+        break;
+      case 'D': // distribution
+        distribution = optarg;
+        break;
+      case 'o': // output
+        if (0 == strcmp(optarg, "discard"))
+          gSink = SINK_DISCARD;
+        else if (0 == strncmp(optarg, "verify:", 7)){
+          gSink = SINK_VERIFY;
+          loadManifest(optarg + 7);
+        }
+        else if (0 != strcmp(optarg, "file")){
+          Usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'v': // verbose
+        gVerbose = 1;
+        break;
       case 'h': // help
         Usage();
         exit(0);
@@ -126,55 +490,42 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (gReplicaPort == 0)
+    gReplicaPort = port;
+
   if( EXIT_SUCCESS != workload_init(workload_path)){
     fprintf(stderr, "Unable to load workload file %s.\n", workload_path);
     exit(EXIT_FAILURE);
   }
+  if( 0 > workload_set_distribution(distribution)){
+    fprintf(stderr, "Unknown distribution %s.\n", distribution);
+    exit(EXIT_FAILURE);
+  }
 
   gfc_global_init();
+  if (NULL != cache_dir && 0 > gfc_global_set_cache(cache_dir, CACHE_MEM))
+    exit(EXIT_FAILURE);
 
   /*Making the requests...*/
-  for(i = 0; i < nrequests * nthreads; i++){
-    req_path = workload_get_path();
-
-    if(strlen(req_path) > 256){
-      fprintf(stderr, "Request path exceeded maximum of 256 characters\n.");
-      exit(EXIT_FAILURE);
-    }
+  if(max_inflight > 0)
+    downloadMulti(server, port, encodings, nrequests * nthreads, max_inflight);
 
-    localPath(req_path, local_path);
+  for(i = 0; max_inflight <= 0 && i < nrequests * nthreads; i++){
+    gfr = startRequest(server, port, encodings, local_path, &file);
 
-    file = openFile(local_path);
+    returncode = gfc_perform(gfr);
 
-    gfr = gfc_create();
-    gfc_set_server(gfr, server);
-    gfc_set_path(gfr, req_path);
-    gfc_set_port(gfr, port);
-    gfc_set_writefunc(gfr, writecb);
-    gfc_set_writearg(gfr, file);
-
-    fprintf(stdout, "Requesting %s%s\n", server, req_path);
-
-    if ( 0 > (returncode = gfc_perform(gfr))){
-      fprintf(stdout, "gfc_perform returned an error %d\n", returncode);
-      fclose(file);
-      if ( 0 > unlink(local_path))
-        fprintf(stderr, "unlink failed on %s\n", local_path);
-    }
-    else {
-        fclose(file);
-    }
-
-    if ( gfc_get_status(gfr) != GF_OK){
-      if ( 0 > unlink(local_path))
-        fprintf(stderr, "unlink failed on %s\n", local_path);
-    }
-
-    fprintf(stdout, "Status: %s\n", gfc_strstatus(gfc_get_status(gfr)));
-    fprintf(stdout, "Received %zu of %zu bytes\n", gfc_get_bytesreceived(gfr), gfc_get_filelen(gfr));
+    finishRequest(gfr, &file, local_path, returncode);
+    gfc_cleanup(gfr);
   }
 
   gfc_global_cleanup();
 
+  if (gSink == SINK_VERIFY){
+    fprintf(stdout, "Verified %lu bodies, %lu mismatched\n", gVerified, gMismatched);
+    if (gMismatched > 0)
+      return EXIT_FAILURE;
+  }
+
   return 0;
 }  
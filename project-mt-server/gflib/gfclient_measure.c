@@ -0,0 +1,565 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/wait.h>
+
+#include "workload.h"
+#include "gfclient.h"
+#include "histogram.h"
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  gfclient_measure [options]\n"                                              \
+"options:\n"                                                                  \
+"  -s [server_addr]    Server address (Default: localhost)\n"                 \
+"  -p [server_port]    Server port (Default: 8888)\n"                         \
+"  -w [workload_path]  Path to workload file (Default: workload.txt)\n"       \
+"  -r [rate]           Requests started per second (Default: 100)\n"          \
+"  -d [seconds]        Duration of the run (Default: 10)\n"                   \
+"  -a [arrival]        Arrival process, fixed, poisson or trace (Default: fixed)\n"\
+"  -D [distribution]   Paths requested, seq, random, zipf[:s] (Default: seq)\n"\
+"  -m [max_inflight]   Requests in flight at most, per process (Default: 1024)\n"\
+"  -P [processes]      Worker processes sharing the rate, one per CPU (Default: 1)\n"\
+"  -S [seed]           Seed for arrivals and paths (Default: 1)\n"           \
+"  -h                  Show this help message\n"                              \
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] = {
+  {"server",        required_argument,      NULL,           's'},
+  {"port",          required_argument,      NULL,           'p'},
+  {"workload-path", required_argument,      NULL,           'w'},
+  {"rate",          required_argument,      NULL,           'r'},
+  {"duration",      required_argument,      NULL,           'd'},
+  {"arrival",       required_argument,      NULL,           'a'},
+  {"distribution",  required_argument,      NULL,           'D'},
+  {"max-inflight",  required_argument,      NULL,           'm'},
+  {"processes",     required_argument,      NULL,           'P'},
+  {"seed",          required_argument,      NULL,           'S'},
+  {"help",          no_argument,            NULL,           'h'},
+  {NULL,            0,                      NULL,             0}
+};
+
+/* Arrival processes */
+#define ARRIVAL_FIXED 0
+#define ARRIVAL_POISSON 1
+#define ARRIVAL_TRACE 2
+
+/* Time the remaining requests get to finish once the run is over */
+#define DRAIN_US 10000000L
+
+/* Workers report what they measured this often */
+#define INTERVAL_US 1000000L
+
+/* Time given to forking and setting up workers before they all start */
+#define START_DELAY_US 200000L
+
+/* Intervals the coordinator holds while waiting for every worker's report */
+#define INTERVAL_SLOTS 4
+
+/* A request in flight */
+typedef struct request_t {
+  gfcrequest_t *gfr;
+  long intended;
+  long started;
+  size_t bytes;
+} request_t;
+
+/* What a run, or one interval of a worker's run, measured */
+typedef struct stats_t {
+  long interval;
+  size_t sent, ok, failed, unfinished, bytes;
+  histogram_t connect, first, last, service;
+} stats_t;
+
+/* Run settings, the same in every worker */
+static char *gServer = "localhost";
+static unsigned short gPort = 8888;
+static double gRate = 100;
+static int gArrival = ARRIVAL_FIXED;
+static int gMaxInflight = 1024;
+static unsigned short gSeed[3] = {1, 0, 0};
+static unsigned int gWorkloadSeed = 1;
+static int gSequential = 1;
+
+/* This process's share of the load when several run together */
+static int gWorker = 0;
+static int gWorkers = 1;
+
+static void Usage() {
+	fprintf(stdout, "%s", USAGE);
+}
+
+static long nowUs(){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+/*
+ * Returns when the request after the one scheduled at prev is due, or the
+ * first one if prev is negative, and picks its path.  Poisson arrivals are
+ * exponentially spaced, trace arrivals follow the times in the workload
+ * file and end with it.  Each worker takes an equal share of the rate, or
+ * every gWorkers-th line of the trace, staggered so their fixed arrivals
+ * interleave.
+ */
+static long nextArrival(long start, long prev, char **path){
+  static unsigned long line = 0;
+  double at;
+
+  if (gArrival == ARRIVAL_TRACE){
+    do {
+      if (NULL == (*path = workload_next_trace(&at)))
+        return LONG_MAX;
+    } while (line++ % gWorkers != gWorker);
+    return start + (long) (at * 1000000.0);
+  }
+
+  *path = workload_get_path();
+  if (prev < 0)
+    return start + (long) (gWorker * 1000000.0 / gRate);
+  if (gArrival == ARRIVAL_POISSON)
+    return prev + (long) (-log(1.0 - erand48(gSeed)) * 1000000.0 * gWorkers / gRate);
+  return prev + (long) (1000000.0 * gWorkers / gRate);
+}
+
+static void resetStats(stats_t *stats){
+  memset(stats, 0, sizeof(stats_t));
+  histogram_reset(&stats->connect);
+  histogram_reset(&stats->first);
+  histogram_reset(&stats->last);
+  histogram_reset(&stats->service);
+}
+
+static void mergeStats(stats_t *into, stats_t *from){
+  into->sent += from->sent;
+  into->ok += from->ok;
+  into->failed += from->failed;
+  into->unfinished += from->unfinished;
+  into->bytes += from->bytes;
+  histogram_merge(&into->connect, &from->connect);
+  histogram_merge(&into->first, &from->first);
+  histogram_merge(&into->last, &from->last);
+  histogram_merge(&into->service, &from->service);
+}
+
+/* Writes a worker's stats to the coordinator */
+static void sendStats(int fd, stats_t *stats){
+  char *data = (char*) stats;
+  size_t len = sizeof(stats_t);
+  ssize_t written;
+
+  while(len > 0){
+    if( 0 > (written = write(fd, data, len))){
+      if (errno == EINTR)
+        continue;
+      perror("Unable to report to the coordinator");
+      exit(EXIT_FAILURE);
+    }
+    data += written;
+    len -= written;
+  }
+}
+
+/* Reads a worker's stats, returning 0 once the worker has finished */
+static int receiveStats(int fd, stats_t *stats){
+  char *data = (char*) stats;
+  size_t len = sizeof(stats_t);
+  ssize_t nread;
+
+  while(len > 0){
+    if( 0 >= (nread = read(fd, data, len))){
+      if (nread < 0 && errno == EINTR)
+        continue;
+      return 0;
+    }
+    data += nread;
+    len -= nread;
+  }
+  return 1;
+}
+
+/* Callbacks ========================================================= */
+static void writecb(void* data, size_t data_len, void *arg){
+  request_t *req = (request_t*) arg;
+
+  req->bytes += data_len;
+}
+
+/*
+ * Requests are started on a schedule that does not depend on how fast
+ * responses come back.  Latencies are measured from the scheduled start,
+ * so time a request spends waiting behind a slow server, or for a free
+ * slot when gMaxInflight is reached, is counted instead of omitted.  A
+ * worker sends its stats to report_fd every interval and starts afresh;
+ * without one they cover the whole run.
+ */
+static void runLoad(long start, long end, stats_t *stats, int report_fd){
+  int i, returncode, inflight = 0, nfree;
+  int *free_slots;
+  long next, now, timeout, report_at, interval;
+  request_t *requests, *req;
+  gfcmulti_t *gfm;
+  gfcrequest_t *gfr;
+  char *path;
+
+  if( NULL == (gfm = gfc_multi_create())){
+    fprintf(stderr, "Unable to create multi handle.\n");
+    exit(EXIT_FAILURE);
+  }
+  requests = calloc(gMaxInflight, sizeof(request_t));
+
+  /* Free request slots are kept on a stack, so starting and finishing a
+     request does not search the table */
+  free_slots = malloc(gMaxInflight * sizeof(int));
+  for(nfree = 0; nfree < gMaxInflight; nfree++)
+    free_slots[nfree] = gMaxInflight - 1 - nfree;
+
+  while ((now = nowUs()) < start)
+    usleep(start - now);
+
+  report_at = start + INTERVAL_US;
+  next = nextArrival(start, -1, &path);
+  while (next < end || inflight > 0){
+    now = nowUs();
+    if (next >= end && now > end + DRAIN_US)
+      break;
+
+    while (next < end && next <= now && inflight < gMaxInflight){
+      req = &requests[free_slots[--nfree]];
+      req->gfr = gfc_create();
+      req->intended = next;
+      req->bytes = 0;
+      gfc_set_server(req->gfr, gServer);
+      gfc_set_path(req->gfr, path);
+      gfc_set_port(req->gfr, gPort);
+      gfc_set_writefunc(req->gfr, writecb);
+      gfc_set_writearg(req->gfr, req);
+
+      req->started = nowUs();
+      gfc_multi_add(gfm, req->gfr);
+      inflight++;
+      stats->sent++;
+      next = nextArrival(start, next, &path);
+    }
+
+    /* Sleep until the next arrival unless it is already due */
+    timeout = 100;
+    if (next < end && inflight < gMaxInflight)
+      timeout = next > now ? (next - now) / 1000 : 0;
+    if( 0 > gfc_multi_perform(gfm, (int) timeout) && errno != EINTR){
+      perror("gfc_multi_perform");
+      break;
+    }
+
+    now = nowUs();
+    while(NULL != (gfr = gfc_multi_info_read(gfm, &returncode))){
+      req = (request_t*) gfc_get_writearg(gfr);
+
+      if (returncode < 0 || gfc_get_status(gfr) != GF_OK)
+        stats->failed++;
+      else {
+        stats->ok++;
+        stats->bytes += req->bytes;
+        if (gfc_get_connect_time(gfr) > 0)
+          histogram_record(&stats->connect, gfc_get_connect_time(gfr));
+        histogram_record(&stats->first, req->started - req->intended + gfc_get_header_time(gfr));
+        histogram_record(&stats->last, now - req->intended);
+        histogram_record(&stats->service, now - req->started);
+      }
+
+      gfc_cleanup(gfr);
+      req->gfr = NULL;
+      free_slots[nfree++] = req - requests;
+      inflight--;
+    }
+
+    if (report_fd >= 0 && now >= report_at){
+      sendStats(report_fd, stats);
+      interval = stats->interval;
+      resetStats(stats);
+      stats->interval = interval + 1;
+      report_at += INTERVAL_US;
+    }
+  }
+
+  /* Anything still running missed the drain deadline */
+  stats->unfinished = inflight;
+  if (report_fd >= 0)
+    sendStats(report_fd, stats);
+
+  gfc_multi_cleanup(gfm);
+  for(i = 0; i < gMaxInflight; i++)
+    if (requests[i].gfr != NULL)
+      gfc_cleanup(requests[i].gfr);
+  free(requests);
+  free(free_slots);
+}
+
+/* Pins the calling process to one CPU, wrapping around when there are more workers */
+static void pinWorker(int worker){
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t cpus;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(worker % (ncpus > 0 ? ncpus : 1), &cpus);
+  if (0 > sched_setaffinity(0, sizeof(cpus), &cpus))
+    perror("Unable to pin worker");
+}
+
+static void printInterval(stats_t *stats){
+  fprintf(stdout, "%5lds %9zu %9zu %9ld %9ld %9ld\n", stats->interval + 1,
+          stats->ok, stats->failed,
+          (long) histogram_percentile(&stats->last, 50), (long) histogram_percentile(&stats->last, 99),
+          (long) stats->last.max);
+}
+
+/*
+ * Forks the workers, each pinned to its own CPU and starting at the same
+ * instant, and merges the stats they stream back over their pipes into
+ * totals.  An interval is printed once every worker has reported it.
+ */
+static void runWorkers(long start, long end, stats_t *totals){
+  struct pollfd fds[gWorkers];
+  pid_t pids[gWorkers];
+  int reported[INTERVAL_SLOTS];
+  stats_t *record, *slots;
+  stats_t *slot;
+  int pipefd[2];
+  int i, j, running;
+
+  fflush(stdout);
+  for(i = 0; i < gWorkers; i++){
+    if( 0 > pipe(pipefd) || 0 > (pids[i] = fork())){
+      perror("Unable to start worker");
+      exit(EXIT_FAILURE);
+    }
+
+    if (pids[i] == 0){
+      for(j = 0; j < i; j++)
+        close(fds[j].fd);
+      close(pipefd[0]);
+
+      gWorker = i;
+      gSeed[2] = (unsigned short) i;
+      pinWorker(i);
+
+      /* Random paths are drawn from a stream of each worker's own, and
+         sequential cursors start on a different line in each worker */
+      workload_set_seed(gWorkloadSeed * gWorkers + i);
+      for(j = 0; gSequential && gArrival != ARRIVAL_TRACE && j < i; j++)
+        workload_get_path();
+
+      record = malloc(sizeof(stats_t));
+      resetStats(record);
+      gfc_global_init();
+      runLoad(start, end, record, pipefd[1]);
+      gfc_global_cleanup();
+      exit(EXIT_SUCCESS);
+    }
+
+    close(pipefd[1]);
+    fds[i].fd = pipefd[0];
+    fds[i].events = POLLIN;
+  }
+
+  record = malloc(sizeof(stats_t));
+  slots = malloc(INTERVAL_SLOTS * sizeof(stats_t));
+  for(i = 0; i < INTERVAL_SLOTS; i++){
+    resetStats(&slots[i]);
+    slots[i].interval = i;
+    reported[i] = 0;
+  }
+
+  fprintf(stdout, "%6s %9s %9s %9s %9s %9s\n", "Time", "ok", "failed", "p50 (us)", "p99 (us)", "max (us)");
+  for(running = gWorkers; running > 0; ){
+    if( 0 > poll(fds, gWorkers, -1)){
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    for(i = 0; i < gWorkers; i++){
+      if (0 == fds[i].revents)
+        continue;
+
+      if (!receiveStats(fds[i].fd, record)){
+        close(fds[i].fd);
+        fds[i].fd = -1;
+        running--;
+        continue;
+      }
+      mergeStats(totals, record);
+
+      /*
+       * A worker that has finished reports no more intervals, and one too
+       * far behind has had its slot taken, so those intervals are printed
+       * as they stand.
+       */
+      slot = &slots[record->interval % INTERVAL_SLOTS];
+      if (slot->interval > record->interval)
+        continue;
+      if (slot->interval < record->interval){
+        if (reported[slot - slots] > 0)
+          printInterval(slot);
+        resetStats(slot);
+        slot->interval = record->interval;
+        reported[slot - slots] = 0;
+      }
+      mergeStats(slot, record);
+      if (++reported[slot - slots] == gWorkers){
+        printInterval(slot);
+        resetStats(slot);
+        slot->interval = record->interval + INTERVAL_SLOTS;
+        reported[slot - slots] = 0;
+      }
+    }
+  }
+
+  /* Intervals that workers finished during */
+  for(i = 0; i < INTERVAL_SLOTS; i++){
+    slot = NULL;
+    for(j = 0; j < INTERVAL_SLOTS; j++)
+      if (reported[j] > 0 && (slot == NULL || slots[j].interval < slot->interval))
+        slot = &slots[j];
+    if (slot == NULL)
+      break;
+    printInterval(slot);
+    reported[slot - slots] = 0;
+  }
+
+  for(i = 0; i < gWorkers; i++)
+    waitpid(pids[i], NULL, 0);
+  free(record);
+  free(slots);
+}
+
+static void printRow(char *name, histogram_t *h){
+  fprintf(stdout, "%-18s %9ld %9ld %9ld %9ld %9ld %9.0f\n", name,
+          (long) histogram_percentile(h, 50), (long) histogram_percentile(h, 90),
+          (long) histogram_percentile(h, 99), (long) histogram_percentile(h, 99.9),
+          (long) h->max, histogram_mean(h));
+}
+
+/* Main ========================================================= */
+int main(int argc, char **argv) {
+/* COMMAND LINE OPTIONS ============================================= */
+  char *workload_path = "workload.txt";
+  int duration = 10;
+  char *distribution = "seq";
+
+  int option_char = 0;
+  long start, end, now;
+  stats_t *totals;
+
+  // Parse and set command line arguments
+  while ((option_char = getopt_long(argc, argv, "s:p:w:r:d:a:D:m:P:S:h", gLongOptions, NULL)) != -1) {
+    switch (option_char) {
+      case 's': // server
+        gServer = optarg;
+        break;
+      case 'p': // port
+        gPort = atoi(optarg);
+        break;
+      case 'w': // workload-path
+        workload_path = optarg;
+        break;
+      case 'r': // rate
+        gRate = atof(optarg);
+        break;
+      case 'd': // duration
+        duration = atoi(optarg);
+        break;
+      case 'a': // arrival
+        if (0 == strcmp(optarg, "poisson"))
+          gArrival = ARRIVAL_POISSON;
+        else if (0 == strcmp(optarg, "trace"))
+          gArrival = ARRIVAL_TRACE;
+        else if (0 != strcmp(optarg, "fixed")){
+          Usage();
+          exit(1);
+        }
+        break;
+      case 'D': // distribution
+        distribution = optarg;
+        break;
+      case 'm': // max-inflight
+        gMaxInflight = atoi(optarg);
+        break;
+      case 'P': // processes
+        gWorkers = atoi(optarg);
+        break;
+      case 'S': // seed
+        gSeed[1] = (unsigned short) atoi(optarg);
+        gWorkloadSeed = (unsigned int) atoi(optarg);
+        workload_set_seed(gWorkloadSeed);
+        break;
+      case 'h': // help
+        Usage();
+        exit(0);
+        break;
+      default:
+        Usage();
+        exit(1);
+    }
+  }
+
+  if (gRate <= 0 || duration <= 0 || gMaxInflight <= 0 || gWorkers <= 0){
+    Usage();
+    exit(1);
+  }
+
+  if( EXIT_SUCCESS != workload_init(workload_path)){
+    fprintf(stderr, "Unable to load workload file %s.\n", workload_path);
+    exit(EXIT_FAILURE);
+  }
+  gSequential = 0 == strcmp(distribution, "seq");
+  if( 0 > workload_set_distribution(distribution)){
+    fprintf(stderr, "Unknown distribution %s.\n", distribution);
+    exit(EXIT_FAILURE);
+  }
+
+  totals = malloc(sizeof(stats_t));
+  resetStats(totals);
+
+  if (gWorkers > 1){
+    start = nowUs() + START_DELAY_US;
+    end = start + duration * 1000000L;
+    runWorkers(start, end, totals);
+  }
+  else {
+    gfc_global_init();
+    start = nowUs();
+    end = start + duration * 1000000L;
+    runLoad(start, end, totals, -1);
+    gfc_global_cleanup();
+  }
+  now = nowUs();
+
+  fprintf(stdout, "Requests: %zu sent, %zu ok, %zu failed, %zu unfinished in %.2f s\n",
+          totals->sent, totals->ok, totals->failed, totals->unfinished, (now - start) / 1000000.0);
+  fprintf(stdout, "Throughput: %.1f req/s, %.2f MB/s (offered %.1f req/s)\n",
+          totals->ok * 1000000.0 / (now - start), totals->bytes / ((now - start) / 1000000.0) / 1e6,
+          totals->sent / (double) duration);
+  fprintf(stdout, "%-18s %9s %9s %9s %9s %9s %9s\n", "Latency (us)", "p50", "p90", "p99", "p99.9", "max", "mean");
+  printRow("connect", &totals->connect);
+  printRow("first byte", &totals->first);
+  printRow("last byte", &totals->last);
+  printRow("last byte (sent)", &totals->service);
+
+  free(totals);
+
+  return 0;
+}
@@ -0,0 +1,314 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "xxhash.h"
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  gfcorpus [options]\n"                                                      \
+"options:\n"                                                                  \
+"  -n [files]          Number of files to generate (Default: 1000)\n"         \
+"  -o [directory]      Directory the corpus and its lists go in (Default: corpus)\n"\
+"  -z [sizes]          Size distribution of the files (Default: lognormal:16384:1.5)\n"\
+"                        fixed:<bytes>\n"                                     \
+"                        lognormal:<median bytes>:<sigma>\n"                  \
+"                        bimodal:<small bytes>:<large bytes>:<large fraction>\n"\
+"                        histogram:<file of \"<bytes> <count>\" lines>\n"      \
+"  -S [seed]           Seed for sizes, contents and workload order (Default: 1)\n"\
+"  -h                  Show this help message\n"                              \
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] = {
+  {"files",         required_argument,      NULL,           'n'},
+  {"output",        required_argument,      NULL,           'o'},
+  {"sizes",         required_argument,      NULL,           'z'},
+  {"seed",          required_argument,      NULL,           'S'},
+  {"help",          no_argument,            NULL,           'h'},
+  {NULL,            0,                      NULL,             0}
+};
+
+/* Size distributions */
+#define SIZES_FIXED 0
+#define SIZES_LOGNORMAL 1
+#define SIZES_BIMODAL 2
+#define SIZES_HISTOGRAM 3
+
+/* Files are spread over directories of this many */
+#define FILES_PER_DIR 1000
+
+/* File contents are generated and written in chunks of this size */
+#define WRITE_CHUNK (1 << 20)
+
+/* One bucket of a measured size histogram */
+typedef struct bucket_t {
+  double size;
+  double cumulative;
+} bucket_t;
+
+static int gSizes = SIZES_LOGNORMAL;
+static double gSizeA = 16384, gSizeB = 1.5, gSizeC = 0;
+static bucket_t *gBuckets = NULL;
+static size_t gBucketsLen = 0;
+static unsigned short gSeed[3] = {0x330e, 1, 0};
+
+static void Usage() {
+	fprintf(stdout, "%s", USAGE);
+}
+
+/* Reads "<bytes> <count>" lines into a cumulative table to sample sizes from */
+static void loadHistogram(char *path){
+  double size, count, total = 0;
+  size_t capacity = 0;
+  char line[256];
+  FILE *file;
+
+  if( NULL == (file = fopen(path, "r"))){
+    perror("Unable to open size histogram");
+    exit(EXIT_FAILURE);
+  }
+
+  while(NULL != fgets(line, sizeof(line), file)){
+    if (2 != sscanf(line, "%lf %lf", &size, &count) || size < 0 || count <= 0)
+      continue;
+    if (gBucketsLen == capacity){
+      capacity = capacity ? capacity * 2 : 64;
+      gBuckets = realloc(gBuckets, capacity * sizeof(bucket_t));
+    }
+    total += count;
+    gBuckets[gBucketsLen].size = size;
+    gBuckets[gBucketsLen++].cumulative = total;
+  }
+  fclose(file);
+
+  if (gBucketsLen == 0){
+    fprintf(stderr, "Size histogram %s holds no buckets.\n", path);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Sets the size distribution from its name, returning -1 if it is not understood */
+static int setSizes(char *spec){
+  if (1 == sscanf(spec, "fixed:%lf", &gSizeA))
+    gSizes = SIZES_FIXED;
+  else if (2 == sscanf(spec, "lognormal:%lf:%lf", &gSizeA, &gSizeB))
+    gSizes = SIZES_LOGNORMAL;
+  else if (3 == sscanf(spec, "bimodal:%lf:%lf:%lf", &gSizeA, &gSizeB, &gSizeC))
+    gSizes = SIZES_BIMODAL;
+  else if (0 == strncmp(spec, "histogram:", 10)){
+    gSizes = SIZES_HISTOGRAM;
+    loadHistogram(spec + 10);
+  }
+  else
+    return -1;
+
+  return gSizeA >= 0 && gSizeB >= 0 ? 0 : -1;
+}
+
+static double normal(){
+  return sqrt(-2 * log(1 - erand48(gSeed))) * cos(2 * M_PI * erand48(gSeed));
+}
+
+static size_t sampleSize(){
+  double u, size;
+  size_t lo, hi, mid;
+
+  switch (gSizes){
+    case SIZES_LOGNORMAL:
+      size = gSizeA * exp(gSizeB * normal());
+      break;
+    case SIZES_BIMODAL:
+      size = erand48(gSeed) < gSizeC ? gSizeB : gSizeA;
+      break;
+    case SIZES_HISTOGRAM:
+      u = erand48(gSeed) * gBuckets[gBucketsLen - 1].cumulative;
+      for (lo = 0, hi = gBucketsLen - 1; lo < hi; ){
+        mid = lo + (hi - lo) / 2;
+        if (gBuckets[mid].cumulative <= u)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      size = gBuckets[lo].size;
+      break;
+    default:
+      size = gSizeA;
+  }
+
+  return (size_t) (size + 0.5);
+}
+
+static void makeDirectory(char *path){
+  if (0 > mkdir(path, S_IRWXU) && errno != EEXIST){
+    perror("Unable to create directory");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static FILE* openList(char *directory, char *name){
+  char path[512];
+  FILE *file;
+
+  snprintf(path, sizeof(path), "%s/%s", directory, name);
+  if( NULL == (file = fopen(path, "w"))){
+    perror("Unable to create list");
+    exit(EXIT_FAILURE);
+  }
+  return file;
+}
+
+/*
+ * Writes size bytes of incompressible data to path and returns their
+ * xxh64, the tag the server will send for the file.  Every file gets its
+ * own stream so equal sizes do not mean equal contents.
+ */
+static uint64_t writeContent(char *path, size_t size, uint64_t *buffer, uint64_t state){
+  xxh64_state_t hash;
+  size_t len, i;
+  ssize_t written;
+  char *data;
+  int fd;
+
+  if( 0 > (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644))){
+    perror("Unable to create file");
+    exit(EXIT_FAILURE);
+  }
+
+  xxh64_reset(&hash, 0);
+  while(size > 0){
+    len = size < WRITE_CHUNK ? size : WRITE_CHUNK;
+    for (i = 0; i < (len + 7) / 8; i++){
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      buffer[i] = state;
+    }
+    xxh64_update(&hash, buffer, len);
+
+    for (data = (char*) buffer; data < (char*) buffer + len; data += written){
+      if( 0 > (written = write(fd, data, (char*) buffer + len - data))){
+        perror("Unable to write file");
+        exit(EXIT_FAILURE);
+      }
+    }
+    size -= len;
+  }
+
+  close(fd);
+  return xxh64_digest(&hash);
+}
+
+/* Main ========================================================= */
+int main(int argc, char **argv) {
+/* COMMAND LINE OPTIONS ============================================= */
+  char *directory = "corpus";
+  unsigned int nfiles = 1000;
+
+  int option_char = 0;
+  unsigned int i, j, tmp;
+  unsigned int *order;
+  uint64_t *buffer;
+  uint64_t total = 0;
+  size_t size;
+  char key[64], local[512], dir[512];
+  char tag[XXH64_HEX_LEN + 1];
+  FILE *content, *locals, *workload, *manifest;
+
+  // Parse and set command line arguments
+  while ((option_char = getopt_long(argc, argv, "n:o:z:S:h", gLongOptions, NULL)) != -1) {
+    switch (option_char) {
+      case 'n': // files
+        nfiles = atoi(optarg);
+        break;
+      case 'o': // output
+        directory = optarg;
+        break;
+      case 'z': // sizes
+        if (0 > setSizes(optarg)){
+          Usage();
+          exit(1);
+        }
+        break;
+      case 'S': // seed
+        gSeed[1] = (unsigned short) atoi(optarg);
+        gSeed[2] = (unsigned short) (atoi(optarg) >> 16);
+        break;
+      case 'h': // help
+        Usage();
+        exit(0);
+        break;
+      default:
+        Usage();
+        exit(1);
+    }
+  }
+
+  if (nfiles == 0 || strlen(directory) > 200){
+    Usage();
+    exit(1);
+  }
+
+  makeDirectory(directory);
+  snprintf(dir, sizeof(dir), "%s/corpus", directory);
+  makeDirectory(dir);
+
+  content = openList(directory, "content.txt");
+  locals = openList(directory, "locals.txt");
+  workload = openList(directory, "workload.txt");
+  manifest = openList(directory, "manifest.txt");
+
+  if( NULL == (buffer = malloc(WRITE_CHUNK + 8))){
+    perror("Unable to allocate write buffer");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < nfiles; i++){
+    if (i % FILES_PER_DIR == 0){
+      snprintf(dir, sizeof(dir), "%s/corpus/%03u", directory, i / FILES_PER_DIR);
+      makeDirectory(dir);
+    }
+
+    snprintf(key, sizeof(key), "/corpus/%03u/%08u.bin", i / FILES_PER_DIR, i);
+    snprintf(local, sizeof(local), "%s%s", directory, key);
+    size = sampleSize();
+    xxh64_tohex(writeContent(local, size, buffer, ((uint64_t) i << 32) ^ nrand48(gSeed) ^ 0x9e3779b97f4a7c15ULL), tag);
+    tag[XXH64_HEX_LEN] = '\0';
+    total += size;
+
+    /* content_init and the cache daemon both read "<path> <local file>" */
+    fprintf(content, "%s %s\n", key, local);
+    fprintf(locals, "%s %s\n", key, local);
+    fprintf(manifest, "%s %s\n", key, tag);
+  }
+
+  /* The workload lists every file once, in an order unrelated to size */
+  order = malloc(nfiles * sizeof(unsigned int));
+  for (i = 0; i < nfiles; i++)
+    order[i] = i;
+  for (i = nfiles - 1; i > 0; i--){
+    j = nrand48(gSeed) % (i + 1);
+    tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+  for (i = 0; i < nfiles; i++)
+    fprintf(workload, "/corpus/%03u/%08u.bin\n", order[i] / FILES_PER_DIR, order[i]);
+
+  fclose(content);
+  fclose(locals);
+  fclose(workload);
+  fclose(manifest);
+  free(order);
+  free(buffer);
+
+  fprintf(stdout, "Wrote %u files, %llu bytes, to %s\n", nfiles, (unsigned long long) total, directory);
+
+  return 0;
+}
@@ -3,27 +3,128 @@
 #include <string.h>
 #include <stdlib.h>
 #include <netdb.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
 
 #include "gfserver.h"
+#include "log.h"
+#include "probe.h"
+#include "stats.h"
+
+#define MAX_EVENTS 64
+#define DEFAULT_IDLE_TIMEOUT 30
+
+// access log records are gathered per thread and written this many at a time
+#define ACCESS_BATCH 64
+
+// counters published with gfserver_set_stats
+#define STAT_REQUESTS 0
+#define STAT_OK 1
+#define STAT_NOT_MODIFIED 2
+#define STAT_NOT_FOUND 3
+#define STAT_ERRORS 4
+#define STAT_ABORTED 5
+#define STAT_BYTES 6
+
+static const char *stat_names[] = {
+	"requests", "ok", "not_modified", "not_found", "errors", "aborted", "bytes"
+};
 
 /*
  * Modify this file to implement the interface specified in
  * gfserver.h.
  */
 
+// access log records waiting to be written by one thread
+typedef struct gfs_access_buffer_t {
+	pthread_mutex_t mutex;
+	int count;
+	struct gfs_access_buffer_t *next;
+	gfs_access_record_t records[ACCESS_BATCH];
+} gfs_access_buffer_t;
+
 // structure for get file server
 typedef struct gfserver_t {
 	unsigned short portno;
 	int max_npending;
 	ssize_t (*handler)(gfcontext_t *, char *, void*);
 	void* handlerarg;
+	int idle_timeout;
+	int lease;
+	int epoll_fd;
+	pthread_mutex_t idle_mutex;
+	gfcontext_t *idle_head;
+	gfcontext_t *idle_tail;
+
+	// access log, -1 when off
+	int access_fd;
+	time_t access_flushed;
+	pthread_mutex_t access_mutex;
+	gfs_access_buffer_t *access_buffers;
+
+	// live statistics published for gfstat
+	int stats;
 } gfserver_t;
 
-// structure for get file context
+// structure for get file context, one per client connection
 typedef struct gfcontext_t {
 	int socket_fd;
+	gfserver_t *gfs;
+
+	// references held by the serve loop and the response in flight
+	int refs;
+	int finished;
+	int keepalive;
+	size_t file_len;
+	size_t bytes_sent;
+
+	// access log and stats times of the request in flight, ns since the epoch
+	int access_pending;
+	gfstatus_t status;
+	uint64_t accepted;
+	uint64_t parsed;
+	uint64_t handler;
+	uint64_t header;
+
+	// idle connection list, ordered by idle_since
+	time_t idle_since;
+	struct gfcontext_t *idle_prev;
+	struct gfcontext_t *idle_next;
+
+	char path[MAX_REQUEST_LEN];
+	int has_client_tag;
+	char client_tag[MAX_TAG_LEN + 1];
+	char tag[MAX_TAG_LEN + 1];
+	char accept_encoding[MAX_ENCODING_LEN + 1];
+	char encoding[MAX_ENCODING_LEN + 1];
 } gfcontext_t;
 
+// helpers for ending a response and freeing its context
+static void gfs_finish(gfcontext_t *ctx);
+static void gfs_release(gfcontext_t *ctx);
+static void gfs_access_log(gfcontext_t *ctx, int aborted);
+
+// this thread's access log records, one server per process
+static __thread gfs_access_buffer_t *access_buffer = NULL;
+
+// the server whose access log is flushed at exit
+static gfserver_t *access_server = NULL;
+static void gfs_access_flush_at_exit();
+
+/*
+ * Returns the wall clock time in nanoseconds.
+ * @return ns since the epoch
+ */
+static uint64_t gfs_now(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 /*
  * Sends to the client the Getfile header containing the appropriate
  * status and file length for the given inputs.  This function should
@@ -34,26 +135,65 @@ typedef struct gfcontext_t {
  * @return status of send
  */
 ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len){
-	char header[100];
+	char header[200];
+	int header_len, options_len;
 	char status_string[20];
+	ssize_t sent;
 
 	// convert the status to the appropriate string
 	switch(status) {
 		case GF_OK:
 			strcpy(status_string, "OK");
-			sprintf(header, "GETFILE %s %zu\r\n\r\n", status_string, file_len);
+			break;
+		case GF_NOT_MODIFIED:
+			strcpy(status_string, "NOT_MODIFIED");
 			break;
 		case GF_FILE_NOT_FOUND:
 			strcpy(status_string, "FILE_NOT_FOUND");
-			sprintf(header, "GETFILE %s \r\n\r\n", status_string);
 			break;
 		default:
 			strcpy(status_string, "ERROR");
-			sprintf(header, "GETFILE %s \r\n\r\n", status_string);
 	}
 
-	// send to client
-	return send(ctx->socket_fd, header, strlen(header), 0);
+	if (status == GF_OK)
+		header_len = sprintf(header, "GETFILE %s %zu", status_string, file_len);
+	else
+		header_len = sprintf(header, "GETFILE %s", status_string);
+	options_len = header_len;
+
+	if (status == GF_OK && ctx->tag[0] != '\0')
+		header_len += sprintf(header + header_len, " TAG=%s", ctx->tag);
+	if (status == GF_OK && ctx->encoding[0] != '\0')
+		header_len += sprintf(header + header_len, " ENC=%s", ctx->encoding);
+
+	// a tagged response may be served from the client's cache until the lease ends
+	if (ctx->gfs->lease > 0 && ((status == GF_OK && ctx->tag[0] != '\0') || status == GF_NOT_MODIFIED))
+		header_len += sprintf(header + header_len, " LEASE=%d", ctx->gfs->lease);
+
+	// acknowledge keep-alive so the client knows it may reuse the connection
+	if (ctx->keepalive)
+		header_len += sprintf(header + header_len, " KEEPALIVE=%d", ctx->gfs->idle_timeout);
+
+	// responses without options keep the blank before the marker
+	if (status != GF_OK && header_len == options_len)
+		header_len += sprintf(header + header_len, " ");
+	strcpy(header + header_len, "\r\n\r\n");
+
+	// send to client, a response without a body is complete right away and
+	// has no later gfs_send to notice a failure, so it is aborted here
+	ctx->file_len = (status == GF_OK) ? file_len : 0;
+	ctx->bytes_sent = 0;
+	ctx->status = status;
+	sent = send(ctx->socket_fd, header, strlen(header), MSG_NOSIGNAL);
+	if (ctx->gfs->access_fd >= 0)
+		ctx->header = gfs_now();
+	if (ctx->file_len == 0) {
+		if (sent > 0)
+			gfs_finish(ctx);
+		else
+			gfs_abort(ctx);
+	}
+	return sent;
 }
 
 /*
@@ -67,7 +207,90 @@ ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len){
  * @return status of send
  */
 ssize_t gfs_send(gfcontext_t *ctx, void *data, size_t len){
-	return send(ctx->socket_fd, data, len, 0);
+	ssize_t sent = send(ctx->socket_fd, data, len, MSG_NOSIGNAL);
+
+	PROBE(gfserver, gfs_send, ctx, sent);
+	// the context must not be touched once the response is finished
+	if (sent > 0) {
+		ctx->bytes_sent += sent;
+		if (ctx->bytes_sent >= ctx->file_len)
+			gfs_finish(ctx);
+	}
+	return sent;
+}
+
+/*
+ * Returns the validator tag the client sent with its request, or NULL
+ * if the request was unconditional.
+ * @param ctx - pointer to gfcontext_t client context
+ * @return tag string or NULL
+ */
+char* gfs_get_tag(gfcontext_t *ctx){
+	return ctx->has_client_tag ? ctx->client_tag : NULL;
+}
+
+/*
+ * Sets the validator tag to include in a subsequent GF_OK header.
+ * @param ctx - pointer to gfcontext_t client context
+ * @param tag - tag of the content being sent, NULL to clear
+ */
+void gfs_set_tag(gfcontext_t *ctx, const char *tag){
+	memset(ctx->tag, '\0', sizeof(ctx->tag));
+	if (tag != NULL)
+		strncpy(ctx->tag, tag, MAX_TAG_LEN);
+}
+
+/*
+ * Returns the comma separated list of encodings the client can decode
+ * (the ENC= option), or NULL if it only accepts the file as is.
+ * @param ctx - pointer to gfcontext_t client context
+ * @return encoding list or NULL
+ */
+char* gfs_get_accept_encoding(gfcontext_t *ctx){
+	return ctx->accept_encoding[0] != '\0' ? ctx->accept_encoding : NULL;
+}
+
+/*
+ * Sets the encoding of the body to include in a subsequent GF_OK header.
+ * @param ctx - pointer to gfcontext_t client context
+ * @param encoding - encoding name, NULL for an unencoded body
+ */
+void gfs_set_encoding(gfcontext_t *ctx, const char *encoding){
+	memset(ctx->encoding, '\0', sizeof(ctx->encoding));
+	if (encoding != NULL)
+		strncpy(ctx->encoding, encoding, MAX_ENCODING_LEN);
+}
+
+/*
+ * Parses the optional NAME=VALUE tokens that may follow the path on the
+ * request line, e.g. "GETFILE GET /a.jpg TAG=0123456789abcdef\r\n\r\n".
+ * Unknown tokens are ignored so that old and new peers interoperate.
+ * The request buffer is modified in place.
+ * @param ctx - pointer to gfcontext_t client context
+ * @param request - received request text
+ */
+static void gfs_parse_options(gfcontext_t *ctx, char *request){
+	char *end, *token, *saveptr;
+	int i;
+
+	if ((end = strstr(request, "\r\n\r\n")) != NULL)
+		*end = '\0';
+
+	// skip over the scheme, method and path
+	token = strtok_r(request, " ", &saveptr);
+	for (i = 0; i < 2 && token != NULL; i++)
+		token = strtok_r(NULL, " ", &saveptr);
+
+	while ((token = strtok_r(NULL, " ", &saveptr)) != NULL) {
+		if (strncmp(token, "TAG=", 4) == 0 && strlen(token + 4) <= MAX_TAG_LEN) {
+			strcpy(ctx->client_tag, token + 4);
+			ctx->has_client_tag = 1;
+		}
+		else if (strncmp(token, "ENC=", 4) == 0 && strlen(token + 4) <= MAX_ENCODING_LEN)
+			strcpy(ctx->accept_encoding, token + 4);
+		else if (strncmp(token, "KEEPALIVE=", 10) == 0)
+			ctx->keepalive = ctx->gfs->idle_timeout > 0;
+	}
 }
 
 /*
@@ -76,7 +299,12 @@ ssize_t gfs_send(gfcontext_t *ctx, void *data, size_t len){
  * @param gfcontext_t - client context to abord
  */
 void gfs_abort(gfcontext_t *ctx){
+	if (!__sync_bool_compare_and_swap(&ctx->finished, 0, 1))
+		return;
+
+	gfs_access_log(ctx, 1);
 	close(ctx->socket_fd);
+	gfs_release(ctx);
 }
 
 /*
@@ -93,6 +321,17 @@ gfserver_t* gfserver_create(){
 	gfs->max_npending = 1;
 	gfs->handler = NULL;
 	gfs->handlerarg = NULL;
+	gfs->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+	gfs->lease = 0;
+	gfs->epoll_fd = -1;
+	pthread_mutex_init(&gfs->idle_mutex, NULL);
+	gfs->idle_head = NULL;
+	gfs->idle_tail = NULL;
+	gfs->access_fd = -1;
+	gfs->access_flushed = 0;
+	pthread_mutex_init(&gfs->access_mutex, NULL);
+	gfs->access_buffers = NULL;
+	gfs->stats = 0;
 	return gfs;
 }
 
@@ -117,6 +356,76 @@ void gfserver_set_maxpending(gfserver_t *gfs, int max_npending){
 		gfs->max_npending = max_npending;
 }
 
+/*
+ * Sets how many seconds a keep-alive connection may sit idle between
+ * requests before the server closes it.  Zero disables keep-alive.
+ * @param gfs - pointer to gfcserver_t
+ * @param idle_timeout - seconds
+ */
+void gfserver_set_idletimeout(gfserver_t *gfs, int idle_timeout){
+	if (gfs != NULL && idle_timeout >= 0)
+		gfs->idle_timeout = idle_timeout;
+}
+
+/*
+ * Sets how many seconds a client may serve a tagged response from its
+ * cache before asking again.  Zero grants no leases.
+ * @param gfs - pointer to gfcserver_t
+ * @param lease - seconds
+ */
+void gfserver_set_lease(gfserver_t *gfs, int lease){
+	if (gfs != NULL && lease >= 0)
+		gfs->lease = lease;
+}
+
+/*
+ * Opens the access log, writing its header if the file is new.
+ * @param gfs - pointer to gfcserver_t
+ * @param path - file to append records to
+ * @return 0 on success, -1 if the file can't be opened
+ */
+int gfserver_set_accesslog(gfserver_t *gfs, const char *path){
+	char header[GFS_ACCESS_HEADER_LEN];
+	uint32_t record_len = sizeof(gfs_access_record_t);
+	struct stat st;
+	int fd;
+
+	if (gfs == NULL || 0 > (fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)))
+		return -1;
+
+	if (0 == fstat(fd, &st) && st.st_size == 0) {
+		memset(header, '\0', sizeof(header));
+		memcpy(header, GFS_ACCESS_MAGIC, 8);
+		memcpy(header + 8, &record_len, sizeof(record_len));
+		if (sizeof(header) != write(fd, header, sizeof(header))) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	gfs->access_fd = fd;
+
+	// records still gathered when the server stops are written at exit
+	if (access_server == NULL)
+		atexit(gfs_access_flush_at_exit);
+	access_server = gfs;
+	return 0;
+}
+
+/*
+ * Publishes request counters and latencies in shared memory for gfstat.
+ * @param gfs - pointer to gfcserver_t
+ * @param program - name the statistics are listed under
+ * @return 0 on success, -1 if the segment can't be created
+ */
+int gfserver_set_stats(gfserver_t *gfs, const char *program){
+	if (gfs == NULL || 0 > stats_init(program, stat_names, sizeof(stat_names) / sizeof(stat_names[0])))
+		return -1;
+
+	gfs->stats = 1;
+	return 0;
+}
+
 /*
  * Sets the handler callback, a function that will be called for each each
  * request.  As arguments, the receives
@@ -143,71 +452,406 @@ void gfserver_set_handlerarg(gfserver_t *gfs, void* arg){
 		gfs->handlerarg = arg;
 }
 
+/*
+ * Unlinks ctx from the idle list if it is on it.  Caller holds idle_mutex.
+ * @param gfs - server owning the list
+ * @param ctx - client context
+ */
+static void gfs_idle_remove(gfserver_t *gfs, gfcontext_t *ctx){
+	if (ctx->idle_since == 0)
+		return;
+
+	if (ctx->idle_prev != NULL)
+		ctx->idle_prev->idle_next = ctx->idle_next;
+	else
+		gfs->idle_head = ctx->idle_next;
+	if (ctx->idle_next != NULL)
+		ctx->idle_next->idle_prev = ctx->idle_prev;
+	else
+		gfs->idle_tail = ctx->idle_prev;
+
+	ctx->idle_prev = ctx->idle_next = NULL;
+	ctx->idle_since = 0;
+}
+
+/*
+ * Closes keep-alive connections that have been idle longer than the
+ * idle timeout.  Only called from the serve loop between epoll_waits,
+ * so no event for a swept connection can still be pending.
+ * @param gfs - server params utilized
+ */
+static void gfs_idle_sweep(gfserver_t *gfs){
+	time_t now = time(NULL);
+	gfcontext_t *ctx;
+
+	pthread_mutex_lock(&gfs->idle_mutex);
+	while ((ctx = gfs->idle_head) != NULL && ctx->idle_since + gfs->idle_timeout <= now) {
+		gfs_idle_remove(gfs, ctx);
+		epoll_ctl(gfs->epoll_fd, EPOLL_CTL_DEL, ctx->socket_fd, NULL);
+		close(ctx->socket_fd);
+		gfs_release(ctx);
+	}
+	pthread_mutex_unlock(&gfs->idle_mutex);
+}
+
+/*
+ * Returns the microseconds from one access log time to a later one.
+ * @param from - earlier time in ns
+ * @param to - later time in ns, 0 if it never came
+ * @return microseconds or GFS_ACCESS_NONE
+ */
+static uint32_t gfs_access_delta(uint64_t from, uint64_t to){
+	if (to == 0 || to < from)
+		return GFS_ACCESS_NONE;
+	return (to - from) / 1000 < GFS_ACCESS_NONE ? (to - from) / 1000 : GFS_ACCESS_NONE - 1;
+}
+
+/*
+ * Writes out a thread's gathered records.  Caller holds buffer->mutex.
+ * @param gfs - server params utilized
+ * @param buffer - records to write
+ */
+static void gfs_access_write(gfserver_t *gfs, gfs_access_buffer_t *buffer){
+	size_t len = buffer->count * sizeof(gfs_access_record_t);
+
+	// O_APPEND keeps the batches of several threads whole
+	if (len != write(gfs->access_fd, buffer->records, len))
+		L(GFLOG_ERROR, "[Server] Unable to write %d access log records", buffer->count);
+	buffer->count = 0;
+}
+
+/*
+ * Counts the request just finished on ctx in this thread's statistics.
+ * @param ctx - client context
+ * @param aborted - whether the response was cut short
+ * @param done - ns since the epoch the request finished
+ */
+static void gfs_stats_record(gfcontext_t *ctx, int aborted, uint64_t done){
+	stats_add(STAT_REQUESTS, 1);
+	switch (ctx->status) {
+		case GF_OK:
+			stats_add(STAT_OK, 1);
+			break;
+		case GF_NOT_MODIFIED:
+			stats_add(STAT_NOT_MODIFIED, 1);
+			break;
+		case GF_FILE_NOT_FOUND:
+			stats_add(STAT_NOT_FOUND, 1);
+			break;
+		default:
+			stats_add(STAT_ERRORS, 1);
+	}
+	if (aborted)
+		stats_add(STAT_ABORTED, 1);
+	stats_add(STAT_BYTES, ctx->bytes_sent);
+	stats_latency((done - ctx->accepted) / 1000);
+}
+
+/*
+ * Adds a record for the request just finished on ctx to this thread's
+ * batch, and counts it in the statistics.  Called once per request,
+ * before the connection can be reused.
+ * @param ctx - client context
+ * @param aborted - whether the response was cut short
+ */
+static void gfs_access_log(gfcontext_t *ctx, int aborted){
+	gfserver_t *gfs = ctx->gfs;
+	gfs_access_buffer_t *buffer;
+	gfs_access_record_t *record;
+	uint64_t done;
+
+	if (!ctx->access_pending)
+		return;
+	ctx->access_pending = 0;
+	if (gfs->access_fd < 0 && !gfs->stats)
+		return;
+	done = gfs_now();
+	if (gfs->stats)
+		gfs_stats_record(ctx, aborted, done);
+	if (gfs->access_fd < 0)
+		return;
+
+	if ((buffer = access_buffer) == NULL) {
+		if ((buffer = calloc(1, sizeof(gfs_access_buffer_t))) == NULL)
+			return;
+		pthread_mutex_init(&buffer->mutex, NULL);
+		pthread_mutex_lock(&gfs->access_mutex);
+		buffer->next = gfs->access_buffers;
+		gfs->access_buffers = buffer;
+		pthread_mutex_unlock(&gfs->access_mutex);
+		access_buffer = buffer;
+	}
+
+	pthread_mutex_lock(&buffer->mutex);
+	record = &buffer->records[buffer->count++];
+	record->accepted = ctx->accepted;
+	record->parsed = gfs_access_delta(ctx->accepted, ctx->parsed);
+	record->handler = gfs_access_delta(ctx->accepted, ctx->handler);
+	record->header = gfs_access_delta(ctx->accepted, ctx->header);
+	record->done = gfs_access_delta(ctx->accepted, done);
+	record->bytes = ctx->bytes_sent;
+	record->status = ctx->status;
+	record->aborted = aborted;
+	memcpy(record->path, ctx->path, sizeof(record->path));
+	if (buffer->count == ACCESS_BATCH)
+		gfs_access_write(gfs, buffer);
+	pthread_mutex_unlock(&buffer->mutex);
+}
+
+/*
+ * Writes out every thread's gathered records, at most once a second.
+ * Only called from the serve loop.
+ * @param gfs - server params utilized
+ */
+static void gfs_access_flush(gfserver_t *gfs){
+	time_t now = time(NULL);
+	gfs_access_buffer_t *buffer;
+
+	if (now == gfs->access_flushed)
+		return;
+	gfs->access_flushed = now;
+
+	pthread_mutex_lock(&gfs->access_mutex);
+	for (buffer = gfs->access_buffers; buffer != NULL; buffer = buffer->next) {
+		pthread_mutex_lock(&buffer->mutex);
+		if (buffer->count > 0)
+			gfs_access_write(gfs, buffer);
+		pthread_mutex_unlock(&buffer->mutex);
+	}
+	pthread_mutex_unlock(&gfs->access_mutex);
+}
+
+/*
+ * Writes out every thread's gathered records as the process exits, which
+ * gfserver_main does from its signal handlers.  A batch a worker is still
+ * adding to is skipped rather than waited for.
+ */
+static void gfs_access_flush_at_exit(){
+	gfserver_t *gfs = access_server;
+	gfs_access_buffer_t *buffer;
+
+	if (gfs == NULL || gfs->access_fd < 0 || 0 != pthread_mutex_trylock(&gfs->access_mutex))
+		return;
+	for (buffer = gfs->access_buffers; buffer != NULL; buffer = buffer->next) {
+		if (0 != pthread_mutex_trylock(&buffer->mutex))
+			continue;
+		if (buffer->count > 0)
+			gfs_access_write(gfs, buffer);
+		pthread_mutex_unlock(&buffer->mutex);
+	}
+	pthread_mutex_unlock(&gfs->access_mutex);
+}
+
+/*
+ * Drops one reference to ctx, freeing it when none are left.
+ * @param ctx - client context
+ */
+static void gfs_release(gfcontext_t *ctx){
+	if (__sync_sub_and_fetch(&ctx->refs, 1) == 0)
+		free(ctx);
+}
+
+/*
+ * Called once the whole response has been sent.  Keep-alive connections
+ * go back to the serve loop to wait for the next request, others are
+ * closed.  This may run on a handler's worker thread.
+ * @param ctx - client context
+ */
+static void gfs_finish(gfcontext_t *ctx){
+	gfserver_t *gfs = ctx->gfs;
+	struct epoll_event event;
+
+	if (!__sync_bool_compare_and_swap(&ctx->finished, 0, 1))
+		return;
+
+	gfs_access_log(ctx, 0);
+	if (!ctx->keepalive) {
+		close(ctx->socket_fd);
+		gfs_release(ctx);
+		return;
+	}
+
+	// the response reference now keeps the idle connection alive
+	pthread_mutex_lock(&gfs->idle_mutex);
+	ctx->idle_since = time(NULL);
+	ctx->idle_prev = gfs->idle_tail;
+	ctx->idle_next = NULL;
+	if (gfs->idle_tail != NULL)
+		gfs->idle_tail->idle_next = ctx;
+	else
+		gfs->idle_head = ctx;
+	gfs->idle_tail = ctx;
+	pthread_mutex_unlock(&gfs->idle_mutex);
+
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = ctx;
+	epoll_ctl(gfs->epoll_fd, EPOLL_CTL_MOD, ctx->socket_fd, &event);
+}
+
+/*
+ * Reads one request from a connection and hands it to the handler.  The
+ * caller's reference to ctx is released before returning.
+ * @param gfs - server params utilized
+ * @param ctx - client context
+ */
+static void gfs_serve_request(gfserver_t *gfs, gfcontext_t *ctx){
+	char client_buffer[4096];
+	char temp_buffer[4096];
+	ssize_t file_block_size;
+	size_t received = 0;
+	int extract_status = -1;
+	ssize_t handle_status = 0;
+	int attempts = 0;
+
+	// reset per request state, the connection may be reused
+	pthread_mutex_lock(&gfs->idle_mutex);
+	gfs_idle_remove(gfs, ctx);
+	pthread_mutex_unlock(&gfs->idle_mutex);
+	ctx->finished = 0;
+	ctx->keepalive = 0;
+	ctx->has_client_tag = 0;
+	memset(ctx->tag, '\0', sizeof(ctx->tag));
+	memset(ctx->accept_encoding, '\0', sizeof(ctx->accept_encoding));
+	memset(ctx->encoding, '\0', sizeof(ctx->encoding));
+	memset(ctx->path, '\0', sizeof(ctx->path));
+	ctx->status = 0;
+	ctx->bytes_sent = 0;
+	ctx->parsed = ctx->handler = ctx->header = 0;
+	if (gfs->access_fd >= 0 || gfs->stats)
+		ctx->accepted = gfs_now();
+
+	// prepate client buffer
+	memset(client_buffer, '\0', sizeof(client_buffer));
+
+	// receive client request and extract path
+	do {
+		memset(temp_buffer, '\0', sizeof(temp_buffer));
+		file_block_size = read(ctx->socket_fd, temp_buffer, sizeof(temp_buffer) - 1 - received);
+		L(GFLOG_TRACE, "[Server] Read %zd bytes of request", file_block_size);
+		// if everything was not received in one chunk keep adding on and looping
+		if (file_block_size > 0) {
+			strcat(client_buffer, temp_buffer);
+			received += file_block_size;
+		}
+		attempts = attempts + 1;
+	} while (strstr(client_buffer, "\r\n\r\n") == NULL && file_block_size > 0 &&
+			received < sizeof(client_buffer) - 1 && attempts < 10);
+
+	// client closed an idle connection
+	if (received == 0) {
+		gfs_abort(ctx);
+		gfs_release(ctx);
+		return;
+	}
+
+	// if file request was received try to extract path
+	ctx->access_pending = 1;
+	if (strstr(client_buffer, "\r\n\r\n") != NULL && strstr(client_buffer, "GETFILE GET") != NULL) {
+		memset(ctx->path, '\0', sizeof(ctx->path));
+		extract_status = sscanf(client_buffer, "GETFILE GET %127s\r\n\r\n", ctx->path);
+		if (extract_status > 0)
+			gfs_parse_options(ctx, client_buffer);
+	}
+	if (gfs->access_fd >= 0)
+		ctx->parsed = gfs_now();
+	PROBE(gfserver, request_parsed, ctx, ctx->path, extract_status > 0);
+
+	// if path was extracted successfully then send to handler
+	if (extract_status > 0) {
+		if (gfs->access_fd >= 0)
+			ctx->handler = gfs_now();
+		PROBE(gfserver, handler_enter, ctx, ctx->path);
+		handle_status = gfs->handler(ctx, ctx->path, gfs->handlerarg);
+		PROBE(gfserver, handler_exit, ctx, handle_status);
+	}
+	else
+		handle_status = gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+
+	if (handle_status < 0)
+		gfs_abort(ctx);
+	gfs_release(ctx);
+}
+
 /*
  * Starts the server.  Does not return.
  * @param gfs - server params utilized
  */
 void gfserver_serve(gfserver_t *gfs){
-	struct sockaddr_in server, client;
+	struct sockaddr_in server;
+	struct sockaddr_in6 server6;
+	struct sockaddr_storage client;
+	struct epoll_event event, events[MAX_EVENTS];
 	int server_socket_fd = 0;
 	int set_reuse_addr = 1;
-	char client_buffer[4096];
-	char temp_buffer[4096];
-	char client_path[100];
-	socklen_t client_addr_len = sizeof(client);
-	size_t file_block_size;
-	int extract_status = -1;
-	int handle_status = -1;
-	int attempts;
+	int v6_only = 0;
+	socklen_t client_addr_len;
+	gfcontext_t *context;
+	int i, nevents;
 
-	// configure server
-	bzero(&server, sizeof(server));
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = htonl(INADDR_ANY);
-    server.sin_port = htons(gfs->portno);
+	// configure server, accepting IPv6 and IPv4 clients on one socket
+	bzero(&server6, sizeof(server6));
+	server6.sin6_family = AF_INET6;
+	server6.sin6_addr = in6addr_any;
+	server6.sin6_port = htons(gfs->portno);
 
 	// setup socket, bind and listen
-	server_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-	setsockopt(server_socket_fd, SOL_SOCKET, SO_REUSEADDR, &set_reuse_addr, sizeof(set_reuse_addr));
-	bind(server_socket_fd, (struct sockaddr *)&server, sizeof(server));
+	server_socket_fd = socket(AF_INET6, SOCK_STREAM, 0);
+	if (server_socket_fd >= 0) {
+		setsockopt(server_socket_fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6_only, sizeof(v6_only));
+		setsockopt(server_socket_fd, SOL_SOCKET, SO_REUSEADDR, &set_reuse_addr, sizeof(set_reuse_addr));
+		bind(server_socket_fd, (struct sockaddr *)&server6, sizeof(server6));
+	}
+	else {
+		// no IPv6 support on this host
+		bzero(&server, sizeof(server));
+		server.sin_family = AF_INET;
+		server.sin_addr.s_addr = htonl(INADDR_ANY);
+		server.sin_port = htons(gfs->portno);
+
+		server_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+		setsockopt(server_socket_fd, SOL_SOCKET, SO_REUSEADDR, &set_reuse_addr, sizeof(set_reuse_addr));
+		bind(server_socket_fd, (struct sockaddr *)&server, sizeof(server));
+	}
 	listen(server_socket_fd, gfs->max_npending);
 
+	// wait on the listening socket and on idle keep-alive connections
+	gfs->epoll_fd = epoll_create1(0);
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	epoll_ctl(gfs->epoll_fd, EPOLL_CTL_ADD, server_socket_fd, &event);
+
 	// accept client requests
 	while (1) {
-		gfcontext_t *context = malloc(sizeof(gfcontext_t));
-		context->socket_fd = accept(server_socket_fd, (struct sockaddr *)&client, &client_addr_len);
-
-		// prepate client buffer
-		memset(client_buffer, '\0', sizeof(client_buffer));
-		strcpy(client_buffer, "");
-		attempts = 0;
-
-		// receive client request and extract path
-		do {
-			memset(temp_buffer, '\0', sizeof(temp_buffer));
-			file_block_size = read(context->socket_fd , temp_buffer, sizeof(temp_buffer));
-			printf("file size: %zu\n", file_block_size);
-			// if everything was not received in one chunk keep adding on and looping
-			strcat(client_buffer, temp_buffer);
-			attempts = attempts + 1;
-		} while (strstr(client_buffer, "\r\n\r\n") == NULL && file_block_size > 0 && attempts < 10);
+		nevents = epoll_wait(gfs->epoll_fd, events, MAX_EVENTS, 1000);
 
-		if (strstr(client_buffer, "\r\n\r\n") == NULL || strstr(client_buffer, "GETFILE GET") == NULL)
-			gfs_sendheader(context, GF_FILE_NOT_FOUND, 0);
+		for (i = 0; i < nevents; i++) {
+			context = events[i].data.ptr;
 
-		// if file request was received try to extract path
-		if (file_block_size > 0) {
-			memset(client_path, '\0', sizeof(client_path));
-			extract_status = sscanf(client_buffer, "GETFILE GET %s\r\n\r\n", client_path);
-		}
+			// new connection, registered disarmed until the response is done
+			if (context == NULL) {
+				context = calloc(1, sizeof(gfcontext_t));
+				context->gfs = gfs;
+				context->refs = 1;
+				client_addr_len = sizeof(client);
+				context->socket_fd = accept(server_socket_fd, (struct sockaddr *)&client, &client_addr_len);
+				if (context->socket_fd < 0) {
+					free(context);
+					continue;
+				}
+				PROBE(gfserver, accept, context, context->socket_fd);
+				event.events = EPOLLONESHOT;
+				event.data.ptr = context;
+				epoll_ctl(gfs->epoll_fd, EPOLL_CTL_ADD, context->socket_fd, &event);
+			}
 
-		// if path was extracted successfully then send to handler
-		if (extract_status > 0) {
-			handle_status = gfs->handler(context, client_path, gfs->handlerarg);
-			extract_status = -1;
+			// one reference for this call, one for the response
+			__sync_add_and_fetch(&context->refs, 1);
+			gfs_serve_request(gfs, context);
 		}
 
-		if (handle_status < 0)
-		    gfs_abort(context);
+		if (gfs->idle_timeout > 0)
+			gfs_idle_sweep(gfs);
+		if (gfs->access_fd >= 0)
+			gfs_access_flush(gfs);
 	}
 }
@@ -15,10 +15,18 @@
 "options:\n"                                                                  \
 "  -p                  Listen port (Default: 8888)\n"                         \
 "  -c                  Content file mapping keys to content files\n"          \
+"  -l                  Lease in seconds granted to client caches (Default: 60)\n"\
+"  -a                  Access log to append a binary record per request to\n"  \
 "  -h                  Show this help message\n"                              
 
 extern ssize_t handler_get(gfcontext_t *ctx, char *path, void* arg);
 
+/* Exiting through exit() removes the statistics segment */
+static void _sig_handler(int signo){
+  if (signo == SIGINT || signo == SIGTERM)
+    exit(signo);
+}
+
 
 /* Main ========================================================= */
 int main(int argc, char **argv) {
@@ -26,9 +34,11 @@ int main(int argc, char **argv) {
   unsigned short port = 8888;
   char *content = "content.txt";
   gfserver_t *gfs;
+  int lease = 60;
+  char *access_log = NULL;
 
   // Parse and set command line arguments
-  while ((option_char = getopt(argc, argv, "p:t:s:h")) != -1) {
+  while ((option_char = getopt(argc, argv, "p:t:s:c:l:a:h")) != -1) {
     switch (option_char) {
       case 'p': // listen-port
         port = atoi(optarg);
@@ -36,6 +46,12 @@ int main(int argc, char **argv) {
       case 'c': // file-path
         content = optarg;
         break;                                          
+      case 'l': // lease
+        lease = atoi(optarg);
+        break;
+      case 'a': // access log
+        access_log = optarg;
+        break;
       case 'h': // help
         fprintf(stdout, "%s", USAGE);
         exit(0);
@@ -46,6 +62,11 @@ int main(int argc, char **argv) {
     }
   }
   
+  if (signal(SIGINT, _sig_handler) == SIG_ERR || signal(SIGTERM, _sig_handler) == SIG_ERR){
+    fprintf(stderr,"Can't catch SIGINT or SIGTERM...exiting.\n");
+    exit(EXIT_FAILURE);
+  }
+
   content_init(content);
 
   /*Initializing server*/
@@ -54,6 +75,13 @@ int main(int argc, char **argv) {
   /*Setting options*/
   gfserver_set_port(gfs, port);
   gfserver_set_maxpending(gfs, 100);
+  gfserver_set_lease(gfs, lease);
+  if (access_log != NULL && 0 > gfserver_set_accesslog(gfs, access_log)){
+    perror("Unable to open access log");
+    exit(1);
+  }
+  if (0 > gfserver_set_stats(gfs, "gfserver_main"))
+    perror("Unable to publish statistics");
   gfserver_set_handler(gfs, handler_get);
   gfserver_set_handlerarg(gfs, NULL);
 
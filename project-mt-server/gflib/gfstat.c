@@ -0,0 +1,293 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  gfstat [options] [program or pid]\n"                                       \
+"options:\n"                                                                  \
+"  -i [seconds]        Seconds between reports (Default: 1)\n"                \
+"  -n [count]          Number of reports, 0 for no limit (Default: 0)\n"      \
+"  -h                  Show this help message\n"                              \
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] = {
+  {"interval",      required_argument,      NULL,           'i'},
+  {"count",         required_argument,      NULL,           'n'},
+  {"help",          no_argument,            NULL,           'h'},
+  {NULL,            0,                      NULL,             0}
+};
+
+/* Shared memory segments are listed here on Linux */
+#define SHM_DIR "/dev/shm"
+
+#define MAX_WATCHED 32
+
+/* A process being watched and its totals at the last report */
+typedef struct watched_t {
+  char name[256];
+  stats_region_t *region;
+  int seen;
+  int primed;
+  uint64_t counters[STATS_MAX_COUNTERS];
+  histogram_t latency;
+} watched_t;
+
+static watched_t gWatched[MAX_WATCHED];
+static char *gFilter = NULL;
+
+static void Usage() {
+	fprintf(stdout, "%s", USAGE);
+}
+
+/* Maps a segment, returning NULL if it isn't one or its process is gone */
+static stats_region_t* attachRegion(char *name){
+  char path[300];
+  stats_region_t *region;
+  struct stat st;
+  int fd;
+
+  snprintf(path, sizeof(path), "/%s", name);
+  if (0 > (fd = shm_open(path, O_RDONLY, 0)))
+    return NULL;
+  if (0 > fstat(fd, &st) || st.st_size < (off_t) sizeof(stats_region_t) ||
+      MAP_FAILED == (region = mmap(NULL, sizeof(stats_region_t), PROT_READ, MAP_SHARED, fd, 0))){
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+
+  if (0 != memcmp(region->magic, STATS_MAGIC, sizeof(region->magic)) ||
+      region->region_size != sizeof(stats_region_t) || region->ncounters > STATS_MAX_COUNTERS){
+    munmap(region, sizeof(stats_region_t));
+    return NULL;
+  }
+
+  /* Left behind by a process that was killed */
+  if (0 > kill(region->pid, 0) && errno == ESRCH){
+    munmap(region, sizeof(stats_region_t));
+    shm_unlink(path);
+    return NULL;
+  }
+  return region;
+}
+
+/* Names are gfstat.<program>.<pid> */
+static int matchesFilter(char *name){
+  char *pid = strrchr(name, '.');
+
+  if (pid == name + strlen(STATS_PREFIX) - 1)
+    return 0;
+  if (gFilter == NULL)
+    return 1;
+  if (0 == strcmp(pid + 1, gFilter))
+    return 1;
+  return (size_t) (pid - name) == strlen(STATS_PREFIX) + strlen(gFilter) &&
+    0 == strncmp(name + strlen(STATS_PREFIX), gFilter, strlen(gFilter));
+}
+
+static watched_t* findWatched(char *name){
+  int i;
+
+  for (i = 0; i < MAX_WATCHED; i++)
+    if (gWatched[i].region != NULL && 0 == strcmp(gWatched[i].name, name))
+      return &gWatched[i];
+  return NULL;
+}
+
+static void detach(watched_t *watched){
+  munmap(watched->region, sizeof(stats_region_t));
+  memset(watched, 0, sizeof(watched_t));
+}
+
+/* Attaches to new segments and lets go of those whose process is gone */
+static void scanRegions(){
+  struct dirent *entry;
+  watched_t *watched;
+  DIR *dir;
+  int i;
+
+  for (i = 0; i < MAX_WATCHED; i++)
+    gWatched[i].seen = 0;
+
+  if (NULL != (dir = opendir(SHM_DIR))){
+    while (NULL != (entry = readdir(dir))){
+      if (0 != strncmp(entry->d_name, STATS_PREFIX, strlen(STATS_PREFIX)) ||
+          strlen(entry->d_name) >= sizeof(gWatched[0].name) || !matchesFilter(entry->d_name))
+        continue;
+
+      if (NULL != (watched = findWatched(entry->d_name))){
+        watched->seen = 1;
+        continue;
+      }
+      for (i = 0; i < MAX_WATCHED && gWatched[i].region != NULL; i++)
+        ;
+      if (i == MAX_WATCHED)
+        break;
+      if (NULL != (gWatched[i].region = attachRegion(entry->d_name))){
+        strcpy(gWatched[i].name, entry->d_name);
+        gWatched[i].seen = 1;
+      }
+    }
+    closedir(dir);
+  }
+
+  for (i = 0; i < MAX_WATCHED; i++)
+    if (gWatched[i].region != NULL && (!gWatched[i].seen ||
+        (0 > kill(gWatched[i].region->pid, 0) && errno == ESRCH)))
+      detach(&gWatched[i]);
+}
+
+/* Adds up the slots of every thread of a process */
+static int sampleRegion(stats_region_t *region, uint64_t *counters, histogram_t *latency){
+  static stats_slot_t copy;
+  uint32_t nslots = __atomic_load_n(&region->nslots, __ATOMIC_ACQUIRE);
+  uint32_t i, j;
+
+  nslots = nslots < STATS_MAX_THREADS ? nslots : STATS_MAX_THREADS;
+  memset(counters, 0, STATS_MAX_COUNTERS * sizeof(uint64_t));
+  histogram_reset(latency);
+  for (i = 0; i < nslots; i++){
+    stats_read_slot(&region->slots[i], &copy);
+    for (j = 0; j < region->ncounters; j++)
+      counters[j] += copy.counters[j];
+    histogram_merge(latency, &copy.latency);
+  }
+  return nslots;
+}
+
+/* The values recorded between two samples of the same histogram */
+static void histogramSince(const histogram_t *current, const histogram_t *before, histogram_t *out){
+  int i;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    out->counts[i] = current->counts[i] - before->counts[i];
+  out->total = current->total - before->total;
+  out->sum = current->sum - before->sum;
+  out->min = 0;
+  out->max = current->max;
+}
+
+static void report(watched_t *watched, double seconds, char *stamp){
+  static histogram_t latency, interval;
+  uint64_t counters[STATS_MAX_COUNTERS];
+  stats_region_t *region = watched->region;
+  double rate;
+  uint32_t i;
+  int threads;
+
+  threads = sampleRegion(region, counters, &latency);
+  if (watched->primed){
+    histogramSince(&latency, &watched->latency, &interval);
+
+    fprintf(stdout, "%s %s[%d] %d thread%s", stamp, region->program, region->pid, threads, threads == 1 ? "" : "s");
+    for (i = 0; i < region->ncounters; i++){
+      rate = (counters[i] - watched->counters[i]) / seconds;
+      if (0 == strncmp(region->counters[i], "bytes", 5))
+        fprintf(stdout, "  %s %.2f MB/s", region->counters[i], rate / 1e6);
+      else
+        fprintf(stdout, "  %s %.0f/s", region->counters[i], rate);
+    }
+    if (interval.total > 0)
+      fprintf(stdout, "  latency us p50 %ld p90 %ld p99 %ld mean %.0f",
+              (long) histogram_percentile(&interval, 50), (long) histogram_percentile(&interval, 90),
+              (long) histogram_percentile(&interval, 99), histogram_mean(&interval));
+    fprintf(stdout, "\n");
+  }
+
+  memcpy(watched->counters, counters, sizeof(counters));
+  memcpy(&watched->latency, &latency, sizeof(histogram_t));
+  watched->primed = 1;
+}
+
+static double now(){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Main ========================================================= */
+int main(int argc, char **argv) {
+/* COMMAND LINE OPTIONS ============================================= */
+  double interval = 1;
+  int count = 0;
+
+  int option_char = 0;
+  int reports, i, watching;
+  double last, elapsed;
+  struct timespec pause;
+  char stamp[16];
+  time_t wall;
+
+  // Parse and set command line arguments
+  while ((option_char = getopt_long(argc, argv, "i:n:h", gLongOptions, NULL)) != -1) {
+    switch (option_char) {
+      case 'i': // interval
+        interval = atof(optarg);
+        break;
+      case 'n': // count
+        count = atoi(optarg);
+        break;
+      case 'h': // help
+        Usage();
+        exit(0);
+        break;
+      default:
+        Usage();
+        exit(1);
+    }
+  }
+
+  if (optind < argc - 1 || interval <= 0){
+    Usage();
+    exit(1);
+  }
+  if (optind == argc - 1)
+    gFilter = argv[optind];
+
+  scanRegions();
+  for (i = 0, watching = 0; i < MAX_WATCHED; i++)
+    watching += gWatched[i].region != NULL;
+  if (watching == 0){
+    fprintf(stderr, "No statistics found in %s.\n", SHM_DIR);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Totals so far only prime the first report */
+  last = now();
+  for (i = 0; i < MAX_WATCHED; i++)
+    if (gWatched[i].region != NULL)
+      report(&gWatched[i], 1, NULL);
+
+  for (reports = 0; count == 0 || reports < count; reports++){
+    pause.tv_sec = (time_t) interval;
+    pause.tv_nsec = (long) ((interval - pause.tv_sec) * 1e9);
+    nanosleep(&pause, NULL);
+
+    elapsed = now() - last;
+    last += elapsed;
+    wall = time(NULL);
+    strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&wall));
+
+    scanRegions();
+    for (i = 0; i < MAX_WATCHED; i++)
+      if (gWatched[i].region != NULL)
+        report(&gWatched[i], elapsed, stamp);
+    fflush(stdout);
+  }
+
+  return 0;
+}
@@ -7,6 +7,7 @@
 
 #include "gfserver.h"
 #include "content.h"
+#include "log.h"
 
 #define BUFFER_SIZE 4096
 
@@ -15,10 +16,18 @@ ssize_t handler_get(gfcontext_t *ctx, char *path, void* arg){
 	ssize_t file_len, bytes_transferred;
 	ssize_t read_len, write_len;
 	char buffer[BUFFER_SIZE];
+	const char *tag, *encoding;
 
-	if( 0 > (fildes = content_get(path)))
+	if( 0 > (fildes = content_get_encoded(path, gfs_get_accept_encoding(ctx), &encoding)))
 		return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
 
+	/* Client already holds this exact content, skip the body. */
+	tag = content_get_tag(path);
+	if (tag != NULL && gfs_get_tag(ctx) != NULL && 0 == strcmp(tag, gfs_get_tag(ctx)))
+		return gfs_sendheader(ctx, GF_NOT_MODIFIED, 0);
+	gfs_set_tag(ctx, tag);
+	gfs_set_encoding(ctx, encoding);
+
 	/* Calculating the file size */
 	file_len = lseek(fildes, 0, SEEK_END);
 
@@ -29,13 +38,13 @@ ssize_t handler_get(gfcontext_t *ctx, char *path, void* arg){
 	while(bytes_transferred < file_len){
 		read_len = pread(fildes, buffer, BUFFER_SIZE, bytes_transferred);
 		if (read_len <= 0){
-			fprintf(stderr, "handle_with_file read error, %zd, %zu, %zu", read_len, bytes_transferred, file_len );
+			L(GFLOG_ERROR, "handle_with_file read error, %zd, %zu, %zu", read_len, bytes_transferred, file_len );
 			gfs_abort(ctx);
 			return -1;
 		}
 		write_len = gfs_send(ctx, buffer, read_len);
 		if (write_len != read_len){
-			fprintf(stderr, "handle_with_file write error");
+			L(GFLOG_ERROR, "handle_with_file write error");
 			gfs_abort(ctx);
 			return -1;
 		}
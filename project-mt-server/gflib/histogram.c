@@ -0,0 +1,117 @@
+#include <string.h>
+
+#include "histogram.h"
+
+#define SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HALF_COUNT (1 << (HISTOGRAM_SUB_BITS - 1))
+
+/*
+ * Returns the bucket of a value.  Values below SUB_COUNT have their own
+ * bucket, larger ones are shifted down until HISTOGRAM_SUB_BITS
+ * significant bits remain.
+ */
+static int histogram_index(int64_t value) {
+    int shift, index;
+
+    if (value < SUB_COUNT)
+        return (int) value;
+
+    shift = 63 - __builtin_clzll((unsigned long long) value) - (HISTOGRAM_SUB_BITS - 1);
+    index = SUB_COUNT + (shift - 1) * HALF_COUNT + (int) (value >> shift) - HALF_COUNT;
+    return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+/*
+ * Returns the largest value counted in a bucket.
+ */
+static int64_t histogram_value(int index) {
+    int shift;
+
+    if (index < SUB_COUNT)
+        return index;
+
+    shift = (index - SUB_COUNT) / HALF_COUNT + 1;
+    return ((int64_t) ((index - SUB_COUNT) % HALF_COUNT + HALF_COUNT) << shift) + ((int64_t) 1 << shift) - 1;
+}
+
+/**
+ * Clears all recorded values.
+ * @param h - histogram
+ */
+void histogram_reset(histogram_t *h) {
+    memset(h, 0, sizeof(histogram_t));
+}
+
+/**
+ * Records one value.
+ * @param h - histogram
+ * @param value - value to record, negative values count as zero
+ */
+void histogram_record(histogram_t *h, int64_t value) {
+    if (value < 0)
+        value = 0;
+
+    h->counts[histogram_index(value)]++;
+    if (h->total == 0 || value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->total++;
+    h->sum += value;
+}
+
+/**
+ * Adds all values recorded in one histogram to another.
+ * @param into - histogram receiving the values
+ * @param from - histogram whose values are added
+ */
+void histogram_merge(histogram_t *into, const histogram_t *from) {
+    int i;
+
+    if (from->total == 0)
+        return;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    if (into->total == 0 || from->min < into->min)
+        into->min = from->min;
+    if (from->max > into->max)
+        into->max = from->max;
+    into->total += from->total;
+    into->sum += from->sum;
+}
+
+/**
+ * Returns the value below which a percentage of the recorded values fall.
+ * @param h - histogram
+ * @param percentile - percentage from 0 to 100
+ * @return value at the percentile, never more than the largest recorded
+ */
+int64_t histogram_percentile(const histogram_t *h, double percentile) {
+    uint64_t rank, seen = 0;
+    int64_t value;
+    int i;
+
+    if (h->total == 0)
+        return 0;
+
+    rank = (uint64_t) (percentile / 100.0 * h->total + 0.5);
+    rank = rank < 1 ? 1 : rank > h->total ? h->total : rank;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank)
+            break;
+    }
+
+    value = histogram_value(i < HISTOGRAM_BUCKETS ? i : HISTOGRAM_BUCKETS - 1);
+    return value < h->max ? value : h->max;
+}
+
+/**
+ * Returns the mean of the recorded values.
+ * @param h - histogram
+ * @return mean, or 0 if nothing was recorded
+ */
+double histogram_mean(const histogram_t *h) {
+    return h->total > 0 ? h->sum / h->total : 0;
+}
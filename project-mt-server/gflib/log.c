@@ -0,0 +1,197 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/* Size of one record, and how many each thread's ring holds */
+#define LOG_RECORD_SIZE 256
+#define LOG_RING_SLOTS 1024
+
+/* How long the writer sleeps when the rings are empty */
+#define LOG_IDLE_NS 10000000L
+
+/* Records are gathered into writes of up to this size */
+#define LOG_WRITE_SIZE 65536
+
+typedef struct log_record_t {
+    unsigned short len;
+    char text[LOG_RECORD_SIZE - sizeof(unsigned short)];
+} log_record_t;
+
+/*
+ * A ring with a single producer, its thread, and a single consumer, the
+ * writer.  head is only stored by the producer and tail only by the
+ * writer, each on its own cache line.
+ */
+typedef struct log_ring_t {
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long dropped;
+    unsigned long tail __attribute__((aligned(64)));
+    int dead;
+    struct log_ring_t *next;
+    log_record_t records[LOG_RING_SLOTS];
+} log_ring_t;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t *rings = NULL;
+static int started = 0;
+static int initialized = 0;
+static pthread_key_t ring_key;
+static __thread log_ring_t *self = NULL;
+
+static void log_output(char *out, size_t len) {
+    ssize_t written;
+
+    while (len > 0) {
+        if (0 > (written = write(MYLOG_FILE, out, len))) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        out += written;
+        len -= written;
+    }
+}
+
+/*
+ * Writes out everything queued so far.  The lock keeps the writer and
+ * log_flush from draining at the same time and the ring list steady.
+ */
+static void log_drain() {
+    static char out[LOG_WRITE_SIZE];
+    log_ring_t **link, *ring;
+    unsigned long head, tail, dropped;
+    log_record_t *record;
+    size_t used = 0;
+
+    pthread_mutex_lock(&log_lock);
+    for (link = &rings; NULL != (ring = *link); ) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (tail = ring->tail; tail != head; tail++) {
+            record = &ring->records[tail % LOG_RING_SLOTS];
+            if (used + record->len + 1 > LOG_WRITE_SIZE) {
+                log_output(out, used);
+                used = 0;
+            }
+            memcpy(out + used, record->text, record->len);
+            used += record->len;
+            out[used++] = '\n';
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        if (0 < (dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED))) {
+            if (used + LOG_RECORD_SIZE > LOG_WRITE_SIZE) {
+                log_output(out, used);
+                used = 0;
+            }
+            used += snprintf(out + used, LOG_RECORD_SIZE, "[Log] Dropped %lu messages\n", dropped);
+        }
+
+        /* A finished thread's ring goes once it is empty */
+        if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) && tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            *link = ring->next;
+            free(ring);
+        }
+        else
+            link = &ring->next;
+    }
+
+    log_output(out, used);
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void* log_writer(void *arg) {
+    struct timespec idle = {0, LOG_IDLE_NS};
+
+    for (;;) {
+        log_drain();
+        nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+static void log_release(void *arg) {
+    __atomic_store_n(&((log_ring_t*) arg)->dead, 1, __ATOMIC_RELEASE);
+}
+
+/* A forked child has no writer and must not print its parent's records */
+static void log_child() {
+    pthread_mutex_init(&log_lock, NULL);
+    rings = NULL;
+    started = 0;
+    self = NULL;
+}
+
+/* Starts the writer, under log_lock, the first time anything is logged */
+static void log_start() {
+    pthread_t writer;
+
+    if (!initialized) {
+        pthread_key_create(&ring_key, log_release);
+        pthread_atfork(NULL, NULL, log_child);
+        atexit(log_flush);
+        initialized = 1;
+    }
+
+    if (0 == pthread_create(&writer, NULL, log_writer, NULL)) {
+        pthread_detach(writer);
+        started = 1;
+    }
+}
+
+/* Returns the calling thread's ring, making it on first use */
+static log_ring_t* log_ring() {
+    log_ring_t *ring;
+
+    if (self != NULL)
+        return self;
+
+    if (NULL == (ring = calloc(1, sizeof(log_ring_t))))
+        return NULL;
+
+    pthread_mutex_lock(&log_lock);
+    if (!started)
+        log_start();
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&log_lock);
+
+    pthread_setspecific(ring_key, ring);
+    self = ring;
+    return ring;
+}
+
+void log_write(int priority, const char *format, ...) {
+    log_ring_t *ring;
+    log_record_t *record;
+    unsigned long head;
+    va_list args;
+    int len;
+
+    if (NULL == (ring = log_ring()))
+        return;
+
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    record = &ring->records[head % LOG_RING_SLOTS];
+    va_start(args, format);
+    len = vsnprintf(record->text, sizeof(record->text), format, args);
+    va_end(args);
+    record->len = len < 0 ? 0 : len < sizeof(record->text) ? len : sizeof(record->text) - 1;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void log_flush() {
+    log_drain();
+}
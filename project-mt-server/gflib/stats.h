@@ -0,0 +1,71 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+/*
+ * Live statistics in shared memory.  A process calls stats_init once to
+ * create the segment /gfstat.<program>.<pid>, and every thread then
+ * counts into a slot of its own: counters are bumped with relaxed atomic
+ * stores and the latency histogram is written under a per-slot seqlock,
+ * so recording takes no lock and no system call.  gfstat maps the
+ * segments read-only and adds the slots up; the server never knows it
+ * is being watched.  The segment is removed when the process exits
+ * normally; gfstat removes those left behind by processes that died.
+ */
+
+#include <stdint.h>
+
+#include "histogram.h"
+
+#define STATS_MAGIC "GFSTAT01"
+#define STATS_PREFIX "gfstat."
+#define STATS_NAME_LEN 32
+#define STATS_MAX_COUNTERS 8
+
+/*
+ * Threads past the first STATS_MAX_THREADS - 1 share the last slot,
+ * adding to its counters atomically and recording no latencies.
+ */
+#define STATS_MAX_THREADS 64
+
+typedef struct stats_slot_t {
+    uint64_t seq;
+    uint64_t counters[STATS_MAX_COUNTERS];
+    histogram_t latency;
+} __attribute__((aligned(64))) stats_slot_t;
+
+typedef struct stats_region_t {
+    char magic[8];
+    uint32_t region_size;
+    uint32_t ncounters;
+    int32_t pid;
+    uint32_t nslots;
+    uint64_t started;
+    char program[STATS_NAME_LEN];
+    char counters[STATS_MAX_COUNTERS][STATS_NAME_LEN];
+    stats_slot_t slots[STATS_MAX_THREADS];
+} stats_region_t;
+
+/*
+ * Creates this process's segment with the named counters, which are then
+ * referred to by their index.  Latencies are in microseconds.  Returns -1
+ * if the segment can't be created, after which recording does nothing.
+ */
+int stats_init(const char *program, const char **counters, int ncounters);
+
+/*
+ * Adds n to a counter of the calling thread.
+ */
+void stats_add(int counter, uint64_t n);
+
+/*
+ * Records one latency, in microseconds, for the calling thread.
+ */
+void stats_latency(int64_t usec);
+
+/*
+ * Copies a slot of a mapped segment, retrying while its owner is
+ * writing, so the histogram in copy is consistent.
+ */
+void stats_read_slot(const stats_slot_t *slot, stats_slot_t *copy);
+
+#endif
@@ -3,10 +3,17 @@
 
 #define WORKLOAD_SEQ 0
 #define WORKLOAD_RND 1
+#define WORKLOAD_ZIPF 2
+#define WORKLOAD_TRACE 3
 
 /* 
  * Opens the file associated with the input argument
- * and reads in a list of paths to request. 
+ * and reads in a list of paths to request.  Each line holds
+ * a path, optionally preceded by the time in seconds from the
+ * start of the trace at which it was requested, e.g.
+ * "0.125 /courses/ud923/filecorpus/road.jpg".  The file is
+ * mapped rather than copied and indexed with four bytes per
+ * path, so it may hold tens of millions of paths, up to 4 GiB.
  */
 int workload_init(char *workload_path);
 
@@ -14,13 +21,36 @@ int workload_init(char *workload_path);
  * Sets the mode.  If WORKLOAD_SEQ, then workload getpath will
  * return the paths in sequence.  If WORKLOAD_RND, then
  * the paths will be chosen uniformly at random with replacement.
+ * If WORKLOAD_ZIPF, the path on line k is chosen with probability
+ * proportional to 1/k^s (see workload_set_zipf).  If WORKLOAD_TRACE,
+ * the lines are replayed in order, shared by all threads.
  */
 int workload_set_mode(int mode);
 
+/*
+ * Sets the exponent s of the Zipf distribution (Default: 1.0).  Must
+ * be positive; larger values skew requests further towards the first
+ * lines of the workload file.
+ */
+int workload_set_zipf(double s);
+
+/*
+ * Sets the mode from a name: "seq", "random", "zipf", "zipf:<s>" or
+ * "trace".  Returns -1 for an unknown name.
+ */
+int workload_set_distribution(char *spec);
+
+/*
+ * Seeds the random choices.  Every thread draws from its own generator,
+ * derived from this seed and the order in which threads first ask for
+ * a path.
+ */
+void workload_set_seed(unsigned int seed);
+
 /*
  * Returns the number of unique paths in the workload
  */
-unsigned short int workload_num_unique_paths();
+unsigned int workload_num_unique_paths();
 
 /*
  * Returns a path from the workload.  Whether this is
@@ -29,4 +59,12 @@ unsigned short int workload_num_unique_paths();
  */
 char* workload_get_path();
 
-#endif
\ No newline at end of file
+/*
+ * Returns the next line of the trace and stores in at the time, in
+ * seconds from the start of the trace, at which it should be requested.
+ * Lines without a time are spaced 1 ms after the previous one.  Returns
+ * NULL once every line has been handed out.
+ */
+char* workload_next_trace(double *at);
+
+#endif
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "xxhash.h"
+
+#define PRIME64_1 11400714785074694791ULL
+#define PRIME64_2 14029467366897019727ULL
+#define PRIME64_3 1609587929392839161ULL
+#define PRIME64_4 9650029242287828579ULL
+#define PRIME64_5 2870177450012600261ULL
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+// unaligned little endian reads
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = ROTL64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/*
+ * Consumes as many whole 32 byte stripes as possible into the four lane
+ * accumulators and returns a pointer to the first unconsumed byte.
+ */
+static const unsigned char *xxh64_stripes(uint64_t *v, const unsigned char *p,
+                                          const unsigned char *end) {
+    while (p + 32 <= end) {
+        v[0] = xxh64_round(v[0], read64(p));
+        v[1] = xxh64_round(v[1], read64(p + 8));
+        v[2] = xxh64_round(v[2], read64(p + 16));
+        v[3] = xxh64_round(v[3], read64(p + 24));
+        p += 32;
+    }
+    return p;
+}
+
+/*
+ * Mixes in the trailing (< 32) bytes and applies the final avalanche.
+ */
+static uint64_t xxh64_finalize(uint64_t h, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        h ^= xxh64_round(0, read64(p));
+        h = ROTL64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        h ^= (uint64_t) read32(p) * PRIME64_1;
+        h = ROTL64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        h ^= (*p) * PRIME64_5;
+        h = ROTL64(h, 11) * PRIME64_1;
+        p++;
+        len--;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t xxh64_converge(const uint64_t *v) {
+    uint64_t h = ROTL64(v[0], 1) + ROTL64(v[1], 7) + ROTL64(v[2], 12) + ROTL64(v[3], 18);
+    h = xxh64_merge(h, v[0]);
+    h = xxh64_merge(h, v[1]);
+    h = xxh64_merge(h, v[2]);
+    return xxh64_merge(h, v[3]);
+}
+
+/**
+ * Returns the hash of len bytes starting at data.
+ * @param data - bytes to hash
+ * @param len - number of bytes
+ * @param seed - hash seed
+ * @return 64-bit hash
+ */
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v[4] = {seed + PRIME64_1 + PRIME64_2, seed + PRIME64_2, seed, seed - PRIME64_1};
+        p = xxh64_stripes(v, p, end);
+        h = xxh64_converge(v);
+    }
+    else
+        h = seed + PRIME64_5;
+
+    h += (uint64_t) len;
+    return xxh64_finalize(h, p, (size_t) (end - p));
+}
+
+/**
+ * Resets the state so a new hash can be computed with xxh64_update.
+ * @param state - streaming state
+ * @param seed - hash seed
+ */
+void xxh64_reset(xxh64_state_t *state, uint64_t seed) {
+    memset(state, 0, sizeof(xxh64_state_t));
+    state->seed = seed;
+    state->v[0] = seed + PRIME64_1 + PRIME64_2;
+    state->v[1] = seed + PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - PRIME64_1;
+}
+
+/**
+ * Adds len bytes starting at data to the running hash.
+ * @param state - streaming state
+ * @param data - bytes to hash
+ * @param len - number of bytes
+ */
+void xxh64_update(xxh64_state_t *state, const void *data, size_t len) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+
+    state->total_len += len;
+
+    // not enough for a stripe yet, just buffer it
+    if (state->memsize + len < 32) {
+        memcpy(state->mem + state->memsize, p, len);
+        state->memsize += len;
+        return;
+    }
+
+    // complete the buffered stripe first
+    if (state->memsize > 0) {
+        size_t fill = 32 - state->memsize;
+        memcpy(state->mem + state->memsize, p, fill);
+        xxh64_stripes(state->v, state->mem, state->mem + 32);
+        p += fill;
+        state->memsize = 0;
+    }
+
+    p = xxh64_stripes(state->v, p, end);
+
+    // keep the remainder for the next update
+    state->memsize = (size_t) (end - p);
+    memcpy(state->mem, p, state->memsize);
+}
+
+/**
+ * Returns the hash of all data passed to xxh64_update so far.
+ * @param state - streaming state
+ * @return 64-bit hash
+ */
+uint64_t xxh64_digest(const xxh64_state_t *state) {
+    uint64_t h;
+
+    if (state->total_len >= 32)
+        h = xxh64_converge(state->v);
+    else
+        h = state->seed + PRIME64_5;
+
+    h += state->total_len;
+    return xxh64_finalize(h, state->mem, state->memsize);
+}
+
+/**
+ * Writes the hash as lowercase hex into hex.
+ * @param hash - value to print
+ * @param hex - buffer of at least XXH64_HEX_LEN + 1 bytes
+ */
+void xxh64_tohex(uint64_t hash, char *hex) {
+    snprintf(hex, XXH64_HEX_LEN + 1, "%016llx", (unsigned long long) hash);
+}
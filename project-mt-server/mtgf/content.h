@@ -1,6 +1,9 @@
 #ifndef __CONTENT_H__
 #define __CONTENT_H__
 
+/* Length of the hex string returned by content_get_tag */
+#define CONTENT_TAG_LEN 16
+
 /* 
  * Initializes the content library given the information from
  * the provided file.  Each row of the file is assumed
@@ -19,6 +22,25 @@ int content_init(char *filename);
  */
 int content_get(char *key);
 
+/*
+ * Like content_get, but may return a precompressed variant of the file
+ * instead.  accept is a comma separated list of encodings the client can
+ * decode (e.g. "zstd,gzip"), or NULL.  Variants are produced offline as
+ * <path>.zst and <path>.gz next to each file (see "make precompress") and
+ * are picked up by content_init.  On return *encoding names the encoding
+ * of the returned descriptor, or is NULL for the original file.
+ * Returns -1 if the key is not found.
+ */
+int content_get_encoded(char *key, char *accept, const char **encoding);
+
+/*
+ * Returns the validator tag of the content associated with the input
+ * key, or NULL if the key is not found.  Tags are computed from the
+ * file contents once at content_init time, so two files with the same
+ * bytes have the same tag.
+ */
+const char* content_get_tag(char *key);
+
 /* 
  * Frees all memory and closes all file descriptors
  * associated with the cache.
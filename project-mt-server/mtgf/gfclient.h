@@ -12,12 +12,16 @@ typedef enum{
   GF_OK,
   GF_FILE_NOT_FOUND,
   GF_ERROR,
-  GF_INVALID
+  GF_INVALID,
+  GF_NOT_MODIFIED
 } gfstatus_t;
 
 /*struct for a getfile request*/
 typedef struct gfcrequest_t gfcrequest_t;
 
+/*struct for driving many requests from one thread*/
+typedef struct gfcmulti_t gfcmulti_t;
+
 /*
  * Returns the string associated with the input status
  */
@@ -46,6 +50,42 @@ void gfc_set_path(gfcrequest_t *gfr, char* path);
  */
 void gfc_set_port(gfcrequest_t *gfr, unsigned short port);
 
+/*
+ * Sets the validator tag of a copy of the file the caller already holds.
+ * The tag is sent with the request, and if the server's content still has
+ * the same tag it responds with GF_NOT_MODIFIED and no body instead of
+ * sending the file again.
+ */
+void gfc_set_tag(gfcrequest_t *gfr, char* tag);
+
+/*
+ * Sets the content encodings the caller is able to decode as a comma
+ * separated list, e.g. "zstd,gzip".  If the server holds a precompressed
+ * variant in one of them it may send that instead; gfc_get_encoding
+ * then names the encoding, and gfc_get_filelen and the write callback
+ * refer to the encoded bytes.
+ */
+void gfc_set_accept_encoding(gfcrequest_t *gfr, char* encodings);
+
+/*
+ * Sets deadlines in milliseconds for connecting to the server and for
+ * each wait on data from it.  When either expires gfc_perform gives up,
+ * sets the status to GF_ERROR and returns a negative value.  Zero, the
+ * default, means no limit.  Requests driven by gfc_multi_* keep the
+ * same deadlines, checked by gfc_multi_perform, and one that expires
+ * finishes with result -1.
+ */
+void gfc_set_timeouts(gfcrequest_t *gfr, int connect_timeout, int read_timeout);
+
+/*
+ * Sets a replica holding the same content.  If the server has not started
+ * responding by the hedge delay (see gfc_global_set_hedge), gfc_perform
+ * sends the same request to the replica, keeps whichever connection
+ * answers first and closes the other.  Only gfc_perform hedges, requests
+ * driven by gfc_multi_perform ignore the replica.  Pass NULL to disable.
+ */
+void gfc_set_hedge(gfcrequest_t *gfr, char* server, unsigned short port);
+
 /*
  * Sets the callback for received header.  The registered callback
  * will receive a pointer the header of the response, the length 
@@ -94,6 +134,54 @@ void gfc_set_writearg(gfcrequest_t *gfr, void *writearg);
  */
 int gfc_perform(gfcrequest_t *gfr);
 
+/*
+ * The gfc_multi_* functions are inspired by libcurl's "multi" interface.
+ * Requests are set up with the same gfc_set_* calls as for gfc_perform,
+ * added to a multi handle, and then all driven from a single thread by
+ * calling gfc_multi_perform repeatedly.  They are not hedged, a replica
+ * set with gfc_set_hedge is not used.  The header and write callbacks
+ * of each request are called from within gfc_multi_perform as data
+ * arrives, and the header callback always receives the full header.
+ *
+ *   gfcmulti_t *gfm = gfc_multi_create();
+ *   gfc_multi_add(gfm, gfr);  ... add as many as wanted
+ *   while (gfc_multi_perform(gfm, 1000) > 0)
+ *     while ((done = gfc_multi_info_read(gfm, &result)) != NULL)
+ *       ... inspect and gfc_cleanup(done), maybe add more requests
+ */
+
+/*
+ * Creates a multi handle.  Returns NULL on failure.
+ */
+gfcmulti_t *gfc_multi_create();
+
+/*
+ * Adds a request to the multi handle and starts connecting.  The request
+ * must not be passed to gfc_perform or gfc_cleanup until it has been
+ * returned by gfc_multi_info_read.  Returns 0 on success; on failure -1
+ * is returned and the request is queued as finished with result -1.
+ */
+int gfc_multi_add(gfcmulti_t *gfm, gfcrequest_t *gfr);
+
+/*
+ * Waits at most timeout_ms milliseconds (-1 for no limit) for network
+ * activity and advances every ready transfer.  Returns the number of
+ * transfers still running, or -1 on error.
+ */
+int gfc_multi_perform(gfcmulti_t *gfm, int timeout_ms);
+
+/*
+ * Returns a request that has finished, or NULL if there is none.  The
+ * value gfc_perform would have returned for it is stored in result.
+ */
+gfcrequest_t *gfc_multi_info_read(gfcmulti_t *gfm, int *result);
+
+/*
+ * Aborts all running transfers and frees the multi handle.  Requests
+ * that were added still belong to the caller.
+ */
+void gfc_multi_cleanup(gfcmulti_t *gfm);
+
 /*
  * Returns the status of the response.
  */
@@ -105,6 +193,19 @@ gfstatus_t gfc_get_status(gfcrequest_t *gfr);
  */
 size_t gfc_get_filelen(gfcrequest_t *gfr);
 
+/*
+ * Returns the validator tag the server sent with a GF_OK response, or NULL
+ * if it did not send one.  Pass it to gfc_set_tag on a later request for
+ * the same path to avoid downloading unchanged content.
+ */
+char* gfc_get_tag(gfcrequest_t *gfr);
+
+/*
+ * Returns the content encoding of the received body, or NULL if the
+ * server sent the file as is.
+ */
+char* gfc_get_encoding(gfcrequest_t *gfr);
+
 /*
  * Returns actual number of bytes received before the connection is closed.
  * This may be distinct from the result of gfc_get_filelen when the response 
@@ -112,6 +213,23 @@ size_t gfc_get_filelen(gfcrequest_t *gfr);
  */
 size_t gfc_get_bytesreceived(gfcrequest_t *gfr);
 
+/*
+ * Return, in microseconds since gfc_perform or gfc_multi_add started the
+ * request, when the connection was established and when the response
+ * header had been received.  The connect time is zero if an open
+ * connection was reused, and the header time is zero if the response was
+ * served from the client cache or never arrived.
+ */
+long gfc_get_connect_time(gfcrequest_t *gfr);
+long gfc_get_header_time(gfcrequest_t *gfr);
+
+/*
+ * Returns the pointer registered with gfc_set_writearg, or NULL if none
+ * was set.  Useful for finding the caller's state for a request returned
+ * by gfc_multi_info_read.
+ */
+void *gfc_get_writearg(gfcrequest_t *gfr);
+
 /*
  * Frees memory associated with the request.  
  */
@@ -121,9 +239,49 @@ void gfc_cleanup(gfcrequest_t *gfr);
 /*
  * Sets up any global data structures needed for the library.
  * Warning: this function may not be thread-safe.
+ *
+ * After this call, connections are kept open when the server agrees to
+ * keep-alive and are reused by later requests to the same server and
+ * port, from any thread.  Calling it again is harmless.
  */
 void gfc_global_init();
 
+/*
+ * Sets the limits of the connection pool: at most max_idle idle
+ * connections are kept (Default: 64), each for at most idle_timeout
+ * seconds (Default: 15) or until the server's own idle timeout, whichever
+ * comes first.  A max_idle of zero disables connection reuse.  Call
+ * before gfc_global_init.
+ */
+void gfc_global_set_pool(int max_idle, int idle_timeout);
+
+/*
+ * Sets how many seconds a resolved server address is cached (Default:
+ * 60).  Server names are resolved with getaddrinfo, so both IPv4 and
+ * IPv6 addresses are supported, and the result is shared by all threads.
+ */
+void gfc_global_set_resolver_ttl(int ttl);
+
+/*
+ * Sets how long a request with a replica waits for the first byte before
+ * it is hedged: the given percentile of recent first byte latencies
+ * (Default: 95), but at least min_delay milliseconds (Default: 20), which
+ * is also used until enough latencies have been measured.
+ */
+void gfc_global_set_hedge(int percentile, int min_delay);
+
+/*
+ * Turns on the client cache.  Tagged responses are kept in memory, up to
+ * mem_limit bytes of bodies, and, unless dir is NULL, as files in dir,
+ * which outlive the process.  While the lease the server granted with a
+ * response (see gfserver_set_lease) holds, gfc_perform serves the copy
+ * without contacting the server; once it has ended the copy is
+ * revalidated with its tag and served again if it is still current.
+ * Requests with their own tag set, and requests driven by gfc_multi_*,
+ * bypass the cache.  Returns -1 if dir cannot be created.
+ */
+int gfc_global_set_cache(char *dir, size_t mem_limit);
+
 
 /*
  * Cleans up any global data structures needed for the library.
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +11,7 @@
 
 #include "workload.h"
 #include "gfclient.h"
+#include "xxhash.h"
 
 #define USAGE                                                                 \
 "usage:\n"                                                                    \
@@ -20,6 +22,12 @@
 "  -w [workload_path]  Path to workload file (Default: workload.txt)\n"       \
 "  -t [nthreads]       Number of threads (Default 1)\n"                       \
 "  -n [num_requests]   Requests download per thread (Default: 1)\n"           \
+"  -e [encodings]      Accepted content encodings, e.g. zstd,gzip (Default: none)\n"\
+"  -d [deadline_ms]    Connect and read deadline per request (Default: none)\n"\
+"  -r [replica]        Replica host[:port] to hedge slow requests to (Default: none)\n"\
+"  -c [cache_dir]      Cache responses in memory and in cache_dir (Default: off)\n"\
+"  -D [distribution]   Paths requested, seq, random, zipf[:s] or trace (Default: seq)\n"\
+"  -o [sink]           Bodies go to a file, discard or verify:<manifest> (Default: file)\n"\
 "  -h                  Show this help message\n"                              \
 
 /* OPTIONS DESCRIPTOR ====================================================== */
@@ -29,16 +37,64 @@ static struct option gLongOptions[] = {
   {"workload-path", required_argument,      NULL,           'w'},
   {"nthreads",      required_argument,      NULL,           't'},
   {"nrequests",     required_argument,      NULL,           'n'},
+  {"encodings",     required_argument,      NULL,           'e'},
+  {"deadline",      required_argument,      NULL,           'd'},
+  {"replica",       required_argument,      NULL,           'r'},
+  {"cache",         required_argument,      NULL,           'c'},
+  {"distribution",  required_argument,      NULL,           'D'},
+  {"output",        required_argument,      NULL,           'o'},
   {"help",          no_argument,            NULL,           'h'},
   {NULL,            0,                      NULL,             0}
 };
 
+/* Bytes of response bodies the client cache keeps in memory */
+#define CACHE_MEM (64 << 20)
+
+/* Received data is staged and written out in chunks of this size */
+#define WRITE_CHUNK (1 << 20)
+
+/*
+ * Output file written with large positional writes.  When bodies are
+ * discarded or verified there is no file and fd is -1.
+ */
+typedef struct outfile_t {
+  int fd;
+  off_t offset;
+  char *buffer;
+  size_t buffered;
+  size_t buffer_size;
+  char *path;
+  xxh64_state_t hash;
+  gfcrequest_t *gfr;
+} outfile_t;
+
+/* Where response bodies go */
+#define SINK_FILE 0
+#define SINK_DISCARD 1
+#define SINK_VERIFY 2
+
+/* Expected hash of a path's body, read from the verify manifest */
+typedef struct manifest_entry_t {
+  char *path;
+  uint64_t hash;
+} manifest_entry_t;
+
+static int gSink = SINK_FILE;
+static manifest_entry_t *gManifest = NULL;
+static size_t gManifestLen = 0;
+static unsigned long gVerified = 0;
+static unsigned long gMismatched = 0;
+
 // request params to be passed to pthread when created
 typedef struct request_params {
     char *server;
     unsigned short portno;
     int num_requests;
     char *path;
+    char *encodings;
+    int deadline;
+    char *replica;
+    unsigned short replica_port;
 } request_params;
 
 void *connection_handler(request_params *req);
@@ -50,12 +106,22 @@ static void Usage() {
 static void localPath(char *req_path, char *local_path){
   static int counter = 0;
 
-  sprintf(local_path, "%s-%06d", &req_path[1], counter++);
+  /* The pid keeps runs sharing a directory from overwriting each other */
+  sprintf(local_path, "%s-%d-%06d", &req_path[1], (int) getpid(), __sync_fetch_and_add(&counter, 1));
 }
 
-static FILE* openFile(char *path){
+static void openFile(char *path, outfile_t *out){
   char *cur, *prev;
-  FILE *ans;
+
+  out->fd = -1;
+  out->offset = 0;
+  out->buffer = NULL;
+  out->buffered = 0;
+  out->buffer_size = 0;
+  if (gSink == SINK_VERIFY)
+    xxh64_reset(&out->hash, 0);
+  if (gSink != SINK_FILE)
+    return;
 
   /* Make the directory if it isn't there */
   prev = path;
@@ -73,19 +139,156 @@ static FILE* openFile(char *path){
     prev = cur;
   }
 
-  if( NULL == (ans = fopen(&path[0], "w"))){
+  if( 0 > (out->fd = open(&path[0], O_WRONLY | O_CREAT | O_TRUNC, 0644))){
     perror("Unable to open file");
     exit(EXIT_FAILURE);
   }
+}
+
+/* Writes len bytes at the current offset of the file */
+static void writeFile(outfile_t *out, char *data, size_t len){
+  ssize_t written;
+
+  while(len > 0){
+    if( 0 > (written = pwrite(out->fd, data, len, out->offset))){
+      if (errno == EINTR)
+        continue;
+      perror("Unable to write file");
+      exit(EXIT_FAILURE);
+    }
+    data += written;
+    len -= written;
+    out->offset += written;
+  }
+}
+
+/* Writes out any staged data, trims the preallocated length and closes */
+static void closeFile(outfile_t *out){
+  if (out->fd < 0)
+    return;
 
-  return ans;
+  writeFile(out, out->buffer, out->buffered);
+  out->buffered = 0;
+
+  if (0 > ftruncate(out->fd, out->offset))
+    perror("Unable to truncate file");
+  close(out->fd);
+  free(out->buffer);
+  out->buffer = NULL;
+}
+
+/* Renames a downloaded file so its name reflects the encoding received */
+static void encodedPath(char *local_path, char *encoding){
+  char encoded_path[600];
+
+  if (0 == strcmp(encoding, "gzip"))
+    snprintf(encoded_path, sizeof(encoded_path), "%s.gz", local_path);
+  else if (0 == strcmp(encoding, "zstd"))
+    snprintf(encoded_path, sizeof(encoded_path), "%s.zst", local_path);
+  else
+    snprintf(encoded_path, sizeof(encoded_path), "%s.%s", local_path, encoding);
+
+  if (0 > rename(local_path, encoded_path))
+    fprintf(stderr, "rename failed on %s\n", local_path);
+}
+
+static int compareEntries(const void *a, const void *b){
+  return strcmp(((manifest_entry_t*) a)->path, ((manifest_entry_t*) b)->path);
+}
+
+/* Reads "<path> <xxh64 hex>" lines, the tags the server sends for identity bodies */
+static void loadManifest(char *manifest_path){
+  char line[4096], path[4096], hex[32];
+  size_t capacity = 0;
+  FILE *file;
+
+  if( NULL == (file = fopen(manifest_path, "r"))){
+    perror("Unable to open manifest");
+    exit(EXIT_FAILURE);
+  }
+
+  while(NULL != fgets(line, sizeof(line), file)){
+    if (2 != sscanf(line, "%4095s %31s", path, hex))
+      continue;
+    if (gManifestLen == capacity){
+      capacity = capacity ? capacity * 2 : 1024;
+      gManifest = realloc(gManifest, capacity * sizeof(manifest_entry_t));
+    }
+    gManifest[gManifestLen].path = strdup(path);
+    gManifest[gManifestLen++].hash = strtoull(hex, NULL, 16);
+  }
+  fclose(file);
+
+  qsort(gManifest, gManifestLen, sizeof(manifest_entry_t), compareEntries);
+}
+
+/* Checks the hash of a complete body against the manifest */
+static void verifyBody(outfile_t *out){
+  manifest_entry_t key, *entry;
+
+  if (gfc_get_encoding(out->gfr) != NULL){
+    fprintf(stdout, "Verify: skipped %s, body is %s encoded\n", out->path, gfc_get_encoding(out->gfr));
+    return;
+  }
+
+  key.path = out->path;
+  if (NULL == (entry = bsearch(&key, gManifest, gManifestLen, sizeof(manifest_entry_t), compareEntries)))
+    fprintf(stdout, "Verify: skipped %s, not in the manifest\n", out->path);
+  else if (entry->hash != xxh64_digest(&out->hash)){
+    fprintf(stdout, "Verify: MISMATCH on %s\n", out->path);
+    __sync_fetch_and_add(&gMismatched, 1);
+  }
+  else
+    __sync_fetch_and_add(&gVerified, 1);
 }
 
 /* Callbacks ========================================================= */
+static void headercb(void* data, size_t data_len, void *arg){
+  outfile_t *out = (outfile_t*) arg;
+  size_t filelen;
+
+  if (out->fd < 0 || gfc_get_status(out->gfr) != GF_OK || 0 == (filelen = gfc_get_filelen(out->gfr)))
+    return;
+
+  /* Reserve the whole file up front so it is laid out contiguously */
+  if (0 != posix_fallocate(out->fd, 0, filelen))
+    fprintf(stderr, "Unable to preallocate %zu bytes\n", filelen);
+
+  out->buffer_size = filelen < WRITE_CHUNK ? filelen : WRITE_CHUNK;
+  if( NULL == (out->buffer = malloc(out->buffer_size))){
+    perror("Unable to allocate write buffer");
+    exit(EXIT_FAILURE);
+  }
+}
+
 static void writecb(void* data, size_t data_len, void *arg){
-  FILE *file = (FILE*) arg;
+  outfile_t *out = (outfile_t*) arg;
+  size_t len;
+
+  if (gSink == SINK_VERIFY)
+    xxh64_update(&out->hash, data, data_len);
+  if (out->fd < 0)
+    return;
+
+  /* Stage small pieces and write whole chunks, large pieces go straight out */
+  while(data_len > 0){
+    if (0 == out->buffered && data_len >= out->buffer_size){
+      writeFile(out, data, data_len);
+      return;
+    }
+
+    len = out->buffer_size - out->buffered;
+    len = data_len < len ? data_len : len;
+    memcpy(out->buffer + out->buffered, data, len);
+    out->buffered += len;
+    data = (char*) data + len;
+    data_len -= len;
 
-  fwrite(data, 1, data_len, file);
+    if (out->buffered == out->buffer_size){
+      writeFile(out, out->buffer, out->buffered);
+      out->buffered = 0;
+    }
+  }
 }
 
 /* Main ========================================================= */
@@ -94,13 +297,20 @@ int main(int argc, char **argv) {
   char *server = "localhost";
   unsigned short port = 8888;
   char *workload_path = "workload.txt";
+  char *encodings = NULL;
+  char *replica = NULL;
+  char *colon;
+  char *cache_dir = NULL;
+  char *distribution = "seq";
+  unsigned short replica_port = 0;
+  int deadline = 0;
   int i;
   int option_char = 0;
   int nrequests = 1;
   int nthreads = 1;
 
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "s:p:w:n:t:h", gLongOptions, NULL)) != -1) {
+  while ((option_char = getopt_long(argc, argv, "s:p:w:n:t:e:d:r:c:D:o:h", gLongOptions, NULL)) != -1) {
     switch (option_char) {
       case 's': // server
         server = optarg;
@@ -117,6 +327,37 @@ int main(int argc, char **argv) {
       case 't': // nthreads
         nthreads = atoi(optarg);
         break;
+      case 'e': // encodings
+        encodings = optarg;
+        break;
+      case 'd': // deadline
+        deadline = atoi(optarg);
+        break;
+      case 'r': // replica
+        replica = optarg;
+        if (NULL != (colon = strchr(replica, ':')) && colon == strrchr(replica, ':')){
+          *colon = '\0';
+          replica_port = atoi(colon + 1);
+        }
+        break;
+      case 'c': // cache
+        cache_dir = optarg;
+        break;
+      case 'D': // distribution
+        distribution = optarg;
+        break;
+      case 'o': // output
+        if (0 == strcmp(optarg, "discard"))
+          gSink = SINK_DISCARD;
+        else if (0 == strncmp(optarg, "verify:", 7)){
+          gSink = SINK_VERIFY;
+          loadManifest(optarg + 7);
+        }
+        else if (0 != strcmp(optarg, "file")){
+          Usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
       case 'h': // help
         Usage();
         exit(EXIT_SUCCESS);
@@ -127,14 +368,23 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (replica_port == 0)
+    replica_port = port;
+
   if (EXIT_SUCCESS != workload_init(workload_path)){
     fprintf(stderr, "Unable to load workload file %s.\n", workload_path);
     exit(EXIT_FAILURE);
   }
+  if (0 > workload_set_distribution(distribution)){
+    fprintf(stderr, "Unknown distribution %s.\n", distribution);
+    exit(EXIT_FAILURE);
+  }
 
   // define pthreads and other globals
   pthread_t thread[nthreads];
   gfc_global_init();
+  if (NULL != cache_dir && 0 > gfc_global_set_cache(cache_dir, CACHE_MEM))
+    exit(EXIT_FAILURE);
 
   /*Making the requests...*/
   fprintf(stdout, "Creating %d threads with %d requests.\n", nthreads, nrequests);
@@ -145,6 +395,10 @@ int main(int argc, char **argv) {
       req->portno = port;
       req->num_requests = nrequests;
       req->path = workload_get_path();
+      req->encodings = encodings;
+      req->deadline = deadline;
+      req->replica = replica;
+      req->replica_port = replica_port;
 
       // create pthread
       if (pthread_create(&(thread[i]), NULL, (void *)connection_handler, req) < 0)
@@ -158,6 +412,11 @@ int main(int argc, char **argv) {
   // clean up and exit
   fprintf(stdout, "All threads and requests complete.\n");
   gfc_global_cleanup();
+  if (gSink == SINK_VERIFY) {
+    fprintf(stdout, "Verified %lu bodies, %lu mismatched\n", gVerified, gMismatched);
+    if (gMismatched > 0)
+      return EXIT_FAILURE;
+  }
   return EXIT_SUCCESS;
 }
 
@@ -171,7 +430,7 @@ void *connection_handler(request_params *req) {
     // initialize all local variables needed
     int i;
     char local_path[512];
-    FILE *file;
+    outfile_t file;
     gfcrequest_t *gfr;
     int returncode = -1;
 
@@ -185,32 +444,40 @@ void *connection_handler(request_params *req) {
 
         // get file informaiton and open
         localPath(req->path, local_path);
-        file = openFile(local_path);
+        openFile(local_path, &file);
+        file.path = req->path;
 
         // set request params to client request structure
         gfr = gfc_create();
         gfc_set_server(gfr, req->server);
         gfc_set_path(gfr, req->path);
         gfc_set_port(gfr, req->portno);
+        gfc_set_headerfunc(gfr, headercb);
+        gfc_set_headerarg(gfr, &file);
         gfc_set_writefunc(gfr, writecb);
-        gfc_set_writearg(gfr, file);
+        gfc_set_writearg(gfr, &file);
+        file.gfr = gfr;
+        gfc_set_accept_encoding(gfr, req->encodings);
+        gfc_set_timeouts(gfr, req->deadline, req->deadline);
+        gfc_set_hedge(gfr, req->replica, req->replica_port);
 
         // initiate structure and begin receiving file
         fprintf(stdout, "Requesting %s%s\n", req->server, req->path);
-        if ((returncode = gfc_perform(gfr) < 0)) {
+        if ((returncode = gfc_perform(gfr)) < 0)
           fprintf(stdout, "gfc_perform returned an error %d\n", returncode);
-          fclose(file);
-          if ( 0 > unlink(local_path))
-            fprintf(stderr, "unlink failed on %s\n", local_path);
-        }
-        else
-            fclose(file);
+        closeFile(&file);
 
         // if request didnt' complete successfully unlink file
-        if ( gfc_get_status(gfr) != GF_OK) {
-          if ( 0 > unlink(local_path))
-            fprintf(stderr, "unlink failed on %s\n", local_path);
+        if (gSink == SINK_FILE) {
+          if (returncode < 0 || gfc_get_status(gfr) != GF_OK) {
+            if ( 0 > unlink(local_path))
+              fprintf(stderr, "unlink failed on %s\n", local_path);
+          }
+          else if (gfc_get_encoding(gfr) != NULL)
+            encodedPath(local_path, gfc_get_encoding(gfr));
         }
+        else if (gSink == SINK_VERIFY && returncode >= 0 && gfc_get_status(gfr) == GF_OK)
+          verifyBody(&file);
 
         fprintf(stdout, "Status: %s\n", gfc_strstatus(gfc_get_status(gfr)));
         fprintf(stdout, "Received %zu of %zu bytes\n", gfc_get_bytesreceived(gfr), gfc_get_filelen(gfr));
@@ -7,17 +7,45 @@
  * protocol.
  */
 
+#include <stdint.h>
+
 #define MAX_REQUEST_LEN 128
+#define MAX_TAG_LEN 32
+#define MAX_ENCODING_LEN 32
 
 typedef int gfstatus_t;
 
 #define  GF_OK 200
+#define  GF_NOT_MODIFIED 304
 #define  GF_FILE_NOT_FOUND 400
 #define  GF_ERROR 500
 
 typedef struct gfserver_t gfserver_t;
 typedef struct gfcontext_t gfcontext_t;
 
+/*
+ * One request in the access log.  The file starts with the 8 bytes of
+ * GFS_ACCESS_MAGIC and the record size as a 32-bit integer, padded to 16
+ * bytes, followed by the records in native byte order.  Times after
+ * accepted are microseconds after it, or GFS_ACCESS_NONE if the request
+ * never got that far.
+ */
+#define GFS_ACCESS_MAGIC "GFACC001"
+#define GFS_ACCESS_HEADER_LEN 16
+#define GFS_ACCESS_NONE 0xffffffffu
+
+typedef struct gfs_access_record_t {
+	uint64_t accepted;	/* ns since the epoch the request became readable */
+	uint32_t parsed;	/* request line parsed */
+	uint32_t handler;	/* handler called */
+	uint32_t header;	/* header sent */
+	uint32_t done;		/* last byte sent, or the connection aborted */
+	uint64_t bytes;		/* body bytes sent */
+	int32_t status;		/* status sent, 0 if none was */
+	uint32_t aborted;
+	char path[MAX_REQUEST_LEN];
+} gfs_access_record_t;
+
 /* 
  * This function must be the first one called as part of 
  * setting up a server.  It returns a gfserver_t handle which should be
@@ -39,6 +67,38 @@ void gfserver_set_port(gfserver_t *gfs, unsigned short port);
 void gfserver_set_maxpending(gfserver_t *gfs, int max_npending);
 
 
+/*
+ * Sets how many seconds a connection may stay open waiting for the next
+ * request when the client asks for keep-alive (Default: 30).  Zero
+ * disables keep-alive, so every connection is closed after one response.
+ */
+void gfserver_set_idletimeout(gfserver_t *gfs, int idle_timeout);
+
+/*
+ * Sets the lease, in seconds, granted with every response that carries a
+ * content tag (the LEASE= option of OK and NOT_MODIFIED responses).  A
+ * client cache may serve its copy without asking again until the lease
+ * ends, so content changed on the server can be seen that much later.
+ * Zero, the default, grants no leases.
+ */
+void gfserver_set_lease(gfserver_t *gfs, int lease);
+
+/*
+ * Appends a gfs_access_record_t for every request to the file at path,
+ * creating it if needed.  Records are gathered per thread and written
+ * in batches, and at least once a second, so a server that is killed
+ * loses at most the last second.  Returns -1 if the file can't be
+ * opened.
+ */
+int gfserver_set_accesslog(gfserver_t *gfs, const char *path);
+
+/*
+ * Publishes live request counters and latencies in a shared memory
+ * segment listed under program, where gfstat can read them without
+ * disturbing the server.  Returns -1 if the segment can't be created.
+ */
+int gfserver_set_stats(gfserver_t *gfs, const char *program);
+
 /*
  * Sets the handler callback, a function that will be called for each each
  * request.  As arguments, the receives 
@@ -64,6 +124,8 @@ void gfserver_serve(gfserver_t *gfs);
  * Sends to the client the Getfile header containing the appropriate 
  * status and file length for the given inputs.  This function should
  * only be called from within a callback registered gfserver_set_handler.
+ * A response without a body is finished by this call, and its connection
+ * is aborted if the header can't be sent.
  */
 ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len);
 
@@ -71,10 +133,42 @@ ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len);
  * Sends size bytes starting at the pointer data to the client 
  * This function should only be called from within a callback registered 
  * with gfserver_set_handler.  It returns once the data has been
- * sent.
+ * sent.  Once the last byte announced by gfs_sendheader has been sent
+ * the response is complete and ctx must not be used again, since a
+ * keep-alive connection may already be serving the next request.
  */
 ssize_t gfs_send(gfcontext_t *ctx, void *data, size_t size);
 
+/*
+ * Returns the validator tag the client sent with its request (the TAG=
+ * option), or NULL if the request was unconditional.  A handler that
+ * finds this equal to the current tag of the content should reply with
+ * GF_NOT_MODIFIED and no body.
+ */
+char* gfs_get_tag(gfcontext_t *ctx);
+
+/*
+ * Sets the validator tag of the content being sent.  It is included in
+ * the header of a subsequent GF_OK response so the client can send it
+ * back on its next request.
+ */
+void gfs_set_tag(gfcontext_t *ctx, const char *tag);
+
+/*
+ * Returns the comma separated list of content encodings the client can
+ * decode (the ENC= option, e.g. "zstd,gzip"), or NULL if the client
+ * only accepts the file as is.
+ */
+char* gfs_get_accept_encoding(gfcontext_t *ctx);
+
+/*
+ * Sets the encoding of the body being sent.  It is included in the
+ * header of a subsequent GF_OK response; the file length in that header
+ * is the length of the encoded body.  Only pick an encoding listed by
+ * gfs_get_accept_encoding.
+ */
+void gfs_set_encoding(gfcontext_t *ctx, const char *encoding);
+
 /*
  * Aborts the connection to the client associated with the input
  * gfcontext_t.
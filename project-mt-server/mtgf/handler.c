@@ -9,6 +9,8 @@
 #include "gfserver.h"
 #include "content.h"
 #include "steque.h"
+#include "log.h"
+#include "probe.h"
 
 #define BUFFER_SIZE 4096
 
@@ -76,6 +78,7 @@ void *context_handler(int thread_num) {
 	ssize_t file_len;
 	ssize_t read_len, write_len;
 	char buffer[BUFFER_SIZE];
+	const char *tag, *encoding;
 	thread_context_t *context = NULL;
 
 	while (1) {
@@ -92,13 +95,25 @@ void *context_handler(int thread_num) {
             if (context == NULL)
                 continue;
 		}
+		PROBE(mtgf, context_dequeued, context->ctx, thread_num);
 
 		/*Send header to the client*/
-		if( 0 > (fildes = content_get(context->path))) {
+		if( 0 > (fildes = content_get_encoded(context->path,
+				gfs_get_accept_encoding(context->ctx), &encoding))) {
 			gfs_sendheader(context->ctx, GF_FILE_NOT_FOUND, 0);
             exit(EXIT_FAILURE);
         }
 
+		/*Client already holds this exact content, skip the body*/
+		tag = content_get_tag(context->path);
+		if (tag != NULL && gfs_get_tag(context->ctx) != NULL &&
+				0 == strcmp(tag, gfs_get_tag(context->ctx))) {
+			gfs_sendheader(context->ctx, GF_NOT_MODIFIED, 0);
+			continue;
+		}
+		gfs_set_tag(context->ctx, tag);
+		gfs_set_encoding(context->ctx, encoding);
+
 		/* Calculating the file size */
 		file_len = lseek(fildes, 0, SEEK_END);
 
@@ -109,14 +124,14 @@ void *context_handler(int thread_num) {
 		while(context->bytes_transferred < file_len) {
 			read_len = pread(fildes, buffer, BUFFER_SIZE, context->bytes_transferred);
 			if (read_len <= 0) {
-				fprintf(stderr, "handle_with_file read error, %zd, %zu, %zu", read_len,
+				L(GFLOG_ERROR, "handle_with_file read error, %zd, %zu, %zu", read_len,
 						context->bytes_transferred, file_len );
 				gfs_abort(context->ctx);
 				exit(EXIT_FAILURE);
 			}
 			write_len = gfs_send(context->ctx, buffer, read_len);
 			if (write_len != read_len) {
-				fprintf(stderr, "handle_with_file write error");
+				L(GFLOG_ERROR, "handle_with_file write error");
 				gfs_abort(context->ctx);
 				exit(EXIT_FAILURE);
 			}
@@ -1,20 +1,41 @@
 #ifndef __LOG_H__
 #define __LOG_H__
 
-#include <stdio.h>
+/*
+ * Asynchronous logging.  L() formats a message into a fixed-size record
+ * in a ring owned by the calling thread, taking no lock and making no
+ * system call, and a background thread drains the rings and writes the
+ * records out.  When a ring is full the message is dropped and counted
+ * rather than making the caller wait.  Messages less important than
+ * MYLOG_PRIORITY compile to nothing, so build with e.g.
+ * -DMYLOG_PRIORITY=GFLOG_DEBUG to see them.
+ */
 
-#define ERROR 1
-#define WARN  2
-#define INFO 3
-#define DEBUG 4
-#define TRACE 5
+#define GFLOG_ERROR 1
+#define GFLOG_WARN 2
+#define GFLOG_INFO 3
+#define GFLOG_DEBUG 4
+#define GFLOG_TRACE 5
 
 #ifndef MYLOG_PRIORITY
 #define MYLOG_PRIORITY 1
 #endif 
 
-#define MYLOG_FILE stderr
+/* File descriptor the records are written to */
+#define MYLOG_FILE 2
 
-#define L(priority,format,a...) if(priority <= MYLOG_PRIORITY) fprintf(MYLOG_FILE, format "\n", ## a);
+/*
+ * Queues one message, without a trailing newline, for the log.  Use L()
+ * rather than calling this directly.
+ */
+void log_write(int priority, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/*
+ * Writes out every queued message before returning.  Called at exit, and
+ * useful before a crash or _exit would lose what is queued.
+ */
+void log_flush();
+
+#define L(priority,format,a...) do { if ((priority) <= MYLOG_PRIORITY) log_write(priority, format, ## a); } while (0)
 
 #endif 
@@ -1,53 +1,277 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <math.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "workload.h"
 
-static char *gWorkloadPathArray[100];
-static unsigned short int gUniqueWorkloadPaths = 0;
+/*
+ * The workload file is mapped privately and each path is terminated in
+ * place, so a path is just its offset into the map.  Times are only kept
+ * when the file has any.
+ */
+static char *gWorkloadMap = NULL;
+static size_t gWorkloadMapSize = 0;
+static uint32_t *gWorkloadOffsets = NULL;
+static double *gWorkloadTimes = NULL;
+static unsigned int gUniqueWorkloadPaths = 0;
 
-static pthread_mutex_t counter_mutex;
-static int counter = 0;
 static int mode = WORKLOAD_SEQ;
+static unsigned int seed = 1;
+
+/* Threads are numbered in the order they first ask for a path */
+static unsigned int thread_count = 0;
+
+/* Position in the trace, shared so each line is replayed once */
+static unsigned long trace_cursor = 0;
+
+/* Zipf exponent and the constants of its sampler */
+static double zipf_s = 1.0;
+static double zipf_h_x1, zipf_h_n, zipf_cutoff;
+
+/* Per thread cursor and random generator, so choosing a path takes no lock */
+typedef struct workload_thread_t {
+  int initialized;
+  unsigned long cursor;
+  unsigned short xsubi[3];
+} workload_thread_t;
+
+static __thread workload_thread_t self;
+
+static workload_thread_t* workloadThread(){
+  unsigned int index;
+
+  if (!self.initialized){
+    index = __sync_fetch_and_add(&thread_count, 1);
+    self.cursor = index;
+    self.xsubi[0] = 0x330e;
+    self.xsubi[1] = (unsigned short) (seed ^ (index * 0x9e37));
+    self.xsubi[2] = (unsigned short) ((seed >> 16) + index);
+    self.initialized = 1;
+  }
+  return &self;
+}
+
+/*
+ * Zipf sampling by rejection-inversion (Hormann and Derflinger), which
+ * needs constant memory and time however many paths there are.
+ */
+static double zipfHelper1(double x){
+  return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - x * 0.25));
+}
+
+static double zipfHelper2(double x){
+  return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x * (1.0 / 3) * (1 + x * 0.25));
+}
+
+static double zipfH(double x){
+  return exp(-zipf_s * log(x));
+}
+
+static double zipfHIntegral(double x){
+  double log_x = log(x);
+
+  return zipfHelper2((1 - zipf_s) * log_x) * log_x;
+}
+
+static double zipfHIntegralInverse(double x){
+  double t = x * (1 - zipf_s);
+
+  if (t < -1)
+    t = -1;
+  return exp(zipfHelper1(t) * x);
+}
+
+static void zipfSetup(){
+  zipf_h_x1 = zipfHIntegral(1.5) - 1;
+  zipf_h_n = zipfHIntegral(gUniqueWorkloadPaths + 0.5);
+  zipf_cutoff = 2 - zipfHIntegralInverse(zipfHIntegral(2.5) - zipfH(2));
+}
+
+/* Returns a rank from 1 to the number of paths */
+static unsigned int zipfSample(unsigned short *xsubi){
+  double u, x;
+  unsigned int k;
+
+  for (;;){
+    u = zipf_h_n + erand48(xsubi) * (zipf_h_x1 - zipf_h_n);
+    x = zipfHIntegralInverse(u);
+    k = x + 0.5 < 1 ? 1 : x + 0.5 > gUniqueWorkloadPaths ? gUniqueWorkloadPaths : (unsigned int) (x + 0.5);
+    if (k - x <= zipf_cutoff || u >= zipfHIntegral(k + 0.5) - zipfH(k))
+      return k;
+  }
+}
+
+static char* workloadPath(unsigned int index){
+  return gWorkloadMap + gWorkloadOffsets[index];
+}
+
+/* Maps the file with one zeroed byte past its end, so the last path is always terminated */
+static int workloadMap(char *workload_path){
+  struct stat st;
+  int fd;
+
+  if (0 > (fd = open(workload_path, O_RDONLY)) || 0 > fstat(fd, &st)) {
+    fprintf(stderr, "cannot open workload file %s\n", workload_path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  if (st.st_size >= UINT32_MAX) {
+    fprintf(stderr, "workload file %s is larger than 4 GiB\n", workload_path);
+    close(fd);
+    return -1;
+  }
+
+  gWorkloadMapSize = st.st_size + 1;
+  gWorkloadMap = mmap(NULL, gWorkloadMapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (gWorkloadMap == MAP_FAILED || (st.st_size > 0 &&
+      MAP_FAILED == mmap(gWorkloadMap, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0))) {
+    fprintf(stderr, "cannot map workload file %s\n", workload_path);
+    if (gWorkloadMap != MAP_FAILED)
+      munmap(gWorkloadMap, gWorkloadMapSize);
+    gWorkloadMap = NULL;
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  madvise(gWorkloadMap, st.st_size, MADV_SEQUENTIAL);
+  return 0;
+}
 
 int workload_init(char *workload_path) {
-  int i = 0;
-  char temp_buf[256];
+  size_t capacity = 0;
+  unsigned int i;
+  char *line, *eol, *end, *path, *next;
+  double at, last = 0;
+  int timed;
+
+  if (0 > workloadMap(workload_path))
+    return EXIT_FAILURE;
+
+  end = gWorkloadMap + gWorkloadMapSize - 1;
+  for (line = gWorkloadMap; line < end; line = eol + 1) {
+    if (NULL == (eol = memchr(line, '\n', end - line)))
+      eol = end;
+
+    /* "<path>" or "<seconds> <path>" */
+    for (path = line; path < eol && isspace((unsigned char) *path); path++)
+      ;
+    if (path == eol)
+      continue;
+
+    timed = 0;
+    if (isdigit((unsigned char) *path)) {
+      at = strtod(path, &next);
+      if (next < eol && isblank((unsigned char) *next)) {
+        for (path = next; path < eol && isblank((unsigned char) *path); path++)
+          ;
+        if (path == eol || isspace((unsigned char) *path))
+          continue;
+        timed = 1;
+      }
+    }
+    for (next = path; next < eol && !isspace((unsigned char) *next); next++)
+      ;
+    *next = '\0';
+    last = timed ? at : last + 0.001;
 
-  FILE *file_handle;
+    if (gUniqueWorkloadPaths == capacity) {
+      capacity = capacity ? capacity * 2 : 4096;
+      gWorkloadOffsets = realloc(gWorkloadOffsets, capacity * sizeof(uint32_t));
+      if (gWorkloadTimes != NULL)
+        gWorkloadTimes = realloc(gWorkloadTimes, capacity * sizeof(double));
+    }
+    if (timed && gWorkloadTimes == NULL) {
+      gWorkloadTimes = malloc(capacity * sizeof(double));
+      for (i = 0; i < gUniqueWorkloadPaths; i++)
+        gWorkloadTimes[i] = (i + 1) * 0.001;
+    }
 
-  file_handle = fopen(workload_path, "r");
-  if (file_handle == NULL) {
-    fprintf(stderr, "cannot open workload file %s", workload_path);
+    gWorkloadOffsets[gUniqueWorkloadPaths] = path - gWorkloadMap;
+    if (gWorkloadTimes != NULL)
+      gWorkloadTimes[gUniqueWorkloadPaths] = last;
+    gUniqueWorkloadPaths++;
+  }
+
+  if (gUniqueWorkloadPaths == 0) {
+    fprintf(stderr, "workload file %s holds no paths\n", workload_path);
     return EXIT_FAILURE;
   }
+  zipfSetup();
 
-  while (fscanf(file_handle, "%s", temp_buf) != EOF)
-    gWorkloadPathArray[i++] = strdup(temp_buf);
+  return EXIT_SUCCESS;
+}
 
-  gUniqueWorkloadPaths = i;
+int workload_set_mode(int new_mode){
+  if (new_mode < WORKLOAD_SEQ || new_mode > WORKLOAD_TRACE)
+    return -1;
 
-  pthread_mutex_init(&counter_mutex, NULL);
+  mode = new_mode;
+  return 0;
+}
 
-  fclose(file_handle);
+int workload_set_zipf(double s){
+  if (s <= 0)
+    return -1;
 
-  return EXIT_SUCCESS;
+  zipf_s = s;
+  if (gUniqueWorkloadPaths > 0)
+    zipfSetup();
+  return 0;
+}
+
+int workload_set_distribution(char *spec){
+  if (0 == strcmp(spec, "seq"))
+    return workload_set_mode(WORKLOAD_SEQ);
+  if (0 == strcmp(spec, "random"))
+    return workload_set_mode(WORKLOAD_RND);
+  if (0 == strcmp(spec, "trace"))
+    return workload_set_mode(WORKLOAD_TRACE);
+  if (0 == strcmp(spec, "zipf"))
+    return workload_set_mode(WORKLOAD_ZIPF);
+  if (0 == strncmp(spec, "zipf:", 5) && 0 == workload_set_zipf(atof(spec + 5)))
+    return workload_set_mode(WORKLOAD_ZIPF);
+  return -1;
+}
+
+void workload_set_seed(unsigned int new_seed){
+  seed = new_seed;
 }
 
-unsigned short int workload_num_unique_paths(){
+unsigned int workload_num_unique_paths(){
   return gUniqueWorkloadPaths;
 }
 
 char* workload_get_path(){
-  if(mode == WORKLOAD_RND)
-    return gWorkloadPathArray[(int)(1.0 * gUniqueWorkloadPaths * rand()/(RAND_MAX+1.0))];
+  workload_thread_t *thread = workloadThread();
 
-  pthread_mutex_lock(&counter_mutex);
-  counter++;
-  pthread_mutex_unlock(&counter_mutex);
+  switch (mode){
+    case WORKLOAD_RND:
+      return workloadPath((unsigned int) (erand48(thread->xsubi) * gUniqueWorkloadPaths));
+    case WORKLOAD_ZIPF:
+      return workloadPath(zipfSample(thread->xsubi) - 1);
+    case WORKLOAD_TRACE:
+      return workloadPath(__sync_fetch_and_add(&trace_cursor, 1) % gUniqueWorkloadPaths);
+    default:
+      return workloadPath(thread->cursor++ % gUniqueWorkloadPaths);
+  }
+}
+
+char* workload_next_trace(double *at){
+  unsigned long index = __sync_fetch_and_add(&trace_cursor, 1);
 
-  return gWorkloadPathArray[counter % gUniqueWorkloadPaths];
+  if (index >= gUniqueWorkloadPaths)
+    return NULL;
 
-}
\ No newline at end of file
+  *at = gWorkloadTimes != NULL ? gWorkloadTimes[index] : (index + 1) * 0.001;
+  return workloadPath(index);
+}
@@ -0,0 +1,52 @@
+#ifndef __XXHASH_H__
+#define __XXHASH_H__
+
+/*
+ * Minimal implementation of the 64-bit xxHash (XXH64) algorithm.  The
+ * output matches the reference implementation, so tags computed here
+ * can be checked with any other xxHash tool.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Number of hex characters needed to print a 64-bit hash */
+#define XXH64_HEX_LEN 16
+
+/* state for hashing data that arrives in pieces */
+typedef struct xxh64_state_t {
+    uint64_t total_len;
+    uint64_t v[4];
+    unsigned char mem[32];
+    size_t memsize;
+    uint64_t seed;
+} xxh64_state_t;
+
+/*
+ * Returns the hash of len bytes starting at data.
+ */
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+/*
+ * Resets the state so a new hash can be computed with xxh64_update.
+ */
+void xxh64_reset(xxh64_state_t *state, uint64_t seed);
+
+/*
+ * Adds len bytes starting at data to the running hash.
+ */
+void xxh64_update(xxh64_state_t *state, const void *data, size_t len);
+
+/*
+ * Returns the hash of all data passed to xxh64_update so far.  The state
+ * is not modified and may continue to be updated.
+ */
+uint64_t xxh64_digest(const xxh64_state_t *state);
+
+/*
+ * Writes the hash as XXH64_HEX_LEN lowercase hex characters followed by
+ * a terminating null into hex.
+ */
+void xxh64_tohex(uint64_t hash, char *hex);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+/*
+ * Latency histogram in the style of HdrHistogram.  Buckets are exact up
+ * to 128 and then grow with the value, 64 per power of two, so every
+ * recorded value is kept to within 1.6% while values up to 2^46 (about
+ * 800 days in microseconds) fit in a fixed array of counters.  Recording
+ * is a few instructions and histograms from several threads or
+ * processes can be merged by adding their counters.
+ */
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_BUCKETS ((1 << HISTOGRAM_SUB_BITS) + 40 * (1 << (HISTOGRAM_SUB_BITS - 1)))
+
+typedef struct histogram_t {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    int64_t min;
+    int64_t max;
+    double sum;
+} histogram_t;
+
+/*
+ * Clears all recorded values.
+ */
+void histogram_reset(histogram_t *h);
+
+/*
+ * Records one value.  Negative values are recorded as zero.
+ */
+void histogram_record(histogram_t *h, int64_t value);
+
+/*
+ * Adds all values recorded in from to into.
+ */
+void histogram_merge(histogram_t *into, const histogram_t *from);
+
+/*
+ * Returns the value below which the given percentage (0 to 100) of the
+ * recorded values fall, or 0 if nothing was recorded.
+ */
+int64_t histogram_percentile(const histogram_t *h, double percentile);
+
+/*
+ * Returns the mean of the recorded values, or 0 if nothing was recorded.
+ */
+double histogram_mean(const histogram_t *h);
+
+#endif
@@ -1,14 +1,36 @@
 #include <stdio.h>
+#include <time.h>
 #include "minifyjpeg.h"
 #include "magickminify.h"
+#include "probe.h"
+#include "stats.h"
+
+// counters published for gfstat
+#define STAT_REQUESTS 0
+#define STAT_BYTES_IN 1
+#define STAT_BYTES_OUT 2
+
+static const char *stat_names[] = {"requests", "bytes_in", "bytes_out"};
 
 /* Implement the needed server-side functions here */
 
+/**
+ * Publishes statistics before the generated main starts serving
+ */
+static void __attribute__((constructor)) minify_stats_init() {
+    if (stats_init("minifyjpeg_svc", stat_names, sizeof(stat_names) / sizeof(stat_names[0])) < 0)
+        perror("Unable to publish statistics");
+}
+
 /**
  * Method used to minify a requested image
  */
 bool_t minify_image_1_svc(image source, image *result, struct svc_req *request) {
     ssize_t result_len;
+    struct timespec started, finished;
+
+    PROBE(minify, minify_begin, source.buffer.buffer_len);
+    clock_gettime(CLOCK_MONOTONIC, &started);
 
     // initialize magic minfiy library
     magickminify_init();
@@ -21,6 +43,13 @@ bool_t minify_image_1_svc(image source, image *result, struct svc_req *request)
     // assign the result length
     result->buffer.buffer_len = (u_int) result_len;
     printf("Minify process complete\n");
+    PROBE(minify, minify_end, source.buffer.buffer_len, result_len);
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    stats_add(STAT_REQUESTS, 1);
+    stats_add(STAT_BYTES_IN, source.buffer.buffer_len);
+    stats_add(STAT_BYTES_OUT, result_len);
+    stats_latency((finished.tv_sec - started.tv_sec) * 1000000LL + (finished.tv_nsec - started.tv_nsec) / 1000);
 
     return 1;
 }
@@ -0,0 +1,140 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+
+static stats_region_t *region = NULL;
+static char region_name[STATS_NAME_LEN + 32];
+
+// this thread's slot, NULL until it first records
+static __thread stats_slot_t *slot = NULL;
+static __thread int slot_shared = 0;
+
+static void stats_unlink() {
+    shm_unlink(region_name);
+}
+
+/*
+ * Returns the calling thread's slot, claiming one the first time.
+ */
+static stats_slot_t *stats_slot() {
+    uint32_t index;
+
+    if (slot == NULL) {
+        index = __atomic_fetch_add(&region->nslots, 1, __ATOMIC_RELAXED);
+        slot_shared = index >= STATS_MAX_THREADS - 1;
+        slot = &region->slots[slot_shared ? STATS_MAX_THREADS - 1 : index];
+    }
+    return slot;
+}
+
+/**
+ * Creates the shared memory segment of this process.
+ * @param program - name the segment is listed under
+ * @param counters - names of the counters
+ * @param ncounters - number of counters, at most STATS_MAX_COUNTERS
+ * @return 0, or -1 if the segment could not be created
+ */
+int stats_init(const char *program, const char **counters, int ncounters) {
+    struct timespec ts;
+    stats_region_t *mapped;
+    int fd, i;
+
+    if (region != NULL || ncounters > STATS_MAX_COUNTERS)
+        return -1;
+
+    snprintf(region_name, sizeof(region_name), "/" STATS_PREFIX "%.31s.%d", program, (int) getpid());
+    if ((fd = shm_open(region_name, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0)
+        return -1;
+    if (ftruncate(fd, sizeof(stats_region_t)) < 0 ||
+            MAP_FAILED == (mapped = mmap(NULL, sizeof(stats_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0))) {
+        close(fd);
+        shm_unlink(region_name);
+        return -1;
+    }
+    close(fd);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    mapped->region_size = sizeof(stats_region_t);
+    mapped->ncounters = ncounters;
+    mapped->pid = getpid();
+    mapped->started = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    strncpy(mapped->program, program, STATS_NAME_LEN - 1);
+    for (i = 0; i < ncounters; i++)
+        strncpy(mapped->counters[i], counters[i], STATS_NAME_LEN - 1);
+
+    // a reader trusts the header once it sees the magic
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(mapped->magic, STATS_MAGIC, sizeof(mapped->magic));
+
+    region = mapped;
+    atexit(stats_unlink);
+    return 0;
+}
+
+/**
+ * Adds to a counter of the calling thread.
+ * @param counter - index of the counter
+ * @param n - amount to add
+ */
+void stats_add(int counter, uint64_t n) {
+    stats_slot_t *s;
+
+    if (region == NULL)
+        return;
+
+    // a slot of its own has one writer, so the add needs no lock prefix
+    s = stats_slot();
+    if (slot_shared)
+        __atomic_fetch_add(&s->counters[counter], n, __ATOMIC_RELAXED);
+    else
+        __atomic_store_n(&s->counters[counter], s->counters[counter] + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Records a latency for the calling thread.
+ * @param usec - latency in microseconds
+ */
+void stats_latency(int64_t usec) {
+    stats_slot_t *s;
+    uint64_t seq;
+
+    if (region == NULL || (s = stats_slot(), slot_shared))
+        return;
+
+    // odd while the histogram is being changed
+    seq = s->seq;
+    __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    histogram_record(&s->latency, usec);
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Takes a consistent copy of a slot written by another process.
+ * @param slot - slot in a mapped segment
+ * @param copy - where the copy goes
+ */
+void stats_read_slot(const stats_slot_t *slot, stats_slot_t *copy) {
+    uint64_t before, after;
+    int tries;
+
+    for (tries = 0; tries < 1000; tries++) {
+        before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (before & 1)
+            continue;
+        memcpy(copy, slot, sizeof(stats_slot_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        if (before == after)
+            return;
+    }
+
+    // the owner died while writing, this copy is as good as it gets
+    memcpy(copy, slot, sizeof(stats_slot_t));
+}